@@ -0,0 +1,160 @@
+#include "batch.h"
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <thread>
+#include <QDir>
+#include <QFileInfo>
+#include <QStringList>
+#include "tiledimage.h"
+
+static int64_t elapsedNanoseconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+BatchProcessor::Stage::Stage(const char *name, int threads) : name(name), threads(threads), images(0), failures(0), pixels(0), busyNanoseconds(0) {}
+
+void BatchProcessor::Stage::record(const QImage &image, int64_t nanoseconds) {
+    images++;
+    pixels += uint64_t(image.width()) * image.height();
+    busyNanoseconds += nanoseconds;
+}
+
+BatchProcessor::BatchProcessor(const FilterGraph &graph, FilterGraph::Node output, int decoders, int filterWorkers, int encoders, std::size_t queueCapacity)
+    : graph(graph), output(output), decoders(std::max(decoders, 1)), filterWorkers(std::max(filterWorkers, 1)), encoders(std::max(encoders, 1)), queueCapacity(queueCapacity),
+      decode("decode", this->decoders), filter("filter", this->filterWorkers), encode("encode", this->encoders), rawOutput(false), wallSeconds(0) {}
+
+void BatchProcessor::setRawOutput(bool raw) {
+    rawOutput = raw;
+}
+
+std::vector<std::string> BatchProcessor::listInputs(const std::string &path) {
+    std::vector<std::string> inputs;
+    QFileInfo info(QString::fromStdString(path));
+    if (info.isDir()) {
+        QStringList patterns = {"*.png", "*.jpg", "*.jpeg", "*.bmp", "*.ppm", "*.pgm", "*.tif", "*.tiff", "*.tiles"};
+        for (const QFileInfo &file : QDir(info.filePath()).entryInfoList(patterns, QDir::Files, QDir::Name)) {
+            inputs.push_back(file.filePath().toStdString());
+        }
+        return inputs;
+    }
+
+    std::ifstream list(path);
+    std::string line;
+    while (std::getline(list, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            inputs.push_back(line);
+        }
+    }
+    return inputs;
+}
+
+int BatchProcessor::run(const std::vector<std::string> &inputs, const std::string &outputDirectory) {
+    QDir().mkpath(QString::fromStdString(outputDirectory));
+    BoundedQueue<Item> decoded(queueCapacity), filtered(queueCapacity);
+    std::atomic<std::size_t> next(0);
+    std::atomic<int> decodersLeft(decoders), filterWorkersLeft(filterWorkers);
+    auto start = std::chrono::steady_clock::now();
+
+    // The last thread of a stage to finish closes the queue after it
+    std::vector<std::thread> threads;
+    for (int i = 0; i < decoders; i++) {
+        threads.emplace_back([&] {
+            for (std::size_t index = next++; index < inputs.size(); index = next++) {
+                auto begin = std::chrono::steady_clock::now();
+                Item item;
+                item.input = inputs[index];
+                QString path = QString::fromStdString(item.input);
+                if (QFileInfo(path).suffix() == "tiles") {
+                    item.image = MappedTiledImage::load(item.input);
+                } else {
+                    item.image.load(path);
+                }
+                if (item.image.isNull()) {
+                    decode.failures++;
+                    std::fprintf(stderr, "Cannot load %s\n", item.input.c_str());
+                    continue;
+                }
+                decode.record(item.image, elapsedNanoseconds(begin));
+                decoded.push(std::move(item));
+            }
+            if (--decodersLeft == 0) {
+                decoded.close();
+            }
+        });
+    }
+    for (int i = 0; i < filterWorkers; i++) {
+        threads.emplace_back([&] {
+            Item item;
+            while (decoded.pop(item)) {
+                auto begin = std::chrono::steady_clock::now();
+                // A filter that throws or gives nothing back fails its image only, the others go on
+                std::string error = "no result";
+                QImage result;
+                try {
+                    result = graph.evaluate(item.image, output);
+                } catch (const std::exception &exception) {
+                    error = exception.what();
+                }
+                if (result.isNull()) {
+                    filter.failures++;
+                    std::fprintf(stderr, "Cannot filter %s: %s\n", item.input.c_str(), error.c_str());
+                    continue;
+                }
+                item.image = std::move(result);
+                filter.record(item.image, elapsedNanoseconds(begin));
+                filtered.push(std::move(item));
+            }
+            if (--filterWorkersLeft == 0) {
+                filtered.close();
+            }
+        });
+    }
+    for (int i = 0; i < encoders; i++) {
+        threads.emplace_back([&] {
+            Item item;
+            while (filtered.pop(item)) {
+                auto begin = std::chrono::steady_clock::now();
+                QFileInfo input(QString::fromStdString(item.input));
+                // Raw inputs are not images Qt can write, their results go to PNG unless raw too
+                QString name = input.fileName();
+                if (rawOutput || input.suffix() == "tiles") {
+                    name = input.completeBaseName() + (rawOutput ? ".tiles" : ".png");
+                }
+                QString path = QDir(QString::fromStdString(outputDirectory)).filePath(name);
+                if (!(rawOutput ? MappedTiledImage::save(path.toStdString(), item.image) : item.image.save(path))) {
+                    encode.failures++;
+                    std::fprintf(stderr, "Cannot save %s\n", path.toStdString().c_str());
+                    continue;
+                }
+                encode.record(item.image, elapsedNanoseconds(begin));
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    wallSeconds = elapsedNanoseconds(start) * 1e-9;
+    return decode.failures + filter.failures + encode.failures;
+}
+
+void BatchProcessor::report(std::ostream &out) const {
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-8s %7s %7s %7s %10s %9s %9s %11s %6s\n", "stage", "threads", "images", "failed", "MPix", "images/s", "MPix/s", "MPix/s/thr", "busy");
+    out << line;
+    for (const Stage *stage : {&decode, &filter, &encode}) {
+        double megapixels = stage->pixels * 1e-6;
+        double busySeconds = stage->busyNanoseconds * 1e-9;
+        std::snprintf(line, sizeof(line), "%-8s %7d %7d %7d %10.1f %9.2f %9.1f %11.1f %5.0f%%\n", stage->name, stage->threads, stage->images.load(), stage->failures.load(), megapixels,
+                      wallSeconds > 0 ? stage->images / wallSeconds : 0., wallSeconds > 0 ? megapixels / wallSeconds : 0., busySeconds > 0 ? megapixels / busySeconds : 0.,
+                      wallSeconds > 0 ? 100 * busySeconds / (stage->threads * wallSeconds) : 0.);
+        out << line;
+    }
+    std::snprintf(line, sizeof(line), "%.2f s wall\n", wallSeconds);
+    out << line;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <QImage>
+#include "filtergraph.h"
+
+// FIFO shared by the threads of two stages. push() blocks while the queue is full, so a slow stage holds
+// the ones before it back instead of letting images pile up.
+template <typename T>
+class BoundedQueue {
+protected:
+    std::deque<T> items;
+    std::size_t capacity;
+    bool closed;
+    std::mutex mutex;
+    std::condition_variable notEmpty, notFull;
+
+public:
+    BoundedQueue(std::size_t capacity) : capacity(std::max<std::size_t>(capacity, 1)), closed(false) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    // False once the queue is closed and drained
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // Called by the last producer, wakes every consumer waiting on an empty queue
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+};
+
+// Runs a filter graph over many files with three overlapped stages: decoder threads load the inputs, filter
+// workers evaluate the graph (each evaluation also uses the ThreadPool when it is free) and encoder threads save
+// the results under the same name in the output directory. At most queueCapacity images wait between two stages,
+// so memory stays bounded by the queues and the images in flight whatever the number of files.
+class BatchProcessor {
+protected:
+    struct Item {
+        std::string input;
+        QImage image;
+    };
+
+    struct Stage {
+        const char *name;
+        int threads;
+        std::atomic<int> images, failures;
+        std::atomic<uint64_t> pixels;
+        // Time spent working, summed over the stage's threads
+        std::atomic<int64_t> busyNanoseconds;
+
+        Stage(const char *name, int threads);
+        void record(const QImage &image, int64_t nanoseconds);
+    };
+
+    const FilterGraph &graph;
+    FilterGraph::Node output;
+    int decoders, filterWorkers, encoders;
+    std::size_t queueCapacity;
+    Stage decode, filter, encode;
+    bool rawOutput;
+    double wallSeconds;
+
+public:
+    BatchProcessor(const FilterGraph &graph, FilterGraph::Node output, int decoders = 2, int filterWorkers = 1, int encoders = 2, std::size_t queueCapacity = 4);
+    // Image files of a directory, or the paths listed one per line in a text file
+    static std::vector<std::string> listInputs(const std::string &path);
+    // Saves the results in the tiled container (.tiles) instead of their own format, which skips encoding them
+    // when they are read back by a later batch, .tiles inputs being mapped rather than decoded
+    void setRawOutput(bool raw);
+    // Returns the number of inputs that could not be loaded, filtered or saved
+    int run(const std::vector<std::string> &inputs, const std::string &outputDirectory);
+    // Per stage: images, megapixels, throughput over the whole run and per busy thread, and how busy the threads were
+    void report(std::ostream &out) const;
+};
@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <QFile>
+#include <QImage>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include "filter.h"
+#include "filtergraph.h"
+#include "filterspec.h"
+#include "stencil.h"
+#include "threadpool.h"
+
+// Benchmark of every filter over synthetic images. Results go out as JSON, which a later run can be
+// compared against:
+//
+//   filters_bench [-s 256,1024,4k] [-f median] [-r 5] [-w 1] [-t threads] [--all-images] [-o results.json]
+//   filters_bench ... --baseline results.json        runs and compares against a stored run
+//   filters_bench --compare old.json new.json         compares two stored runs
+//
+// A case is flagged as a regression when its throughput drops by more than --threshold (10% by default).
+
+enum class Pattern { Noise, Gradient, Mask };
+
+struct BenchCase {
+    // FilterSpec text, chains are evaluated through a FilterGraph
+    const char *spec;
+    Pattern pattern;
+};
+
+// Every filter class at the parameters that pick its different code paths
+static const BenchCase benchCases[] = {
+    {"invert", Pattern::Gradient},
+    {"grayscale", Pattern::Gradient},
+    {"sepia", Pattern::Gradient},
+    {"brightness", Pattern::Gradient},
+    {"basecolor:0.67:0.34:0.18", Pattern::Gradient},
+    {"grayworld", Pattern::Gradient},
+    {"perfectreflector", Pattern::Gradient},
+    {"histogram", Pattern::Gradient},
+    {"blur:1", Pattern::Noise},
+    {"blur:5", Pattern::Noise},
+    {"blur:20", Pattern::Noise},
+    {"gauss:2:1", Pattern::Noise},
+    {"gauss:9:3", Pattern::Noise},
+    {"gauss:30:10", Pattern::Noise},
+    {"gauss:9:3:1", Pattern::Noise},
+    {"gauss:30:10:1", Pattern::Noise},
+    {"sobelx", Pattern::Noise},
+    {"sobely", Pattern::Noise},
+    {"sobel:1", Pattern::Noise},
+    {"sobel:3", Pattern::Noise},
+    {"scharr", Pattern::Noise},
+    {"prewitt", Pattern::Noise},
+    {"sharpness", Pattern::Noise},
+    {"sharpness2", Pattern::Noise},
+    {"motionblur:10", Pattern::Noise},
+    {"median:1", Pattern::Noise},
+    {"median:5", Pattern::Noise},
+    {"median:20", Pattern::Noise},
+    {"dilation:1", Pattern::Mask},
+    {"dilation:7", Pattern::Mask},
+    {"erosion:3", Pattern::Mask},
+    {"opening:3", Pattern::Mask},
+    {"closing:3", Pattern::Mask},
+    {"gradient:3", Pattern::Mask},
+    {"tophat:3", Pattern::Mask},
+    {"blackhat:3", Pattern::Mask},
+    {"move:50:20", Pattern::Noise},
+    {"rotate:128:128:0.5", Pattern::Noise},
+    {"rotate:128:128:0.5:1", Pattern::Noise},
+    {"rotate:128:128:0.5:2", Pattern::Noise},
+    {"waves:30:0", Pattern::Noise},
+    {"waves:30:1", Pattern::Noise},
+    {"glass:1", Pattern::Noise},
+    {"gauss:2:1,invert,sobel,dilation:1", Pattern::Noise},
+};
+
+struct ImageSize {
+    const char *name;
+    int width, height;
+};
+
+static const ImageSize imageSizes[] = {
+    {"256", 256, 256},
+    {"1024", 1024, 1024},
+    {"1080p", 1920, 1080},
+    {"4k", 3840, 2160},
+    {"8k", 7680, 4320},
+};
+
+static const char *patternName(Pattern pattern) {
+    switch (pattern) {
+    case Pattern::Noise: return "noise";
+    case Pattern::Gradient: return "gradient";
+    default: return "mask";
+    }
+}
+
+static QImage syntheticImage(Pattern pattern, int width, int height) {
+    QImage img(width, height, QImage::Format_RGB32);
+    std::mt19937 random(12345);
+    for (int y = 0; y < height; y++) {
+        QRgb *line = reinterpret_cast<QRgb *>(img.scanLine(y));
+        for (int x = 0; x < width; x++) {
+            if (pattern == Pattern::Noise) {
+                uint32_t bits = random();
+                line[x] = qRgb(bits & 0xff, (bits >> 8) & 0xff, (bits >> 16) & 0xff);
+            } else if (pattern == Pattern::Gradient) {
+                line[x] = qRgb(255 * x / std::max(width - 1, 1), 255 * y / std::max(height - 1, 1), 255 * (x + y) / std::max(width + height - 2, 1));
+            } else {
+                // Blobs of a few pixels, so the structuring elements see both edges and flat areas
+                int value = ((x / 7) * 31 + (y / 5) * 17 + static_cast<int>(random() % 4)) % 5 == 0 ? 255 : 0;
+                line[x] = qRgb(value, value, value);
+            }
+        }
+    }
+    return img;
+}
+
+// The peak resident set of every case on its own. Only Linux can reset the peak between cases (by writing 5 to
+// /proc/self/clear_refs), elsewhere the lifetime peak would repeat the largest case so none is reported.
+static bool resetPeakResident() {
+#ifdef __linux__
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    return bool(clearRefs << "5");
+#else
+    return false;
+#endif
+}
+
+// VmHWM in MiB, the peak since the last reset
+static double peakResidentMiB() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return atof(line.c_str() + 6) / 1024.;
+        }
+    }
+    return -1;
+}
+
+static QString caseKey(const QJsonObject &result) {
+    return result["filter"].toString() + "|" + result["image"].toString() + "|" + QString::number(result["width"].toInt()) + "x" + QString::number(result["height"].toInt());
+}
+
+static bool loadResults(const char *path, QJsonObject &results) {
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    QJsonDocument document = QJsonDocument::fromJson(file.readAll());
+    if (!document.isObject()) {
+        fprintf(stderr, "%s is not a benchmark result\n", path);
+        return false;
+    }
+    results = document.object();
+    return true;
+}
+
+// Prints every case found in both runs and returns the number of regressions
+static int compareResults(const QJsonObject &baseline, const QJsonObject &current, double threshold, FILE *out) {
+    std::map<QString, double> baselineSpeeds;
+    for (const QJsonValue &value : baseline["results"].toArray()) {
+        baselineSpeeds[caseKey(value.toObject())] = value.toObject()["mpixPerSecond"].toDouble();
+    }
+
+    int regressions = 0, compared = 0;
+    fprintf(out, "%-40s %-9s %-11s %10s %10s %8s\n", "filter", "image", "size", "base MP/s", "MP/s", "change");
+    for (const QJsonValue &value : current["results"].toArray()) {
+        QJsonObject result = value.toObject();
+        auto base = baselineSpeeds.find(caseKey(result));
+        if (base == baselineSpeeds.end() || base->second <= 0) {
+            continue;
+        }
+        double speed = result["mpixPerSecond"].toDouble();
+        double change = speed / base->second - 1;
+        bool regression = change < -threshold;
+        regressions += regression;
+        compared++;
+        QString size = QString::number(result["width"].toInt()) + "x" + QString::number(result["height"].toInt());
+        fprintf(out, "%-40s %-9s %-11s %10.1f %10.1f %+7.1f%%%s\n", result["filter"].toString().toStdString().c_str(), result["image"].toString().toStdString().c_str(),
+                     size.toStdString().c_str(), base->second, speed, 100 * change, regression ? "  REGRESSION" : "");
+    }
+    fprintf(out, "%d cases compared, %d regressions beyond %.0f%%\n", compared, regressions, 100 * threshold);
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    std::string sizes = "256,1024,1080p,4k,8k", only, outputPath;
+    const char *baselinePath = nullptr, *comparedPath = nullptr;
+    int repetitions = 5, warmups = 1;
+    double threshold = 0.1;
+    bool allImages = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && (i + 1 < argc)) {
+            sizes = argv[++i];
+        } else if (!strcmp(argv[i], "-f") && (i + 1 < argc)) {
+            only = argv[++i];
+        } else if (!strcmp(argv[i], "-r") && (i + 1 < argc)) {
+            repetitions = std::max(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "-w") && (i + 1 < argc)) {
+            warmups = std::max(atoi(argv[++i]), 0);
+        } else if (!strcmp(argv[i], "-t") && (i + 1 < argc)) {
+            ThreadPool::instance().setThreadCount(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-o") && (i + 1 < argc)) {
+            outputPath = argv[++i];
+        } else if (!strcmp(argv[i], "--all-images")) {
+            allImages = true;
+        } else if (!strcmp(argv[i], "--threshold") && (i + 1 < argc)) {
+            threshold = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--baseline") && (i + 1 < argc)) {
+            baselinePath = argv[++i];
+        } else if (!strcmp(argv[i], "--compare") && (i + 2 < argc)) {
+            baselinePath = argv[++i];
+            comparedPath = argv[++i];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    QJsonObject baseline, current;
+    if (baselinePath && !loadResults(baselinePath, baseline)) {
+        return 2;
+    }
+    if (comparedPath) {
+        if (!loadResults(comparedPath, current)) {
+            return 2;
+        }
+        return compareResults(baseline, current, threshold, stdout) == 0 ? 0 : 1;
+    }
+
+    QJsonArray results;
+    for (const ImageSize &size : imageSizes) {
+        if (("," + sizes + ",").find("," + std::string(size.name) + ",") == std::string::npos) {
+            continue;
+        }
+        for (Pattern pattern : {Pattern::Noise, Pattern::Gradient, Pattern::Mask}) {
+            QImage img;
+            for (const BenchCase &benchCase : benchCases) {
+                if ((!allImages && benchCase.pattern != pattern) || (!only.empty() && std::string(benchCase.spec).find(only) == std::string::npos)) {
+                    continue;
+                }
+                if (img.isNull()) {
+                    img = syntheticImage(pattern, size.width, size.height);
+                }
+
+                // Single filters run through process(), chains through the graph
+                std::vector<std::shared_ptr<const Filter>> filters = FilterSpec::chain(benchCase.spec);
+                FilterGraph graph;
+                FilterGraph::Node output = FilterSpec::parse(benchCase.spec, graph);
+                auto run = [&]() {
+                    return filters.size() == 1 ? filters[0]->process(img) : graph.evaluate(img, output);
+                };
+
+                bool peakReset = resetPeakResident();
+                for (int i = 0; i < warmups; i++) {
+                    run();
+                }
+                std::vector<double> seconds;
+                for (int i = 0; i < repetitions; i++) {
+                    auto start = std::chrono::steady_clock::now();
+                    QImage result = run();
+                    seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                }
+                std::sort(seconds.begin(), seconds.end());
+                double median = seconds[seconds.size() / 2];
+                double pixels = double(size.width) * size.height;
+
+                QJsonObject result;
+                result["filter"] = benchCase.spec;
+                result["image"] = patternName(pattern);
+                result["width"] = size.width;
+                result["height"] = size.height;
+                result["repetitions"] = repetitions;
+                result["medianMs"] = median * 1e3;
+                result["minMs"] = seconds.front() * 1e3;
+                result["mpixPerSecond"] = pixels * 1e-6 / median;
+                result["nsPerPixel"] = median * 1e9 / pixels;
+                double peak = peakReset ? peakResidentMiB() : -1;
+                if (peak >= 0) {
+                    result["peakRssMiB"] = peak;
+                }
+                results.append(result);
+                fprintf(stderr, "%-40s %-9s %5dx%-5d %9.2f ms %9.1f MPix/s %7.2f ns/px\n", benchCase.spec, patternName(pattern), size.width, size.height, median * 1e3, pixels * 1e-6 / median, median * 1e9 / pixels);
+            }
+        }
+    }
+
+    current["threads"] = static_cast<int>(ThreadPool::instance().getThreadCount());
+    current["instructionSet"] = Stencil3x3::instructionSet();
+    current["repetitions"] = repetitions;
+    current["warmups"] = warmups;
+    current["results"] = results;
+    QByteArray json = QJsonDocument(current).toJson();
+    if (outputPath.empty()) {
+        fwrite(json.constData(), 1, json.size(), stdout);
+    } else {
+        QFile file(QString::fromStdString(outputPath));
+        if (!file.open(QFile::WriteOnly)) {
+            fprintf(stderr, "Cannot write %s\n", outputPath.c_str());
+            return 2;
+        }
+        file.write(json);
+    }
+
+    // The table goes next to the progress lines when the JSON takes stdout
+    if (baselinePath) {
+        return compareResults(baseline, current, threshold, outputPath.empty() ? stderr : stdout) == 0 ? 0 : 1;
+    }
+    return 0;
+}
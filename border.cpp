@@ -0,0 +1,46 @@
+#include "border.h"
+
+int borderCoordinate(int i, int n, BorderMode mode) {
+    if (i >= 0 && i < n) {
+        return i;
+    }
+    switch (mode) {
+    case BorderMode::Clamp:
+        return i < 0 ? 0 : n - 1;
+    case BorderMode::Reflect: {
+        if (n == 1) {
+            return 0;
+        }
+        // Reflections repeat every 2n - 2 pixels
+        int period = 2 * n - 2;
+        i %= period;
+        if (i < 0) {
+            i += period;
+        }
+        return i < n ? i : period - i;
+    }
+    case BorderMode::Wrap:
+        i %= n;
+        return i < 0 ? i + n : i;
+    case BorderMode::Constant:
+        break;
+    }
+    return -1;
+}
+
+BorderRows::BorderRows(int width, int radius, BorderMode mode, QRgb constant) : width(width), radius(radius), mode(mode), constant(constant) {
+    if (mode == BorderMode::Constant) {
+        constantRow.assign(width, constant);
+    }
+}
+
+void BorderRows::extend(const QRgb *line, int begin, int end, QRgb *out) const {
+    int inside = std::max(begin, 0), insideEnd = std::max(std::min(end, width), inside);
+    for (int x = begin; x < std::min(inside, end); x++) {
+        *out++ = pixel(line, x);
+    }
+    out = std::copy(line + inside, line + insideEnd, out);
+    for (int x = std::max(insideEnd, begin); x < end; x++) {
+        *out++ = pixel(line, x);
+    }
+}
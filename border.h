@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <QImage>
+
+// What neighbourhood filters read outside the image: the edge pixel repeated (Clamp, aaa|abcd|ddd), the image
+// mirrored about its edge pixel (Reflect, dcb|abcd|cba), the opposite edge (Wrap, bcd|abcd|abc) or a colour
+// (Constant)
+enum class BorderMode { Clamp, Reflect, Wrap, Constant };
+
+// Coordinate read for i on an axis of n pixels, -1 for the constant colour
+int borderCoordinate(int i, int n, BorderMode mode);
+
+// Rows of width pixels seen through a border mode, for a window of radius pixels on each side. Pixels whose
+// window lies in the row form the interior, which filters read straight from the image without any check. The
+// few others are computed on copies of their neighbourhood padded according to the mode.
+class BorderRows {
+protected:
+    int width, radius;
+    BorderMode mode;
+    QRgb constant;
+    // width pixels of the constant colour, in Constant mode
+    std::vector<QRgb> constantRow;
+    std::vector<QRgb> padded;
+    std::vector<const QRgb *> paddedLines;
+
+public:
+    BorderRows(int width, int radius, BorderMode mode, QRgb constant);
+
+    // Row y of an image of height rows given by lines(y), the constant row outside it in Constant mode
+    template <typename Lines>
+    const QRgb *row(Lines lines, int y, int height) const {
+        int source = borderCoordinate(y, height, mode);
+        return source < 0 ? constantRow.data() : lines(source);
+    }
+    // Pixel x of line, which may lie outside it
+    QRgb pixel(const QRgb *line, int x) const {
+        if (x >= 0 && x < width) {
+            return line[x];
+        }
+        int source = borderCoordinate(x, width, mode);
+        return source < 0 ? constant : line[source];
+    }
+    // Pixels [begin, end) of line, which may reach outside it
+    void extend(const QRgb *line, int begin, int end, QRgb *out) const;
+
+    int interiorBegin() const { return std::min(radius, width); }
+    int interiorEnd() const { return std::max(width - radius, interiorBegin()); }
+    // Calls run(lines, xBegin, xEnd) for the pixels left and right of the interior, lines[i][k] being pixel
+    // xBegin - radius + k of rows[i] for k < xEnd - xBegin + 2 * radius
+    template <typename Run>
+    void forEachBorderRun(const QRgb *const *rows, int count, Run run) {
+        const int runs[2][2] = {{0, interiorBegin()}, {interiorEnd(), width}};
+        paddedLines.resize(count);
+        for (const int *bounds : runs) {
+            int length = bounds[1] - bounds[0] + 2 * radius;
+            if (bounds[0] >= bounds[1]) {
+                continue;
+            }
+            padded.resize(std::size_t(count) * length);
+            for (int i = 0; i < count; i++) {
+                extend(rows[i], bounds[0] - radius, bounds[1] + radius, &padded[std::size_t(i) * length]);
+                paddedLines[i] = &padded[std::size_t(i) * length];
+            }
+            run(paddedLines.data(), bounds[0], bounds[1]);
+        }
+    }
+};
@@ -1,6 +1,6 @@
 QT += gui
 
-CONFIG += c++14 console
+CONFIG += c++14 console thread
 CONFIG -= app_bundle
 
 # You can make your code fail to compile if it uses deprecated APIs.
@@ -8,8 +8,23 @@ CONFIG -= app_bundle
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+        batch.cpp \
+        border.cpp \
+        fftconvolution.cpp \
         filter.cpp \
-        main.cpp
+        filtergraph.cpp \
+        filterspec.cpp \
+        fixedpoint.cpp \
+        imagebuffer.cpp \
+        imageio.cpp \
+        imagestatistics.cpp \
+        main.cpp \
+        random.cpp \
+        stencil.cpp \
+        threadpool.cpp \
+        tiledimage.cpp \
+        trace.cpp \
+        warp.cpp
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -17,4 +32,19 @@ else: unix:!android: target.path = /opt/$${TARGET}/bin
 !isEmpty(target.path): INSTALLS += target
 
 HEADERS += \
-    filter.h
+    batch.h \
+    border.h \
+    fftconvolution.h \
+    filter.h \
+    filtergraph.h \
+    filterspec.h \
+    fixedpoint.h \
+    imagebuffer.h \
+    imageio.h \
+    imagestatistics.h \
+    random.h \
+    stencil.h \
+    threadpool.h \
+    tiledimage.h \
+    trace.h \
+    warp.h
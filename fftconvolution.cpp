@@ -0,0 +1,225 @@
+#include "fftconvolution.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// Measured time of a multiply-add of the direct path for one channel, and of a butterfly of a transform,
+// in the same unit. A tile costs its three channels a forward and an inverse transform.
+static const double directTapCost = 1.0;
+static const double butterflyCost = 3.0;
+static const int maxTileSize = 512;
+
+template <typename T>
+static T clampTo(T value, T min, T max) {
+    return value > max ? max : value < min ? min : value;
+}
+
+Fft::Fft(int size) : size(size), reversed(size), twiddles(size / 2) {
+    if (size < 1 || (size & (size - 1)) != 0) throw std::invalid_argument("Fft: size is not a power of two");
+    int bits = 0;
+    while ((1 << bits) < size) {
+        bits++;
+    }
+    for (int i = 0; i < size; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        reversed[i] = r;
+    }
+    const double pi = std::acos(-1.0);
+    for (int k = 0; k < size / 2; k++) {
+        twiddles[k] = std::polar(1.0, -2 * pi * k / size);
+    }
+}
+
+void Fft::transform(std::complex<double> *data, bool inverse) const {
+    for (int i = 0; i < size; i++) {
+        if (i < reversed[i]) {
+            std::swap(data[i], data[reversed[i]]);
+        }
+    }
+    for (int length = 2; length <= size; length <<= 1) {
+        int half = length / 2, step = size / length;
+        for (int i = 0; i < size; i += length) {
+            for (int k = 0; k < half; k++) {
+                std::complex<double> w = inverse ? std::conj(twiddles[k * step]) : twiddles[k * step];
+                std::complex<double> u = data[i + k], v = data[i + k + half] * w;
+                data[i + k] = u + v;
+                data[i + k + half] = u - v;
+            }
+        }
+    }
+}
+
+RealFft::RealFft(int size) : half(size / 2), twiddles(size / 2 + 1) {
+    if (size < 2) throw std::invalid_argument("RealFft: size below 2");
+    const double pi = std::acos(-1.0);
+    for (int k = 0; k <= size / 2; k++) {
+        twiddles[k] = std::polar(1.0, -2 * pi * k / size);
+    }
+}
+
+void RealFft::forward(const double *input, std::complex<double> *output, std::complex<double> *scratch) const {
+    int m = half.getSize();
+    for (int i = 0; i < m; i++) {
+        scratch[i] = std::complex<double>(input[2 * i], input[2 * i + 1]);
+    }
+    half.transform(scratch, false);
+
+    // Bin k of the even samples is (Z[k] + conj(Z[m - k])) / 2, of the odd ones (Z[k] - conj(Z[m - k])) / 2i
+    for (int k = 0; k <= m; k++) {
+        std::complex<double> z = scratch[k % m], mirror = std::conj(scratch[(m - k) % m]);
+        std::complex<double> even = 0.5 * (z + mirror), odd = std::complex<double>(0, -0.5) * (z - mirror);
+        output[k] = even + twiddles[k] * odd;
+    }
+}
+
+void RealFft::inverse(const std::complex<double> *input, double *output, std::complex<double> *scratch) const {
+    int m = half.getSize();
+    for (int k = 0; k < m; k++) {
+        std::complex<double> x = input[k], mirror = std::conj(input[m - k]);
+        std::complex<double> even = 0.5 * (x + mirror), odd = 0.5 * (x - mirror) * std::conj(twiddles[k]);
+        scratch[k] = even + std::complex<double>(0, 1) * odd;
+    }
+    half.transform(scratch, true);
+    for (int i = 0; i < m; i++) {
+        output[2 * i] = scratch[i].real();
+        output[2 * i + 1] = scratch[i].imag();
+    }
+}
+
+// Tile with the least transform work per output pixel
+static int bestTileSize(int radius) {
+    int best = 0;
+    double bestCost = 0;
+    for (int size = 4; size <= maxTileSize; size *= 2) {
+        int block = size - 2 * radius;
+        if (block < 1) {
+            continue;
+        }
+        double cost = double(size) * size * std::log2(size) / (double(block) * block);
+        if (best == 0 || cost < bestCost) {
+            best = size;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
+
+bool FftConvolution::supports(int radius) {
+    return radius > 0 && bestTileSize(radius) != 0;
+}
+
+FftConvolution::FftConvolution(const std::vector<float> &taps, int radius)
+    : taps(taps), radius(radius), tileSize(bestTileSize(radius)), rowFft(std::max(tileSize, 2)), columnFft(std::max(tileSize, 1)) {
+    if (tileSize == 0) throw std::invalid_argument("FftConvolution: no tile fits the radius");
+    if (taps.size() != std::size_t(2 * radius + 1) * (2 * radius + 1)) throw std::invalid_argument("FftConvolution: taps do not match the radius");
+}
+
+void FftConvolution::prepare() const {
+    int size = 2 * radius + 1, bins = tileSize / 2 + 1;
+    // Output (y, x) sums taps[dy][dx] * input(y + dy, x + dx), a circular convolution with the kernel mirrored
+    std::vector<double> kernel(std::size_t(tileSize) * tileSize, 0.0);
+    for (int dy = -radius; dy <= radius; dy++) {
+        for (int dx = -radius; dx <= radius; dx++) {
+            kernel[std::size_t((tileSize - dy) % tileSize) * tileSize + (tileSize - dx) % tileSize] = taps[std::size_t(dy + radius) * size + dx + radius];
+        }
+    }
+    std::vector<std::complex<double>> rows(std::size_t(tileSize) * bins), scratch(tileSize);
+    for (int ty = 0; ty < tileSize; ty++) {
+        rowFft.forward(&kernel[std::size_t(ty) * tileSize], &rows[std::size_t(ty) * bins], scratch.data());
+    }
+
+    // The inverse transforms scale by tileSize (columns) times tileSize / 2 (rows)
+    double scale = 2.0 / (double(tileSize) * tileSize);
+    spectrum.resize(std::size_t(tileSize) * bins);
+    for (int column = 0; column < bins; column++) {
+        std::complex<double> *values = &spectrum[std::size_t(column) * tileSize];
+        for (int ty = 0; ty < tileSize; ty++) {
+            values[ty] = rows[std::size_t(ty) * bins + column];
+        }
+        columnFft.transform(values, false);
+        for (int ty = 0; ty < tileSize; ty++) {
+            values[ty] *= scale;
+        }
+    }
+}
+
+double FftConvolution::relativeCost(int width, int rows) const {
+    int block = blockSize();
+    double tiles = double((width + block - 1) / block) * ((rows + block - 1) / block);
+    // A transform of n points is n / 2 log2(n) butterflies, a tile takes 2 (rows and columns) per transform
+    double transform = double(tileSize) * tileSize * std::log2(tileSize);
+    double fft = tiles * 3 * 2 * transform * butterflyCost;
+    double size = 2 * radius + 1;
+    double direct = double(width) * rows * 3 * size * size * directTapCost;
+    return fft / direct;
+}
+
+void FftConvolution::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, BorderMode mode, QRgb constant) const {
+    std::call_once(prepared, [this] { prepare(); });
+    int width = img.width(), height = img.height();
+    BorderRows borders(width, radius, mode, constant);
+    int block = blockSize(), bins = tileSize / 2 + 1;
+    std::vector<double> samples(tileSize);
+    std::vector<std::complex<double>> tile(std::size_t(tileSize) * bins), column(tileSize), scratch(tileSize);
+    std::vector<float> channels(std::size_t(3) * block * block);
+    std::vector<const QRgb *> lines(tileSize);
+
+    for (int y0 = yBegin; y0 < yEnd; y0 += block) {
+        int rows = std::min(block, yEnd - y0);
+        // Input beyond the block and its radius only reaches outputs that are thrown away, it is left zero
+        int inputRows = rows + 2 * radius;
+        for (int ty = 0; ty < inputRows; ty++) {
+            lines[ty] = borders.row([&](int row) { return img.constLine(row); }, y0 - radius + ty, height);
+        }
+
+        for (int x0 = 0; x0 < width; x0 += block) {
+            int columns = std::min(block, width - x0), inputColumns = columns + 2 * radius;
+            for (int channel = 0; channel < 3; channel++) {
+                int shift = 16 - 8 * channel;
+                std::fill(samples.begin(), samples.end(), 0.0);
+                for (int ty = 0; ty < inputRows; ty++) {
+                    for (int tx = 0; tx < inputColumns; tx++) {
+                        samples[tx] = (borders.pixel(lines[ty], x0 - radius + tx) >> shift) & 0xff;
+                    }
+                    rowFft.forward(samples.data(), &tile[std::size_t(ty) * bins], scratch.data());
+                }
+                std::fill(tile.begin() + std::size_t(inputRows) * bins, tile.end(), std::complex<double>());
+
+                for (int bin = 0; bin < bins; bin++) {
+                    const std::complex<double> *kernel = &spectrum[std::size_t(bin) * tileSize];
+                    for (int ty = 0; ty < tileSize; ty++) {
+                        column[ty] = tile[std::size_t(ty) * bins + bin];
+                    }
+                    columnFft.transform(column.data(), false);
+                    for (int ty = 0; ty < tileSize; ty++) {
+                        column[ty] *= kernel[ty];
+                    }
+                    columnFft.transform(column.data(), true);
+                    // Only the rows of the block are transformed back
+                    for (int row = 0; row < rows; row++) {
+                        tile[std::size_t(row + radius) * bins + bin] = column[row + radius];
+                    }
+                }
+
+                float *plane = &channels[std::size_t(channel) * block * block];
+                for (int row = 0; row < rows; row++) {
+                    rowFft.inverse(&tile[std::size_t(row + radius) * bins], samples.data(), scratch.data());
+                    for (int x = 0; x < columns; x++) {
+                        plane[row * block + x] = static_cast<float>(samples[x + radius]);
+                    }
+                }
+            }
+
+            for (int row = 0; row < rows; row++) {
+                QRgb *line = result + std::size_t(y0 - yBegin + row) * stride + x0;
+                const float *red = &channels[std::size_t(row) * block], *green = red + block * block, *blue = green + block * block;
+                for (int x = 0; x < columns; x++) {
+                    line[x] = qRgb(clampTo(red[x], 0.f, 255.f), clampTo(green[x], 0.f, 255.f), clampTo(blue[x], 0.f, 255.f));
+                }
+            }
+        }
+    }
+}
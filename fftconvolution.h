@@ -0,0 +1,67 @@
+#pragma once
+
+#include <complex>
+#include <mutex>
+#include <vector>
+#include <QImage>
+#include "border.h"
+#include "imagebuffer.h"
+
+// Radix-2 complex FFT of a fixed power of two size
+class Fft {
+protected:
+    int size;
+    std::vector<int> reversed;
+    // exp(-2 pi i k / size) for k < size / 2
+    std::vector<std::complex<double>> twiddles;
+
+public:
+    Fft(int size);
+    int getSize() const { return size; }
+    // In place and unnormalized, the inverse runs on the conjugate twiddles
+    void transform(std::complex<double> *data, bool inverse) const;
+};
+
+// FFT of real sequences of an even size through a complex FFT of half that size, the odd samples
+// going into the imaginary parts. The size / 2 + 1 bins kept are the rest of the spectrum's conjugates.
+class RealFft {
+protected:
+    Fft half;
+    // exp(-2 pi i k / size) for k <= size / 2
+    std::vector<std::complex<double>> twiddles;
+
+public:
+    RealFft(int size);
+    // size samples to size / 2 + 1 bins, scratch holds size / 2 values
+    void forward(const double *input, std::complex<double> *output, std::complex<double> *scratch) const;
+    // size / 2 + 1 bins back to size samples, scaled by size / 2
+    void inverse(const std::complex<double> *input, double *output, std::complex<double> *scratch) const;
+};
+
+// Convolution with a large kernel in the frequency domain, by overlap-save. The image is cut into blocks, each
+// read with the kernel's radius around it (extended by the border mode, as the direct path does) into a square tile,
+// transformed, multiplied by the kernel's spectrum and transformed back. Circular wrap-around only reaches the
+// radius at the tile's edges, which the overlap of the tiles throws away. Memory is a tile per thread.
+class FftConvolution {
+protected:
+    // Weights as MatrixFilter applies them, taps[(dy + radius) * size + dx + radius]
+    std::vector<float> taps;
+    int radius, tileSize;
+    RealFft rowFft;
+    Fft columnFft;
+    // Spectrum of the kernel, column after column, scaled to undo the transforms. Computed on first use.
+    mutable std::vector<std::complex<double>> spectrum;
+    mutable std::once_flag prepared;
+
+    void prepare() const;
+
+public:
+    FftConvolution(const std::vector<float> &taps, int radius);
+    // Whether a tile of at most 512 pixels leaves room for a block around the kernel's radius
+    static bool supports(int radius);
+    // Output rows and columns of a tile
+    int blockSize() const { return tileSize - 2 * radius; }
+    // Estimated time over the direct path for rows of the given size, below 1 when the FFT is faster
+    double relativeCost(int width, int rows) const;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, BorderMode mode = BorderMode::Clamp, QRgb constant = 0) const;
+};
@@ -1,5 +1,12 @@
 #include "filter.h"
+#include "stencil.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <stdexcept>
+#include <vector>
 
 template <typename T>
 T clamp(T value, T min, T max) {
@@ -8,41 +15,183 @@ T clamp(T value, T min, T max) {
     return value;
 }
 
+static const QRgb *constRow(const ImageBuffer &img, int y) {
+    return img.constLine(y);
+}
+
+// Rows handed to one pool task, several bands per thread keep the threads evenly loaded
+static int bandHeight(int height) {
+    int bands = 4 * static_cast<int>(ThreadPool::instance().getThreadCount());
+    return std::max(16, (height + bands - 1) / bands);
+}
+
+static void differenceRow(const QRgb *line1, const QRgb *line2, int width, QRgb *result) {
+    for (int x = 0; x < width; x++) {
+        result[x] = qRgb(clamp(qRed(line1[x]) - qRed(line2[x]), 0, 255), clamp(qGreen(line1[x]) - qGreen(line2[x]), 0, 255), clamp(qBlue(line1[x]) - qBlue(line2[x]), 0, 255));
+    }
+}
+
 QImage imageDifference(const QImage &img1, const QImage &img2) {
-    if (img1.width() != img2.width() || img1.height() != img2.height()) throw;
-    int width = img1.width(), height = img2.height();
-    QImage result(img1);
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height; j++) {
-            QColor color1 = img1.pixelColor(i, j), color2 = img2.pixelColor(i, j);
-            result.setPixelColor(i, j, QColor(clamp(color1.red() - color2.red(), 0, 255), clamp(color1.green() - color2.green(), 0, 255), clamp(color1.blue() - color2.blue(), 0, 255)));
+    if (img1.width() != img2.width() || img1.height() != img2.height()) throw std::invalid_argument("imageDifference: images of different sizes");
+    ImageBuffer source1 = ImageBuffer::wrap(img1), source2 = ImageBuffer::wrap(img2);
+    int width = source1.width(), height = source1.height();
+    ImageBuffer result(width, height, ImageBuffer::Layout::Interleaved, ImageBuffer::Sample::UInt8, source1.hasAlpha());
+    ThreadPool::instance().parallelFor(0, height, bandHeight(height), [&](int yBegin, int yEnd) {
+        for (int y = yBegin; y < yEnd; y++) {
+            differenceRow(constRow(source1, y), constRow(source2, y), width, result.line(y));
         }
-    }
-    return result;
+    });
+    return result.toQImage();
 }
 
-float Filter::calcColorIntensity(const QColor &color) {
-    float intensity = clamp(0.299f * color.red() + 0.587f * color.green() + 0.114f * color.blue(), 0.f, 255.f);
+Filter::Filter() : borderMode(BorderMode::Clamp), borderColor(qRgb(0, 0, 0)) {}
+
+void Filter::setBorderMode(BorderMode mode, QRgb color) {
+    borderMode = mode;
+    borderColor = color;
+}
+
+float Filter::calcColorIntensity(QRgb color) {
+    float intensity = clamp(0.299f * qRed(color) + 0.587f * qGreen(color) + 0.114f * qBlue(color), 0.f, 255.f);
     return intensity;
 }
 
+void Filter::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        processRow(img, y, result);
+    }
+}
+
+bool Filter::isReentrant() const {
+    return true;
+}
+
+int Filter::haloRadius() const {
+    return -1;
+}
+
 QImage Filter::process(const QImage &img) const {
-    QImage result(img);
+    TraceSpan span(this, int64_t(img.width()) * img.height());
+    // Qt is only involved here: the rows run on the image's own bits and write into a pooled buffer,
+    // which then becomes the result without a copy
+    ImageBuffer source = ImageBuffer::wrap(img);
+    ImageBuffer result(source.width(), source.height(), ImageBuffer::Layout::Interleaved, ImageBuffer::Sample::UInt8, source.hasAlpha());
+
+    // Bands only ever write their own rows, so the output does not depend on the thread count
+    int stride = result.bytesPerLine() / sizeof(QRgb);
+    int grain = isReentrant() ? bandHeight(source.height()) : source.height();
+    ThreadPool::instance().parallelFor(0, source.height(), grain, [&](int yBegin, int yEnd) {
+        TraceBand band(span);
+        processRows(source, yBegin, yEnd, result.line(yBegin), stride);
+    });
+
+    return result.toQImage();
+}
 
-    for (int x = 0; x < img.width(); x++) {
-        for (int y = 0; y < img.height(); y++) {
-            QColor color = calcNewPixelColor(img, x, y);
-            result.setPixelColor(x, y, color);
+PointTable::PointTable() {
+    for (int v = 0; v < 256; v++) {
+        red[v] = green[v] = blue[v] = v;
+    }
+}
+
+void PointTable::applyRow(const QRgb *line, int width, QRgb *result) const {
+    if (intensity.empty()) {
+        for (int x = 0; x < width; x++) {
+            result[x] = qRgb(red[qRed(line[x])], green[qGreen(line[x])], blue[qBlue(line[x])]);
         }
+        return;
+    }
+
+    for (int x = 0; x < width; x++) {
+        float value = clamp(redIntensity[qRed(line[x])] + greenIntensity[qGreen(line[x])] + blueIntensity[qBlue(line[x])], 0.f, 255.f);
+        result[x] = intensity[static_cast<int>(value * intensitySteps)];
     }
+}
 
+ImageBuffer PointTable::apply(const ImageBuffer &img) const {
+    int width = img.width(), height = img.height();
+    TraceSpan span(this, int64_t(width) * height);
+    ImageBuffer result(width, height, ImageBuffer::Layout::Interleaved, ImageBuffer::Sample::UInt8, img.hasAlpha());
+    ThreadPool::instance().parallelFor(0, height, bandHeight(height), [&](int yBegin, int yEnd) {
+        TraceBand band(span);
+        for (int y = yBegin; y < yEnd; y++) {
+            applyRow(constRow(img, y), width, result.line(y));
+        }
+    });
     return result;
 }
 
-QColor InvertFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    QColor color = img.pixelColor(x, y);
-    color.setRgb(255 - color.red(), 255 - color.green(), 255 - color.blue());
-    return color;
+QImage PointTable::apply(const QImage &img) const {
+    return apply(ImageBuffer::wrap(img)).toQImage();
+}
+
+void PointFilter::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    processRows(img, y, y + 1, result, img.width());
+}
+
+void PointFilter::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    PointTable lookup = table();
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        lookup.applyRow(constRow(img, y), img.width(), result);
+    }
+}
+
+void PointFilter::compose(PointTable &table) const {
+    if (!table.intensity.empty()) {
+        for (QRgb &color : table.intensity) {
+            color = map(color);
+        }
+        return;
+    }
+
+    // Each output channel only depends on its input channel, so the grays give all three tables
+    for (int v = 0; v < 256; v++) {
+        QRgb color = map(qRgb(table.red[v], table.green[v], table.blue[v]));
+        table.red[v] = qRed(color);
+        table.green[v] = qGreen(color);
+        table.blue[v] = qBlue(color);
+    }
+}
+
+PointTable PointFilter::table() const {
+    PointTable lookup;
+    compose(lookup);
+    return lookup;
+}
+
+QImage PointFilter::process(const QImage &img) const {
+    TraceSpan span(this, int64_t(img.width()) * img.height());
+    return table().apply(img);
+}
+
+int PointFilter::haloRadius() const {
+    return 0;
+}
+
+QRgb IntensityFilter::map(QRgb color) const {
+    return mapIntensity(calcColorIntensity(color));
+}
+
+void IntensityFilter::compose(PointTable &table) const {
+    if (!table.intensity.empty()) {
+        PointFilter::compose(table);
+        return;
+    }
+
+    // Same products as calcColorIntensity(), added in the same order, so the intensity is bit for bit the same
+    for (int v = 0; v < 256; v++) {
+        table.redIntensity[v] = 0.299f * table.red[v];
+        table.greenIntensity[v] = 0.587f * table.green[v];
+        table.blueIntensity[v] = 0.114f * table.blue[v];
+    }
+    table.intensity.resize(255 * PointTable::intensitySteps + 1);
+    for (std::size_t i = 0; i < table.intensity.size(); i++) {
+        table.intensity[i] = mapIntensity(float(i) / PointTable::intensitySteps);
+    }
+}
+
+QRgb InvertFilter::map(QRgb color) const {
+    return qRgb(255 - qRed(color), 255 - qGreen(color), 255 - qBlue(color));
 }
 
 std::size_t Kernel::getLen() const {
@@ -71,6 +220,18 @@ Kernel::Kernel (float* kernel, size_t radius) : radius(radius) {
     std::copy(kernel, kernel + getLen(), data.get());
 }
 
+Kernel::Kernel(const std::vector<float> &factor) : Kernel(factor, factor) {}
+
+Kernel::Kernel(const std::vector<float> &columnFactor, const std::vector<float> &rowFactor) : radius(columnFactor.size() / 2) {
+    if (columnFactor.size() != rowFactor.size() || columnFactor.size() % 2 == 0) throw std::invalid_argument("Kernel: factors of different or even sizes");
+    data = std::make_unique<float[]>(getLen());
+    for (std::size_t i = 0; i < getSize(); i++) {
+        for (std::size_t j = 0; j < getSize(); j++) {
+            data[i * getSize() + j] = columnFactor[i] * rowFactor[j];
+        }
+    }
+}
+
 std::size_t Kernel::getRadius() const {
     return radius;
 }
@@ -95,6 +256,65 @@ void Kernel::setKernel(float *kernel, size_t len) {
     std::copy(kernel, kernel + getLen(), data.get());
 }
 
+bool Kernel::separate(std::vector<float> &columnFactor, std::vector<float> &rowFactor) const {
+    columnFactor.clear();
+    rowFactor.clear();
+    if (!data) {
+        return false;
+    }
+
+    std::size_t size = getSize(), pivot = 0;
+    for (std::size_t i = 0; i < getLen(); i++) {
+        if (std::abs(data[i]) > std::abs(data[pivot])) {
+            pivot = i;
+        }
+    }
+    if (data[pivot] == 0.f) {
+        return false;
+    }
+
+    // A rank-1 kernel is its pivot column times its pivot row scaled by the pivot
+    std::vector<float> column(size), row(size);
+    for (std::size_t i = 0; i < size; i++) {
+        column[i] = data[i * size + pivot % size];
+        row[i] = data[(pivot / size) * size + i] / data[pivot];
+    }
+
+    float tolerance = 1e-5f * std::abs(data[pivot]);
+    for (std::size_t i = 0; i < size; i++) {
+        for (std::size_t j = 0; j < size; j++) {
+            if (std::abs(data[i * size + j] - column[i] * row[j]) > tolerance) {
+                return false;
+            }
+        }
+    }
+
+    columnFactor.swap(column);
+    rowFactor.swap(row);
+    return true;
+}
+
+// Weights of a 3x3 kernel with small integer taps, which Stencil3x3 evaluates exactly
+static std::vector<int> integerStencil(const Kernel &kernel) {
+    std::vector<int> weights;
+    if (kernel.getRadius() != 1) {
+        return weights;
+    }
+
+    int weightSum = 0;
+    for (std::size_t i = 0; i < kernel.getSize() * kernel.getSize(); i++) {
+        if (kernel[i] != std::round(kernel[i])) {
+            return std::vector<int>();
+        }
+        weights.push_back(static_cast<int>(kernel[i]));
+        weightSum += std::abs(weights.back());
+    }
+    if (weightSum > Stencil3x3::maxWeightSum) {
+        weights.clear();
+    }
+    return weights;
+}
+
 float Kernel::operator[](std::size_t id) const {
     return data[id];
 }
@@ -103,27 +323,184 @@ float& Kernel::operator[](std::size_t id) {
     return data[id];
 }
 
-QColor MatrixFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    float returnR = 0, returnG = 0, returnB = 0;
+void MatrixFilter::processRow(const ImageBuffer &img, int y, QRgb *result) const {
     int size = mKernel.getSize();
     int radius = mKernel.getRadius();
+    int width = img.width();
+    BorderRows borders(width, radius, borderMode, borderColor);
 
+    std::vector<const QRgb *> lines(size);
     for (int i = -radius; i <= radius; i++) {
-        for (int j = -radius; j <= radius; j++) {
-            int idx = (i + radius) * size + j + radius;
+        lines[i + radius] = borders.row([&](int line) { return constRow(img, line); }, y + i, img.height());
+    }
+
+    if (!stencil.empty()) {
+        auto stencilRow = [&](const QRgb *const *rows, int count, QRgb *out) {
+            if (staticStencil) {
+                staticStencil(rows, count, out);
+            } else {
+                Stencil3x3::convolveRow(rows, count, stencil.data(), out);
+            }
+        };
+        stencilRow(lines.data(), width, result);
+        // The stencils clamp their first and last pixels, which the other modes compute again
+        if (borderMode != BorderMode::Clamp) {
+            borders.forEachBorderRun(lines.data(), size, [&](const QRgb *const *rows, int xBegin, int xEnd) {
+                QRgb run[3];
+                stencilRow(rows, xEnd - xBegin + 2, run);
+                std::copy(run + 1, run + 1 + xEnd - xBegin, result + xBegin);
+            });
+        }
+        return;
+    }
+
+    // rows[i][k] is pixel origin + k of source row i, so the window of x starts at rows[i][x - radius - origin]
+    auto convolve = [&](const QRgb *const *rows, int origin, int xBegin, int xEnd) {
+        for (int x = xBegin; x < xEnd; x++) {
+            float returnR = 0, returnG = 0, returnB = 0;
+
+            for (int i = 0; i < size; i++) {
+                const QRgb *window = rows[i] + x - radius - origin;
+                for (int j = 0; j < size; j++) {
+                    int idx = i * size + j;
+
+                    QRgb color = window[j];
+
+                    returnR += qRed(color) * mKernel[idx];
+                    returnG += qGreen(color) * mKernel[idx];
+                    returnB += qBlue(color) * mKernel[idx];
+                }
+            }
+
+            result[x] = qRgb(clamp(returnR, 0.f, 255.f), clamp(returnG, 0.f, 255.f), clamp(returnB, 0.f, 255.f));
+        }
+    };
+    convolve(lines.data(), 0, borders.interiorBegin(), borders.interiorEnd());
+    borders.forEachBorderRun(lines.data(), size, [&](const QRgb *const *rows, int xBegin, int xEnd) {
+        convolve(rows, xBegin - radius, xBegin, xEnd);
+    });
+}
+
+void MatrixFilter::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    if (fft && fft->relativeCost(img.width(), yEnd - yBegin) < 1) {
+        fft->processRows(img, yBegin, yEnd, result, stride, borderMode, borderColor);
+        return;
+    }
+    if (fixedPoint) {
+        fixedPoint->processRows(img, yBegin, yEnd, result, stride, borderMode, borderColor);
+        return;
+    }
+    if (columnFactor.empty()) {
+        Filter::processRows(img, yBegin, yEnd, result, stride);
+        return;
+    }
+
+    int size = mKernel.getSize();
+    int radius = mKernel.getRadius();
+    int width = img.width(), height = img.height();
+    BorderRows borders(width, radius, borderMode, borderColor);
+
+    // Horizontally filtered rows, window row v (row y + i of output row y) lives in slot v mod size
+    std::vector<float> ring(std::size_t(size) * width * 3);
+    std::vector<float> padded(std::size_t(width + 2 * radius) * 3);
+    std::vector<float> accumulator(std::size_t(width) * 3);
+    auto slot = [&](int v) { return ((v % size) + size) % size; };
+    int nextRow = yBegin - radius;
+
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        for (; nextRow <= y + radius; nextRow++) {
+            const QRgb *line = borders.row([&](int row) { return constRow(img, row); }, nextRow, height);
+            for (int x = -radius; x < width + radius; x++) {
+                QRgb color = borders.pixel(line, x);
+                float *pixel = &padded[std::size_t(x + radius) * 3];
+                pixel[0] = qRed(color); pixel[1] = qGreen(color); pixel[2] = qBlue(color);
+            }
+
+            float *filtered = &ring[std::size_t(slot(nextRow)) * width * 3];
+            std::fill(filtered, filtered + width * 3, 0.f);
+            for (int j = 0; j < size; j++) {
+                const float weight = rowFactor[j];
+                const float *shifted = &padded[std::size_t(j) * 3];
+                for (int k = 0; k < width * 3; k++) {
+                    filtered[k] += weight * shifted[k];
+                }
+            }
+        }
 
-            QColor color = img.pixelColor(clamp(x + j, 0, img.width() - 1), clamp(y + i, 0, img.height() - 1));
+        std::fill(accumulator.begin(), accumulator.end(), 0.f);
+        for (int i = -radius; i <= radius; i++) {
+            const float weight = columnFactor[i + radius];
+            const float *filtered = &ring[std::size_t(slot(y + i)) * width * 3];
+            for (int k = 0; k < width * 3; k++) {
+                accumulator[k] += weight * filtered[k];
+            }
+        }
 
-            returnR += color.red() * mKernel[idx];
-            returnG += color.green() * mKernel[idx];
-            returnB += color.blue() * mKernel[idx];
+        for (int x = 0; x < width; x++) {
+            const float *pixel = &accumulator[std::size_t(x) * 3];
+            result[x] = qRgb(clamp(pixel[0], 0.f, 255.f), clamp(pixel[1], 0.f, 255.f), clamp(pixel[2], 0.f, 255.f));
+        }
+    }
+}
+
+MatrixFilter::MatrixFilter(const Kernel &kernel) : mKernel(kernel), stencil(integerStencil(kernel)), staticStencil(nullptr) {
+    if (stencil.empty()) {
+        mKernel.separate(columnFactor, rowFactor);
+    }
+    // Kernels too large for any tile stay on the direct path
+    if (stencil.empty() && columnFactor.empty() && FftConvolution::supports(static_cast<int>(mKernel.getRadius()))) {
+        std::vector<float> taps(mKernel.getSize() * mKernel.getSize());
+        for (std::size_t i = 0; i < taps.size(); i++) {
+            taps[i] = mKernel[i];
         }
+        fft = std::make_shared<FftConvolution>(taps, static_cast<int>(mKernel.getRadius()));
     }
+    setFractionBits(FixedPointConvolution::defaultFractionBits);
+}
 
-    return QColor(clamp(returnR, 0.f, 255.f), clamp(returnG, 0.f, 255.f), clamp(returnB, 0.f, 255.f));
+MatrixFilter::MatrixFilter(const Kernel &kernel, StructuringElement) : mKernel(kernel), staticStencil(nullptr) {}
+
+void MatrixFilter::setFractionBits(int bits) {
+    fixedPoint.reset();
+    std::shared_ptr<FixedPointConvolution> convolution;
+    if (!columnFactor.empty()) {
+        convolution = std::make_shared<FixedPointConvolution>(columnFactor, rowFactor, bits);
+    } else if (fft) {
+        // The kernels the FFT is built for are the non-separable convolutions
+        std::vector<float> taps(mKernel.getSize() * mKernel.getSize());
+        for (std::size_t i = 0; i < taps.size(); i++) {
+            taps[i] = mKernel[i];
+        }
+        convolution = std::make_shared<FixedPointConvolution>(taps, static_cast<int>(mKernel.getRadius()), bits);
+    }
+    if (convolution && convolution->isValid()) {
+        fixedPoint = convolution;
+    }
 }
 
-MatrixFilter::MatrixFilter(const Kernel &kernel) : mKernel(kernel) {}
+QImage MatrixFilter::process(const QImage &img) const {
+    if (!fft || fft->relativeCost(img.width(), img.height()) >= 1) {
+        return Filter::process(img);
+    }
+
+    // Bands as high as the FFT's blocks, so no tile is cut by a band
+    TraceSpan span(this, int64_t(img.width()) * img.height());
+    ImageBuffer source = ImageBuffer::wrap(img);
+    ImageBuffer result(source.width(), source.height(), ImageBuffer::Layout::Interleaved, ImageBuffer::Sample::UInt8, source.hasAlpha());
+    int stride = result.bytesPerLine() / sizeof(QRgb);
+    ThreadPool::instance().parallelFor(0, source.height(), fft->blockSize(), [&](int yBegin, int yEnd) {
+        TraceBand band(span);
+        processRows(source, yBegin, yEnd, result.line(yBegin), stride);
+    });
+    return result.toQImage();
+}
+
+int MatrixFilter::haloRadius() const {
+    if (borderMode == BorderMode::Wrap) {
+        return -1;
+    }
+    return mKernel.getRadius();
+}
 
 BlurKernel::BlurKernel(std::size_t radius) : Kernel(radius) {
     for (std::size_t i = 0; i < getLen(); i++) {
@@ -131,6 +508,86 @@ BlurKernel::BlurKernel(std::size_t radius) : Kernel(radius) {
     }
 }
 
+// Running sums stay exact up to this radius (the window area times 255 fits the 48-bit reciprocal below)
+static const int maxBoxRadius = 511;
+
+// Box means of rows [yBegin, yEnd), rows come from lines(y) with y already clamped to the image.
+// Column sums slide down the band, horizontally summed rows live in a ring indexed by window position.
+template <typename Lines>
+static void boxRows(Lines lines, int width, int height, int radius, int yBegin, int yEnd, QRgb *result, int stride, bool rounded) {
+    int size = 2 * radius + 1;
+    uint64_t area = uint64_t(size) * size;
+    // floor(sum / area) == (sum * multiplier) >> 48 while sum * area < 2^48
+    uint64_t multiplier = ((uint64_t(1) << 48) + area - 1) / area;
+    uint64_t bias = rounded ? area / 2 : 0;
+
+    std::vector<uint32_t> ring(std::size_t(size) * width * 3);
+    std::vector<uint32_t> columns(std::size_t(width) * 3, 0);
+    std::vector<uint32_t> padded(std::size_t(width + 2 * radius) * 3);
+    int first = yBegin - radius;
+
+    auto horizontalSums = [&](int position) {
+        const QRgb *line = lines(clamp(position, 0, height - 1));
+        for (int x = -radius; x < width + radius; x++) {
+            QRgb color = line[clamp(x, 0, width - 1)];
+            uint32_t *pixel = &padded[std::size_t(x + radius) * 3];
+            pixel[0] = qRed(color); pixel[1] = qGreen(color); pixel[2] = qBlue(color);
+        }
+
+        uint32_t *sums = &ring[std::size_t((position - first) % size) * width * 3];
+        uint32_t red = 0, green = 0, blue = 0;
+        for (int j = 0; j < size; j++) {
+            red += padded[std::size_t(j) * 3];
+            green += padded[std::size_t(j) * 3 + 1];
+            blue += padded[std::size_t(j) * 3 + 2];
+        }
+        for (int x = 0; x < width; x++) {
+            sums[x * 3] = red; sums[x * 3 + 1] = green; sums[x * 3 + 2] = blue;
+            if (x + 1 < width) {
+                const uint32_t *leaving = &padded[std::size_t(x) * 3], *entering = &padded[std::size_t(x + size) * 3];
+                red += entering[0] - leaving[0];
+                green += entering[1] - leaving[1];
+                blue += entering[2] - leaving[2];
+            }
+        }
+        return sums;
+    };
+
+    for (int position = first; position < first + size; position++) {
+        const uint32_t *sums = horizontalSums(position);
+        for (int k = 0; k < width * 3; k++) {
+            columns[k] += sums[k];
+        }
+    }
+
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        for (int x = 0; x < width; x++) {
+            const uint32_t *pixel = &columns[std::size_t(x) * 3];
+            result[x] = qRgb(int(((pixel[0] + bias) * multiplier) >> 48), int(((pixel[1] + bias) * multiplier) >> 48), int(((pixel[2] + bias) * multiplier) >> 48));
+        }
+
+        if (y + 1 < yEnd) {
+            // Row y - radius leaves the window and row y + radius + 1 takes its slot
+            const uint32_t *leaving = &ring[std::size_t((y - radius - first) % size) * width * 3];
+            for (int k = 0; k < width * 3; k++) {
+                columns[k] -= leaving[k];
+            }
+            const uint32_t *entering = horizontalSums(y + radius + 1);
+            for (int k = 0; k < width * 3; k++) {
+                columns[k] += entering[k];
+            }
+        }
+    }
+}
+
+void BlurFilter::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    if (int(mKernel.getRadius()) > maxBoxRadius || borderMode != BorderMode::Clamp) {
+        MatrixFilter::processRows(img, yBegin, yEnd, result, stride);
+        return;
+    }
+    boxRows([&](int y) { return constRow(img, y); }, img.width(), img.height(), mKernel.getRadius(), yBegin, yEnd, result, stride, false);
+}
+
 BlurFilter::BlurFilter(std::size_t radius) : MatrixFilter(BlurKernel(radius)) {}
 
 GaussianKernel::GaussianKernel(std::size_t radius, float sigma) : Kernel(radius) {
@@ -150,311 +607,1159 @@ GaussianKernel::GaussianKernel(std::size_t radius, float sigma) : Kernel(radius)
     }
 }
 
-GaussianFilter::GaussianFilter(std::size_t radius, float sigma) : MatrixFilter(GaussianKernel(radius, sigma)) {}
+void GaussianFilter::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    if (boxRadii.empty() || borderMode != BorderMode::Clamp) {
+        MatrixFilter::processRows(img, yBegin, yEnd, result, stride);
+        return;
+    }
 
-QColor GrayScaleFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    QColor color = img.pixelColor(x, y);
-    float intensity = calcColorIntensity(color);
-    color.setRgb(intensity, intensity, intensity);
-    return color;
-}
+    int width = img.width(), height = img.height();
+    // Current source of the chain, starting with the image itself
+    const QRgb *source = constRow(img, 0);
+    int sourceTop = 0, sourceStride = img.bytesPerLine() / sizeof(QRgb);
+    auto lines = [&](int y) { return source + std::ptrdiff_t(y - sourceTop) * sourceStride; };
+
+    // Every pass produces the band widened by the radii of the passes still to come
+    std::vector<QRgb> buffers[2];
+    int halo = 0;
+    for (int radius : boxRadii) {
+        halo += radius;
+    }
+    for (std::size_t k = 0; k < boxRadii.size(); k++) {
+        halo -= boxRadii[k];
+        if (k + 1 == boxRadii.size()) {
+            boxRows(lines, width, height, boxRadii[k], yBegin, yEnd, result, stride, true);
+            break;
+        }
 
-QColor SepiaFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    QColor color = img.pixelColor(x, y);
-    float intensity = calcColorIntensity(color);
-    color.setRgb(clamp(intensity + 2.f * coefficient, 0.f, 255.f), clamp(intensity + 0.5f * coefficient, 0.f, 255.f), clamp(intensity - 1.f * coefficient, 0.f, 255.f));
-    return color;
+        int top = std::max(yBegin - halo, 0), bottom = std::min(yEnd + halo, height);
+        std::vector<QRgb> &buffer = buffers[k % 2];
+        buffer.resize(std::size_t(bottom - top) * width);
+        boxRows(lines, width, height, boxRadii[k], top, bottom, buffer.data(), width, true);
+        source = buffer.data();
+        sourceTop = top;
+        sourceStride = width;
+    }
 }
 
-SepiaFilter::SepiaFilter(float coefficient) : coefficient(coefficient) {}
+// Widths of three boxes whose combined variance is closest to sigma^2: the lower odd width below
+// the ideal sqrt(12 sigma^2 / 3 + 1) for the first passes and the next odd width for the rest
+static std::vector<int> gaussianBoxRadii(float sigma) {
+    const int passes = 3;
+    float ideal = std::sqrt(12 * sigma * sigma / passes + 1);
+    int lower = std::max(static_cast<int>(std::floor(ideal)), 1);
+    if (lower % 2 == 0) {
+        lower--;
+    }
+    int upper = lower + 2;
+    int lowerPasses = static_cast<int>(std::round((12 * sigma * sigma - passes * lower * lower - 4 * passes * lower - 3 * passes) / (-4.f * lower - 4)));
 
-QColor BrightnessFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    QColor color = img.pixelColor(x, y);
-    color.setRgb(clamp(color.red() + coefficient, 0.f, 255.f), clamp(color.green() + coefficient, 0.f, 255.f), clamp(color.blue() + coefficient, 0.f, 255.f));
-    return color;
+    std::vector<int> radii;
+    for (int k = 0; k < passes; k++) {
+        radii.push_back(((k < lowerPasses ? lower : upper) - 1) / 2);
+    }
+    return radii;
 }
 
-BrightnessFilter::BrightnessFilter(float coefficient) : coefficient(coefficient) {}
+constexpr float GaussianFilter::minRecursiveSigma;
 
-SobelKernelX::SobelKernelX() : Kernel(1) {
-    data[0] = -1.f; data[1] = 0.f; data[2] = 1.f;
-    data[3] = -2.f; data[4] = 0.f; data[5] = 2.f;
-    data[6] = -1.f; data[7] = 0.f; data[8] = 1.f;
+GaussianFilter::GaussianFilter(std::size_t radius, float sigma, bool approximate) : MatrixFilter(GaussianKernel(radius, sigma)), recursiveSigma(0) {
+    if (approximate && sigma >= 2.f) {
+        boxRadii = gaussianBoxRadii(sigma);
+    } else if (sigma >= minRecursiveSigma && radius >= 2 * sigma) {
+        recursiveSigma = sigma;
+    }
 }
 
-SobelKernelY::SobelKernelY() : Kernel(1) {
-    data[0] = -1.f; data[1] = -2.f; data[2] = -1.f;
-    data[3] = 0.f;  data[4] = 0.f;  data[5] = 0.f;
-    data[6] = 1.f;  data[7] = 2.f;  data[8] = 1.f;
+int GaussianFilter::haloRadius() const {
+    if (recursiveSigma != 0 && borderMode == BorderMode::Clamp) {
+        return -1;
+    }
+    if (boxRadii.empty() || borderMode != BorderMode::Clamp) {
+        return MatrixFilter::haloRadius();
+    }
+    int radius = 0;
+    for (int boxRadius : boxRadii) {
+        radius += boxRadius;
+    }
+    return radius;
 }
 
-SobelFilterX::SobelFilterX() : MatrixFilter(SobelKernelX()) {}
+// Young-van Vliet recursion y[n] = b * x[n] + a1 * y[n - 1] + a2 * y[n - 2] + a3 * y[n - 3], and the
+// Triggs-Sdika matrix giving the last outputs of the backward pass for a signal clamped past its end
+struct RecursiveGaussian {
+    double b, a1, a2, a3;
+    double boundary[9];
+
+    RecursiveGaussian(float sigma) {
+        double q = sigma >= 2.5f ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+        double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+        a1 = (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0;
+        a2 = -(1.4281 * q * q + 1.26661 * q * q * q) / b0;
+        a3 = 0.422205 * q * q * q / b0;
+        b = 1 - (a1 + a2 + a3);
+
+        double scale = 1 / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) * (1 + a2 + (a1 - a3) * a3));
+        boundary[0] = scale * (-a3 * a1 + 1 - a3 * a3 - a2);
+        boundary[1] = scale * (a3 + a1) * (a2 + a3 * a1);
+        boundary[2] = scale * a3 * (a1 + a3 * a2);
+        boundary[3] = scale * (a1 + a3 * a2);
+        boundary[4] = -scale * (a2 - 1) * (a2 + a3 * a1);
+        boundary[5] = -scale * a3 * (a3 * a1 + a3 * a3 + a2 - 1);
+        boundary[6] = scale * (a3 * a1 + a2 + a1 * a1 - a2 * a2);
+        boundary[7] = scale * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3);
+        boundary[8] = scale * a3 * (a1 + a3 * a2);
+    }
 
-SobelFilterY::SobelFilterY() : MatrixFilter(SobelKernelY()) {}
+    // Forward and backward passes in place over `count` samples of `lanes` independent signals,
+    // sample i of lane k at data[i * step + k]
+    void filter(float *data, int count, std::ptrdiff_t step, int lanes) const {
+        std::vector<double> state(std::size_t(lanes) * 4);
+        double *y1 = state.data(), *y2 = y1 + lanes, *y3 = y2 + lanes, *last = y3 + lanes;
+        for (int k = 0; k < lanes; k++) {
+            y1[k] = y2[k] = y3[k] = data[k];
+            last[k] = data[(count - 1) * step + k];
+        }
 
-QColor DualFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
+        // A constant signal is a fixed point, so starting from the first sample clamps the front edge
+        for (int i = 0; i < count; i++) {
+            float *sample = data + i * step;
+            for (int k = 0; k < lanes; k++) {
+                y3[k] = b * sample[k] + a1 * y1[k] + a2 * y2[k] + a3 * y3[k];
+                sample[k] = y3[k];
+            }
+            std::swap(y3, y2);
+            std::swap(y2, y1);
+        }
 
-    std::size_t sizeX = kernelX.getSize() * kernelX.getSize(), lengthX = kernelX.getSize(), sizeY = kernelY.getSize() * kernelY.getSize(), lengthY = kernelY.getSize();
+        // y1..y3 hold the forward outputs at count - 1..count - 3, the backward outputs at count - 1, count and count + 1 follow
+        for (int k = 0; k < lanes; k++) {
+            double u0 = y1[k] - last[k], u1 = y2[k] - last[k], u2 = y3[k] - last[k];
+            double v0 = b * (boundary[0] * u0 + boundary[1] * u1 + boundary[2] * u2) + last[k];
+            double v1 = b * (boundary[3] * u0 + boundary[4] * u1 + boundary[5] * u2) + last[k];
+            double v2 = b * (boundary[6] * u0 + boundary[7] * u1 + boundary[8] * u2) + last[k];
+            data[(count - 1) * step + k] = v0;
+            y1[k] = v0;
+            y2[k] = v1;
+            y3[k] = v2;
+        }
 
-    float redX = 0, greenX = 0, blueX = 0, redY = 0, greenY = 0, blueY = 0;
-    for (std::size_t i = 0; i < sizeX; i++) {
-        QColor tmp = img.pixelColor(clamp((int)(x + (i % lengthX) - 1), 0, img.width() - 1), clamp((int)(y + (i / lengthX) - 1), 0, img.height() - 1));
-        redX += tmp.red() * kernelX[i];
-        greenX += tmp.green() * kernelX[i];
-        blueX += tmp.blue() * kernelX[i];
+        for (int i = count - 2; i >= 0; i--) {
+            float *sample = data + i * step;
+            for (int k = 0; k < lanes; k++) {
+                y3[k] = b * sample[k] + a1 * y1[k] + a2 * y2[k] + a3 * y3[k];
+                sample[k] = y3[k];
+            }
+            std::swap(y3, y2);
+            std::swap(y2, y1);
+        }
     }
+};
 
-    for (std::size_t i = 0; i < sizeY; i++) {
-        QColor tmp = img.pixelColor(clamp((int)(x + (i % lengthY) - 1), 0, img.width() - 1), clamp((int)(y + (i / lengthY) - 1), 0, img.height() - 1));
-        redY += tmp.red() * kernelY[i];
-        greenY += tmp.green() * kernelY[i];
-        blueY += tmp.blue() * kernelY[i];
+QImage GaussianFilter::process(const QImage &img) const {
+    if (recursiveSigma == 0 || borderMode != BorderMode::Clamp) {
+        return Filter::process(img);
     }
 
-    float returnR = std::sqrt(redX * redX + redY * redY), returnG = std::sqrt(greenX * greenX + greenY * greenY), returnB = std::sqrt(blueX * blueX + blueY * blueY);
+    TraceSpan span(this, int64_t(img.width()) * img.height());
+    ImageBuffer source = ImageBuffer::wrap(img);
+    int width = source.width(), height = source.height();
+    RecursiveGaussian gaussian(recursiveSigma);
+    ThreadPool &pool = ThreadPool::instance();
+
+    // Both passes need whole rows and columns, so the image goes through float planes
+    ImageBuffer planes(width, height, ImageBuffer::Layout::Planar, ImageBuffer::Sample::Float);
+    pool.parallelFor(0, height, bandHeight(height), [&](int yBegin, int yEnd) {
+        TraceBand band(span);
+        // Rows run with the three channels interleaved, three independent recursions per step
+        std::vector<float> samples(std::size_t(width) * 3);
+        for (int y = yBegin; y < yEnd; y++) {
+            const QRgb *line = constRow(source, y);
+            for (int x = 0; x < width; x++) {
+                samples[x * 3] = qRed(line[x]);
+                samples[x * 3 + 1] = qGreen(line[x]);
+                samples[x * 3 + 2] = qBlue(line[x]);
+            }
+            gaussian.filter(samples.data(), width, 3, 3);
+            float *red = planes.floatLine(0, y), *green = planes.floatLine(1, y), *blue = planes.floatLine(2, y);
+            for (int x = 0; x < width; x++) {
+                red[x] = samples[x * 3];
+                green[x] = samples[x * 3 + 1];
+                blue[x] = samples[x * 3 + 2];
+            }
+        }
+    });
+
+    // Columns in blocks, so that every step of the recursion is a contiguous run of the plane's row
+    const int blockWidth = 64;
+    int blocks = (width + blockWidth - 1) / blockWidth;
+    std::ptrdiff_t step = planes.bytesPerLine() / sizeof(float);
+    pool.parallelFor(0, 3 * blocks, 1, [&](int blockBegin, int blockEnd) {
+        TraceBand band(span);
+        for (int block = blockBegin; block < blockEnd; block++) {
+            int x = block % blocks * blockWidth;
+            gaussian.filter(planes.floatLine(block / blocks, 0) + x, height, step, std::min(blockWidth, width - x));
+        }
+    });
+
+    ImageBuffer result(width, height, ImageBuffer::Layout::Interleaved, ImageBuffer::Sample::UInt8, source.hasAlpha());
+    pool.parallelFor(0, height, bandHeight(height), [&](int yBegin, int yEnd) {
+        TraceBand band(span);
+        for (int y = yBegin; y < yEnd; y++) {
+            const float *red = planes.constFloatLine(0, y), *green = planes.constFloatLine(1, y), *blue = planes.constFloatLine(2, y);
+            QRgb *resultLine = result.line(y);
+            for (int x = 0; x < width; x++) {
+                resultLine[x] = qRgb(clamp(red[x], 0.f, 255.f) + 0.5f, clamp(green[x], 0.f, 255.f) + 0.5f, clamp(blue[x], 0.f, 255.f) + 0.5f);
+            }
+        }
+    });
+    return result.toQImage();
+}
 
-    QColor color(clamp(returnR, 0.f, 255.f), clamp(returnG, 0.f, 255.f), clamp(returnB, 0.f, 255.f));
+QRgb GrayScaleFilter::mapIntensity(float intensity) const {
+    int gray = intensity;
+    return qRgb(gray, gray, gray);
+}
 
-    return color;
+QRgb SepiaFilter::mapIntensity(float intensity) const {
+    return qRgb(clamp(intensity + 2.f * coefficient, 0.f, 255.f), clamp(intensity + 0.5f * coefficient, 0.f, 255.f), clamp(intensity - 1.f * coefficient, 0.f, 255.f));
 }
 
-DualFilter::DualFilter(Kernel kernelX, Kernel kernelY) : kernelX(kernelX), kernelY(kernelY) {}
+SepiaFilter::SepiaFilter(float coefficient) : coefficient(coefficient) {}
 
-SharpnessKernel::SharpnessKernel() : Kernel(1) {
-    data[0] = 0.f;  data[1] = -1.f; data[2] = 0.f;
-    data[3] = -1.f; data[4] = 5.f;  data[5] = -1.f;
-    data[6] = 0.f;  data[7] = -1.f; data[8] = 0.f;
+QRgb BrightnessFilter::map(QRgb color) const {
+    return qRgb(clamp(qRed(color) + coefficient, 0.f, 255.f), clamp(qGreen(color) + coefficient, 0.f, 255.f), clamp(qBlue(color) + coefficient, 0.f, 255.f));
 }
 
-SharpnessFilter::SharpnessFilter() : MatrixFilter(SharpnessKernel()) {}
+BrightnessFilter::BrightnessFilter(float coefficient) : coefficient(coefficient) {}
+
+PointFilterChain::PointFilterChain(std::initializer_list<std::shared_ptr<const PointFilter>> filters) : filters(filters) {}
 
-QColor GrayWorldFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    QColor color = img.pixelColor(x, y);
-    color.setRgb(clamp(avgFull / avgR * color.red(), 0.f, 255.f), clamp(avgFull / avgG * color.green(), 0.f, 255.f), clamp(avgFull / avgB * color.blue(), 0.f, 255.f));
+void PointFilterChain::append(std::shared_ptr<const PointFilter> filter) {
+    filters.push_back(filter);
+}
+
+QRgb PointFilterChain::map(QRgb color) const {
+    for (const auto &filter : filters) {
+        color = filter->map(color);
+    }
     return color;
 }
 
-QImage GrayWorldFilter::process(const QImage &img) {
-    avgR = 0.f; avgG = 0.f; avgB = 0.f; avgFull = 0.f;
-    for (int x = 0; x < img.width(); x++) {
-        for (int y = 0; y < img.height(); y++) {
-            QColor temp = img.pixelColor(x, y);
-            avgR += temp.red();
-            avgG += temp.green();
-            avgB += temp.blue();
+void PointFilterChain::compose(PointTable &table) const {
+    for (const auto &filter : filters) {
+        filter->compose(table);
+    }
+}
+
+// Row `order` of Pascal's triangle
+static std::vector<float> binomial(std::size_t order) {
+    std::vector<float> coefficients(order + 1, 0.f);
+    coefficients[0] = 1.f;
+    for (std::size_t i = 1; i <= order; i++) {
+        for (std::size_t j = i; j > 0; j--) {
+            coefficients[j] += coefficients[j - 1];
         }
     }
-    avgR /= img.width() * img.height();
-    avgG /= img.width() * img.height();
-    avgB /= img.width() * img.height();
-    avgFull = (avgR + avgG + avgB) / 3;
+    return coefficients;
+}
 
-    return Filter::process(img);
+// Smoothing of order 2r across the derivative, [-1, 0, 1] convolved with smoothing of order 2r - 2 along it
+static void sobelFactors(std::size_t radius, std::vector<float> &smoothing, std::vector<float> &derivative) {
+    smoothing = binomial(2 * radius);
+    std::vector<float> inner = binomial(2 * radius - 2);
+    derivative.assign(2 * radius + 1, 0.f);
+    for (std::size_t i = 0; i < inner.size(); i++) {
+        derivative[i] -= inner[i];
+        derivative[i + 2] += inner[i];
+    }
 }
 
-QColor PerfectReflectorFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    QColor color = img.pixelColor(x, y);
-    color.setRgb(clamp(255.f / maxR * color.red(), 0.f, 255.f), clamp(255.f / maxG * color.green(), 0.f, 255.f), clamp(255.f / maxB * color.blue(), 0.f, 255.f));
-    return color;
+SobelKernelX::SobelKernelX(std::size_t radius) : Kernel(radius) {
+    std::vector<float> smoothing, derivative;
+    sobelFactors(radius, smoothing, derivative);
+    for (std::size_t i = 0; i < getSize(); i++) {
+        for (std::size_t j = 0; j < getSize(); j++) {
+            data[i * getSize() + j] = smoothing[i] * derivative[j];
+        }
+    }
 }
 
-QImage PerfectReflectorFilter::process(const QImage &img) {
-    maxR = 0.f; maxG = 0.f; maxB = 0.f;
-    for (int x = 0; x < img.width(); x++) {
-        for (int y = 0; y < img.height(); y++) {
-            QColor temp = img.pixelColor(x, y);
-            if (maxR < temp.red()) {
-                maxR = temp.red();
-            }
-            if (maxG < temp.green()) {
-                maxG = temp.green();
-            }
-            if (maxB < temp.green()) {
-                maxB = temp.blue();
-            }
+SobelKernelY::SobelKernelY(std::size_t radius) : Kernel(radius) {
+    std::vector<float> smoothing, derivative;
+    sobelFactors(radius, smoothing, derivative);
+    for (std::size_t i = 0; i < getSize(); i++) {
+        for (std::size_t j = 0; j < getSize(); j++) {
+            data[i * getSize() + j] = derivative[i] * smoothing[j];
         }
     }
+}
 
-    return Filter::process(img);
+SobelFilterX::SobelFilterX(std::size_t radius) : MatrixFilter(SobelKernelX(radius)) {
+    if (radius == 1) {
+        staticStencil = StaticStencil3x3<SobelWeightsX>::convolveRow;
+    }
 }
 
-QColor HistogramLinearChange::calcNewPixelColor(const QImage &img, int x, int y) const {
-    QColor color = img.pixelColor(x, y);
-    color.setRgb(clamp(255.f * (color.red() - minR) / deltaR, 0.f, 255.f), clamp(255.f * (color.green() - minG) / deltaG, 0.f, 255.f), clamp(255.f * (color.blue() - minG) / deltaG, 0.f, 255.f));
-    return color;
+SobelFilterY::SobelFilterY(std::size_t radius) : MatrixFilter(SobelKernelY(radius)) {
+    if (radius == 1) {
+        staticStencil = StaticStencil3x3<SobelWeightsY>::convolveRow;
+    }
 }
 
-QImage HistogramLinearChange::process(const QImage &img) {
-    deltaR = 0.f; deltaG = 0.f; deltaB = 0.f; minR = 255.f; minG = 255.f; minB = 255.f;
-    for (int x = 0; x < img.width(); x++) {
-        for (int y = 0; y < img.height(); y++) {
-            QColor temp = img.pixelColor(x, y);
-            if (deltaR < temp.red()) {
-                deltaR = temp.red();
-            }
-            if (minR > temp.red()) {
-                minR = temp.red();
-            }
-            if (deltaG < temp.green()) {
-                deltaG = temp.green();
-            }
-            if (minG > temp.green()) {
-                minG = temp.green();
+void DualFilter::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    int width = img.width();
+    int radiusX = kernelX.getRadius(), radiusY = kernelY.getRadius(), radius = std::max(radiusX, radiusY);
+    BorderRows borders(width, radius, borderMode, borderColor);
+
+    std::vector<const QRgb *> lines(2 * radius + 1);
+    for (int i = -radius; i <= radius; i++) {
+        lines[i + radius] = borders.row([&](int line) { return constRow(img, line); }, y + i, img.height());
+    }
+
+    if (!stencilX.empty()) {
+        auto stencilRow = [&](const QRgb *const *rows, int count, QRgb *out) {
+            if (staticGradient) {
+                staticGradient(rows, count, magnitudeType, out);
+            } else {
+                Stencil3x3::gradientRow(rows, count, stencilX.data(), stencilY.data(), magnitudeType, out);
             }
-            if (deltaB < temp.green()) {
-                deltaB = temp.blue();
+        };
+        stencilRow(lines.data(), width, result);
+        // The stencils clamp their first and last pixels, which the other modes compute again
+        if (borderMode != BorderMode::Clamp) {
+            borders.forEachBorderRun(lines.data(), 3, [&](const QRgb *const *rows, int xBegin, int xEnd) {
+                QRgb run[3];
+                stencilRow(rows, xEnd - xBegin + 2, run);
+                std::copy(run + 1, run + 1 + xEnd - xBegin, result + xBegin);
+            });
+        }
+        return;
+    }
+
+    // Union of the taps of both kernels, each kernel centred on the pixel, as the row and column of the tap
+    // in the (2 * radius + 1) window
+    std::vector<int> tapRows, tapColumns;
+    std::vector<float> weightsX, weightsY;
+    for (int i = -radius; i <= radius; i++) {
+        for (int j = -radius; j <= radius; j++) {
+            float weightX = std::abs(i) <= radiusX && std::abs(j) <= radiusX ? kernelX[(i + radiusX) * kernelX.getSize() + j + radiusX] : 0.f;
+            float weightY = std::abs(i) <= radiusY && std::abs(j) <= radiusY ? kernelY[(i + radiusY) * kernelY.getSize() + j + radiusY] : 0.f;
+            if (weightX != 0.f || weightY != 0.f) {
+                tapRows.push_back(i + radius);
+                tapColumns.push_back(j + radius);
+                weightsX.push_back(weightX);
+                weightsY.push_back(weightY);
             }
-            if (minB > temp.blue()) {
-                minB = temp.blue();
+        }
+    }
+
+    // rows[i][k] is pixel origin + k of window row i
+    auto gradient = [&](const QRgb *const *rows, int origin, int xBegin, int xEnd) {
+        for (int x = xBegin; x < xEnd; x++) {
+            float redX = 0, greenX = 0, blueX = 0, redY = 0, greenY = 0, blueY = 0;
+            for (std::size_t k = 0; k < tapRows.size(); k++) {
+                QRgb tmp = rows[tapRows[k]][x - radius - origin + tapColumns[k]];
+                redX += qRed(tmp) * weightsX[k];
+                greenX += qGreen(tmp) * weightsX[k];
+                blueX += qBlue(tmp) * weightsX[k];
+                redY += qRed(tmp) * weightsY[k];
+                greenY += qGreen(tmp) * weightsY[k];
+                blueY += qBlue(tmp) * weightsY[k];
             }
+
+            result[x] = qRgb(Stencil3x3::gradientMagnitude(redX, redY, magnitudeType), Stencil3x3::gradientMagnitude(greenX, greenY, magnitudeType), Stencil3x3::gradientMagnitude(blueX, blueY, magnitudeType));
         }
+    };
+    gradient(lines.data(), 0, borders.interiorBegin(), borders.interiorEnd());
+    borders.forEachBorderRun(lines.data(), 2 * radius + 1, [&](const QRgb *const *rows, int xBegin, int xEnd) {
+        gradient(rows, xBegin - radius, xBegin, xEnd);
+    });
+}
+
+DualFilter::DualFilter(Kernel kernelX, Kernel kernelY, GradientMagnitude magnitudeType) : kernelX(kernelX), kernelY(kernelY), magnitudeType(magnitudeType), stencilX(integerStencil(kernelX)), stencilY(integerStencil(kernelY)), staticGradient(nullptr) {
+    if (stencilX.empty() || stencilY.empty()) {
+        stencilX.clear();
+        stencilY.clear();
     }
-    deltaR -= minR; deltaG -= minG; deltaB -= minB;
+}
 
-    return Filter::process(img);
+int DualFilter::haloRadius() const {
+    if (borderMode == BorderMode::Wrap) {
+        return -1;
+    }
+    return std::max(kernelX.getRadius(), kernelY.getRadius());
+}
+
+SharpnessKernel::SharpnessKernel() : Kernel(1) {
+    SharpnessWeights::copyTo(data.get());
+}
+
+SharpnessFilter::SharpnessFilter() : MatrixFilter(SharpnessKernel()) {
+    staticStencil = StaticStencil3x3<SharpnessWeights>::convolveRow;
+}
+
+void GrayWorldFilter::processRow(const ImageBuffer &, int, QRgb *) const {
+    throw std::logic_error("GrayWorldFilter: the correction needs the whole image, use process()");
+}
+
+PointTable GrayWorldFilter::correction(const ImageStatistics &statistics) const {
+    float avgR = statistics.mean(ImageStatistics::Red), avgG = statistics.mean(ImageStatistics::Green), avgB = statistics.mean(ImageStatistics::Blue);
+    float avgFull = (avgR + avgG + avgB) / 3;
+
+    // A channel that is zero everywhere has nothing to scale
+    return BaseColorCorrection(avgR ? avgFull / avgR : 1.f, avgG ? avgFull / avgG : 1.f, avgB ? avgFull / avgB : 1.f).table();
+}
+
+QImage GrayWorldFilter::process(const QImage &img) const {
+    TraceSpan span(this, int64_t(img.width()) * img.height());
+    ImageBuffer source = ImageBuffer::wrap(img);
+    return correction(ImageStatistics(source)).apply(source).toQImage();
+}
+
+void PerfectReflectorFilter::processRow(const ImageBuffer &, int, QRgb *) const {
+    throw std::logic_error("PerfectReflectorFilter: the correction needs the whole image, use process()");
+}
+
+PointTable PerfectReflectorFilter::correction(const ImageStatistics &statistics) const {
+    float maxR = statistics.maximum(ImageStatistics::Red), maxG = statistics.maximum(ImageStatistics::Green), maxB = statistics.maximum(ImageStatistics::Blue);
+    return BaseColorCorrection(maxR ? 255.f / maxR : 1.f, maxG ? 255.f / maxG : 1.f, maxB ? 255.f / maxB : 1.f).table();
+}
+
+QImage PerfectReflectorFilter::process(const QImage &img) const {
+    TraceSpan span(this, int64_t(img.width()) * img.height());
+    ImageBuffer source = ImageBuffer::wrap(img);
+    return correction(ImageStatistics(source)).apply(source).toQImage();
+}
+
+void HistogramLinearChange::processRow(const ImageBuffer &, int, QRgb *) const {
+    throw std::logic_error("HistogramLinearChange: the correction needs the whole image, use process()");
+}
+
+PointTable HistogramLinearChange::correction(const ImageStatistics &statistics) const {
+    PointTable lookup;
+    uchar *tables[3] = {lookup.red, lookup.green, lookup.blue};
+    ImageStatistics::Channel channels[3] = {ImageStatistics::Red, ImageStatistics::Green, ImageStatistics::Blue};
+    for (int k = 0; k < 3; k++) {
+        float min = statistics.minimum(channels[k]);
+        float delta = statistics.maximum(channels[k]) - min;
+        // A flat channel has no range to stretch and keeps its values
+        if (delta == 0) {
+            continue;
+        }
+        for (int v = 0; v < 256; v++) {
+            tables[k][v] = static_cast<uchar>(clamp(255.f * (v - min) / delta, 0.f, 255.f));
+        }
+    }
+    return lookup;
+}
+
+QImage HistogramLinearChange::process(const QImage &img) const {
+    TraceSpan span(this, int64_t(img.width()) * img.height());
+    ImageBuffer source = ImageBuffer::wrap(img);
+    return correction(ImageStatistics(source)).apply(source).toQImage();
 }
 
 ScharrKernelX::ScharrKernelX() : Kernel(1) {
-    data[0] = 3.f;  data[1] = 0.f; data[2] = -3.f;
-    data[3] = 10.f; data[4] = 0.f; data[5] = -10.f;
-    data[6] = 3.f;  data[7] = 0.f; data[8] = -3.f;
+    ScharrWeightsX::copyTo(data.get());
 }
 
 ScharrKernelY::ScharrKernelY() : Kernel(1) {
-    data[0] = 3.f;  data[1] = 10.f;  data[2] = 3.f;
-    data[3] = 0.f;  data[4] = 0.f;   data[5] = 0.f;
-    data[6] = -3.f; data[7] = -10.f; data[8] = -3.f;
+    ScharrWeightsY::copyTo(data.get());
 }
 
-SobelFilter::SobelFilter() : DualFilter(SobelKernelX(), SobelKernelY()) {}
+SobelFilter::SobelFilter(std::size_t radius, GradientMagnitude magnitudeType) : DualFilter(SobelKernelX(radius), SobelKernelY(radius), magnitudeType) {
+    if (radius == 1) {
+        staticGradient = StaticGradient3x3<SobelWeightsX, SobelWeightsY>::gradientRow;
+    }
+}
 
-ScharrFilter::ScharrFilter() : DualFilter(ScharrKernelX(), ScharrKernelY()) {}
+ScharrFilter::ScharrFilter(GradientMagnitude magnitudeType) : DualFilter(ScharrKernelX(), ScharrKernelY(), magnitudeType) {
+    staticGradient = StaticGradient3x3<ScharrWeightsX, ScharrWeightsY>::gradientRow;
+}
 
 PrewittKernelX::PrewittKernelX() : Kernel(1) {
-    data[0] = -1.f; data[1] = 0.f; data[2] = 1.f;
-    data[3] = -1.f; data[4] = 0.f; data[5] = 1.f;
-    data[6] = -1.f; data[7] = 0.f; data[8] = 1.f;
+    PrewittWeightsX::copyTo(data.get());
 }
 
 PrewittKernelY::PrewittKernelY() : Kernel(1) {
-    data[0] = -1.f; data[1] = -1.f; data[2] = -1.f;
-    data[3] = 0.f;  data[4] = 0.f;  data[5] = 0.f;
-    data[6] = 1.f;  data[7] = 1.f;  data[8] = 1.f;
+    PrewittWeightsY::copyTo(data.get());
 }
 
-PrewittFilter::PrewittFilter() : DualFilter(PrewittKernelX(), PrewittKernelY()) {}
+PrewittFilter::PrewittFilter(GradientMagnitude magnitudeType) : DualFilter(PrewittKernelX(), PrewittKernelY(), magnitudeType) {
+    staticGradient = StaticGradient3x3<PrewittWeightsX, PrewittWeightsY>::gradientRow;
+}
 
 Sharpness2Kernel::Sharpness2Kernel() : Kernel(1) {
-    data[0] = -1.f; data[1] = -1.f; data[2] = -1.f;
-    data[3] = -1.f; data[4] = 9.f;  data[5] = -1.f;
-    data[6] = -1.f; data[7] = -1.f; data[8] = -1.f;
+    Sharpness2Weights::copyTo(data.get());
 }
 
-Sharpness2Filter::Sharpness2Filter() : MatrixFilter(Sharpness2Kernel()) {}
+Sharpness2Filter::Sharpness2Filter() : MatrixFilter(Sharpness2Kernel()) {
+    staticStencil = StaticStencil3x3<Sharpness2Weights>::convolveRow;
+}
+
+static const auto maximum = [](int a, int b) { return std::max(a, b); };
+static const auto minimum = [](int a, int b) { return std::min(a, b); };
 
-QColor MathematicalMorphologyFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    int returnR = stdData.red, returnG = stdData.green, returnB = stdData.blue;
+template <typename Lines>
+void MathematicalMorphologyFilter::windowRows(Lines lines, int height, int y, const BorderRows &borders, std::vector<const QRgb *> &rows) const {
+    int radius = mKernel.getRadius();
+    rows.resize(mKernel.getSize());
+    for (int i = -radius; i <= radius; i++) {
+        rows[i + radius] = borders.row(lines, y + i, height);
+    }
+}
+
+void MathematicalMorphologyFilter::kernelTaps(std::vector<int> &tapRows, std::vector<int> &tapColumns) const {
     int size = mKernel.getSize();
+
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            if (mKernel[i * size + j]) {
+                tapRows.push_back(i);
+                tapColumns.push_back(j);
+            }
+        }
+    }
+}
+
+template <typename Lines, typename Operation>
+void MathematicalMorphologyFilter::morphologyRow(Lines lines, int width, int height, int y, QRgb *result, int initial, Operation operation) const {
     int radius = mKernel.getRadius();
+    BorderRows borders(width, radius, borderMode, borderColor);
+    std::vector<const QRgb *> rows;
+    windowRows(lines, height, y, borders, rows);
+    std::vector<int> tapRows, tapColumns;
+    kernelTaps(tapRows, tapColumns);
+
+    // rows[i][k] is pixel origin + k of window row i
+    auto apply = [&](const QRgb *const *window, int origin, int xBegin, int xEnd) {
+        for (int x = xBegin; x < xEnd; x++) {
+            int returnR = initial, returnG = initial, returnB = initial;
+
+            for (std::size_t k = 0; k < tapRows.size(); k++) {
+                QRgb color = window[tapRows[k]][x - radius - origin + tapColumns[k]];
+                returnR = operation(qRed(color), returnR);
+                returnG = operation(qGreen(color), returnG);
+                returnB = operation(qBlue(color), returnB);
+            }
 
-    for (int i = -radius; i <= radius; i++) {
-        for (int j = -radius; j <= radius; j++) {
-            int idx = (i + radius) * size + j + radius;
-            if (mKernel[idx]) {
-                QColor color = img.pixelColor(clamp(x + j, 0, img.width() - 1), clamp(y + i, 0, img.height() - 1));
-                pixelProcess(color.red(), returnR);
-                pixelProcess(color.green(), returnG);
-                pixelProcess(color.blue(), returnB);
+            result[x] = qRgb(clamp(returnR, 0, 255), clamp(returnG, 0, 255), clamp(returnB, 0, 255));
+        }
+    };
+    apply(rows.data(), 0, borders.interiorBegin(), borders.interiorEnd());
+    borders.forEachBorderRun(rows.data(), static_cast<int>(rows.size()), [&](const QRgb *const *window, int xBegin, int xEnd) {
+        apply(window, xBegin - radius, xBegin, xEnd);
+    });
+}
+
+// Window operation over every run of `window` consecutive pixels, out gets count - window + 1 pixels.
+// Prefix results inside blocks of `window` pixels and suffix results inside the same blocks
+// cover any window with two of them.
+template <typename Operation>
+static void vanHerkRow(const QRgb *in, int count, int window, QRgb *out, std::vector<QRgb> &prefix, std::vector<QRgb> &suffix, Operation operation) {
+    auto combine = [&](QRgb a, QRgb b) {
+        return qRgba(operation(qRed(a), qRed(b)), operation(qGreen(a), qGreen(b)), operation(qBlue(a), qBlue(b)), operation(qAlpha(a), qAlpha(b)));
+    };
+    prefix.resize(count);
+    suffix.resize(count);
+    for (int i = 0; i < count; i++) {
+        prefix[i] = i % window ? combine(prefix[i - 1], in[i]) : in[i];
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        suffix[i] = i == count - 1 || (i + 1) % window == 0 ? in[i] : combine(suffix[i + 1], in[i]);
+    }
+    for (int i = 0; i + window <= count; i++) {
+        out[i] = combine(suffix[i], prefix[i + window - 1]);
+    }
+}
+
+// Channel by channel on whole rows, which compilers turn into packed byte min/max
+template <typename Operation>
+static void combineRows(uchar *destination, const uchar *a, const uchar *b, std::size_t bytes, Operation operation) {
+    for (std::size_t i = 0; i < bytes; i++) {
+        destination[i] = operation(a[i], b[i]);
+    }
+}
+
+template <typename Lines, typename Operation>
+void MathematicalMorphologyFilter::rectangleRows(Lines lines, int width, int height, int yBegin, int yEnd, QRgb *result, int stride, Operation operation) const {
+    int radius = mKernel.getRadius();
+    int paddedWidth = width + 2 * radius;
+    int top = yBegin - radius, rows = yEnd - yBegin + 2 * radius;
+    int bandRows = yEnd - yBegin;
+    std::size_t rowBytes = std::size_t(width) * sizeof(QRgb);
+
+    // Source rows [top, top + rows) padded by radius pixels on both sides, all following the border mode
+    BorderRows borders(width, radius, borderMode, borderColor);
+    std::vector<QRgb> padded(std::size_t(rows) * paddedWidth);
+    for (int r = 0; r < rows; r++) {
+        borders.extend(borders.row(lines, top + r, height), -radius, width + radius, &padded[std::size_t(r) * paddedWidth]);
+    }
+
+    // Horizontal pass once per distinct rectangle width, pixel p covers padded pixels [p, p + w)
+    std::vector<std::vector<QRgb>> horizontal(mKernel.getSize() + 1);
+    std::vector<QRgb> prefix, suffix;
+    for (const QRect &rectangle : rectangles) {
+        int w = rectangle.width();
+        if (w == 1 || !horizontal[w].empty()) {
+            continue;
+        }
+        horizontal[w].resize(std::size_t(rows) * (paddedWidth - w + 1));
+        for (int r = 0; r < rows; r++) {
+            vanHerkRow(&padded[std::size_t(r) * paddedWidth], paddedWidth, w, &horizontal[w][std::size_t(r) * (paddedWidth - w + 1)], prefix, suffix, operation);
+        }
+    }
+
+    // Vertical pass per rectangle over the rows the band needs, merged into the accumulator
+    std::vector<QRgb> accumulator(std::size_t(bandRows) * width);
+    std::vector<QRgb> columnPrefix, columnSuffix;
+    bool first = true;
+    for (const QRect &rectangle : rectangles) {
+        int w = rectangle.width(), h = rectangle.height();
+        const QRgb *source = w == 1 ? padded.data() : horizontal[w].data();
+        int sourceWidth = paddedWidth - w + 1, column = rectangle.x() + radius;
+        auto sourceRow = [&](int r) { return reinterpret_cast<const uchar *>(source + std::size_t(r) * sourceWidth + column); };
+        auto accumulatorRow = [&](int r) { return reinterpret_cast<uchar *>(&accumulator[std::size_t(r) * width]); };
+
+        // Output row y reads source rows [y + rectangle.y(), y + rectangle.y() + h)
+        int firstRow = yBegin + rectangle.y() - top, count = bandRows + h - 1;
+        if (h > 1) {
+            columnPrefix.resize(std::size_t(count) * width);
+            columnSuffix.resize(std::size_t(count) * width);
+            auto prefixRow = [&](int r) { return reinterpret_cast<uchar *>(&columnPrefix[std::size_t(r) * width]); };
+            auto suffixRow = [&](int r) { return reinterpret_cast<uchar *>(&columnSuffix[std::size_t(r) * width]); };
+            for (int r = 0; r < count; r++) {
+                if (r % h) {
+                    combineRows(prefixRow(r), prefixRow(r - 1), sourceRow(firstRow + r), rowBytes, operation);
+                } else {
+                    std::copy(sourceRow(firstRow + r), sourceRow(firstRow + r) + rowBytes, prefixRow(r));
+                }
+            }
+            for (int r = count - 1; r >= 0; r--) {
+                if (r == count - 1 || (r + 1) % h == 0) {
+                    std::copy(sourceRow(firstRow + r), sourceRow(firstRow + r) + rowBytes, suffixRow(r));
+                } else {
+                    combineRows(suffixRow(r), suffixRow(r + 1), sourceRow(firstRow + r), rowBytes, operation);
+                }
+            }
+            for (int r = 0; r < bandRows; r++) {
+                if (first) {
+                    combineRows(accumulatorRow(r), suffixRow(r), prefixRow(r + h - 1), rowBytes, operation);
+                } else {
+                    combineRows(accumulatorRow(r), accumulatorRow(r), suffixRow(r), rowBytes, operation);
+                    combineRows(accumulatorRow(r), accumulatorRow(r), prefixRow(r + h - 1), rowBytes, operation);
+                }
+            }
+        } else {
+            for (int r = 0; r < bandRows; r++) {
+                if (first) {
+                    std::copy(sourceRow(firstRow + r), sourceRow(firstRow + r) + rowBytes, accumulatorRow(r));
+                } else {
+                    combineRows(accumulatorRow(r), accumulatorRow(r), sourceRow(firstRow + r), rowBytes, operation);
+                }
+            }
+        }
+        first = false;
+    }
+
+    for (int r = 0; r < bandRows; r++, result += stride) {
+        const QRgb *line = &accumulator[std::size_t(r) * width];
+        for (int x = 0; x < width; x++) {
+            result[x] = line[x] | 0xff000000;
+        }
+    }
+}
+
+template <typename Lines, typename Operation>
+void MathematicalMorphologyFilter::morphologyRows(Lines lines, int width, int height, int yBegin, int yEnd, QRgb *result, int stride, int initial, Operation operation) const {
+    if (rectangles.empty()) {
+        for (int y = yBegin; y < yEnd; y++, result += stride) {
+            morphologyRow(lines, width, height, y, result, initial, operation);
+        }
+        return;
+    }
+    rectangleRows(lines, width, height, yBegin, yEnd, result, stride, operation);
+}
+
+// Rows the composites compute at a time. Their buffers hold a chunk and 2 * radius rows, whatever the band's
+// height, and the van Herk passes pay their 2 * radius rows of halo once per chunk.
+static int chunkRows(int radius) {
+    return std::max(64, 8 * radius);
+}
+
+void MathematicalMorphologyFilter::compositeRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, bool opening) const {
+    int width = img.width(), height = img.height();
+    int radius = mKernel.getRadius();
+    int chunk = chunkRows(radius);
+    auto imageLines = [&](int y) { return constRow(img, y); };
+
+    // First pass rows go round a ring, row v of the band's window in slot v mod ringRows. A chunk of the second
+    // pass reads rows [c0 - radius, c1 + radius), which the ring still holds once they are computed. Wrapped rows
+    // are the image rows congruent to them mod height, at most two segments per chunk; an image no taller than
+    // the ring is kept whole instead.
+    bool wrap = borderMode == BorderMode::Wrap;
+    int ringRows = std::min(chunk, yEnd - yBegin) + 2 * radius;
+    bool whole = wrap && ringRows >= height;
+    if (whole) {
+        ringRows = height;
+    }
+    int next = whole ? 0 : wrap ? yBegin - radius : std::max(yBegin - radius, 0);
+    std::vector<QRgb> ring(std::size_t(std::min(ringRows, height)) * width);
+    auto modulo = [](int v, int n) { return (v % n + n) % n; };
+    auto slot = [&](int v) { return &ring[std::size_t(modulo(v, ringRows)) * width]; };
+    // The second pass asks for image rows, under Wrap the window row congruent to one is found from its top
+    int windowTop = 0;
+    auto ringLines = [&](int y) { return slot(wrap && !whole ? windowTop + modulo(y - windowTop, height) : y); };
+
+    // Each pass is a span of its own, nested in the filter's
+    auto run = [&](const char *firstName, int firstInitial, auto first, const char *secondName, int secondInitial, auto second) {
+        for (int c0 = yBegin; c0 < yEnd; c0 += chunk) {
+            int c1 = std::min(c0 + chunk, yEnd);
+            int last = whole ? height : wrap ? c1 + radius : std::min(c1 + radius, height);
+            if (next < last) {
+                TraceSpan pass(firstName, int64_t(last - next) * width);
+                // Pieces cross neither the end of the ring nor the image's last row, so each is contiguous
+                for (int end; next < last; next = end) {
+                    int y = modulo(next, height);
+                    end = std::min({last, next + ringRows - modulo(next, ringRows), next + height - y});
+                    morphologyRows(imageLines, width, height, y, y + end - next, slot(next), width, firstInitial, first);
+                }
             }
+            windowTop = c0 - radius;
+            TraceSpan pass(secondName, int64_t(c1 - c0) * width);
+            morphologyRows(ringLines, width, height, c0, c1, result + std::size_t(c0 - yBegin) * stride, stride, secondInitial, second);
         }
+    };
+    if (opening) {
+        run("erosion", 255, minimum, "dilation", 0, maximum);
+    } else {
+        run("dilation", 0, maximum, "erosion", 255, minimum);
     }
+}
+
+// Runs of cells in every kernel row, identical runs in consecutive rows merged into one rectangle
+static std::vector<QRect> kernelRectangles(const Kernel &kernel) {
+    int size = kernel.getSize(), radius = kernel.getRadius();
+    std::vector<QRect> rectangles, open;
+    for (int i = 0; i <= size; i++) {
+        std::vector<QRect> runs;
+        for (int j = 0; i < size && j < size; j++) {
+            if (kernel[i * size + j] && (j == 0 || !kernel[i * size + j - 1])) {
+                runs.push_back(QRect(j - radius, i - radius, 1, 1));
+            } else if (kernel[i * size + j]) {
+                runs.back().setWidth(runs.back().width() + 1);
+            }
+        }
+
+        std::vector<QRect> stillOpen;
+        for (QRect &rectangle : open) {
+            auto same = std::find_if(runs.begin(), runs.end(), [&](const QRect &run) { return run.x() == rectangle.x() && run.width() == rectangle.width(); });
+            if (same != runs.end()) {
+                rectangle.setHeight(rectangle.height() + 1);
+                stillOpen.push_back(rectangle);
+                runs.erase(same);
+            } else {
+                rectangles.push_back(rectangle);
+            }
+        }
+        stillOpen.insert(stillOpen.end(), runs.begin(), runs.end());
+        open.swap(stillOpen);
+    }
+    return rectangles;
+}
+
+MathematicalMorphologyFilter::MathematicalMorphologyFilter(const Kernel &kernel) : MatrixFilter(kernel, StructuringElement()) {
+    if (mKernel.getRadius() == 0 || mKernel.getRadius() > 1024) {
+        return;
+    }
+
+    // Comparisons per pixel and channel: one per cell when visiting every cell, three per
+    // horizontal and per vertical van Herk pass plus one to merge each rectangle
+    std::vector<QRect> candidates = kernelRectangles(mKernel);
+    int cells = 0, cost = 0;
+    std::vector<bool> widthSeen(mKernel.getSize() + 1, false);
+    for (const QRect &rectangle : candidates) {
+        cells += rectangle.width() * rectangle.height();
+        cost += (rectangle.height() > 1 ? 3 : 0) + 1;
+        if (rectangle.width() > 1 && !widthSeen[rectangle.width()]) {
+            widthSeen[rectangle.width()] = true;
+            cost += 3;
+        }
+    }
+    if (cost < cells) {
+        rectangles.swap(candidates);
+    }
+}
 
-    return QColor(clamp(returnR, 0, 255), clamp(returnG, 0, 255), clamp(returnB, 0, 255));
+void Dilation::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    morphologyRow([&](int line) { return constRow(img, line); }, img.width(), img.height(), y, result, 0, maximum);
 }
 
-MathematicalMorphologyFilter::MathematicalMorphologyFilter(const Kernel &kernel) : MatrixFilter(kernel) {}
+void Dilation::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    morphologyRows([&](int line) { return constRow(img, line); }, img.width(), img.height(), yBegin, yEnd, result, stride, 0, maximum);
+}
+
+Dilation::Dilation(const Kernel &kernel) : MathematicalMorphologyFilter(kernel) {}
 
-void Dilation::pixelProcess(int processData, int &storageData) const {
-    storageData = std::max(processData, storageData);
+void Erosion::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    morphologyRow([&](int line) { return constRow(img, line); }, img.width(), img.height(), y, result, 255, minimum);
 }
 
-Dilation::Dilation(const Kernel &kernel) : MathematicalMorphologyFilter(kernel) {
-    stdData.red = 0; stdData.green = 0; stdData.blue = 0;
+void Erosion::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    morphologyRows([&](int line) { return constRow(img, line); }, img.width(), img.height(), yBegin, yEnd, result, stride, 255, minimum);
 }
 
-void Erosion::pixelProcess(int processData, int &storageData) const {
-    storageData = std::min(processData, storageData);
+Erosion::Erosion(const Kernel &kernel) : MathematicalMorphologyFilter(kernel) {}
+
+Opening::Opening(const Kernel &kernel) : MathematicalMorphologyFilter(kernel) {}
+
+int Opening::haloRadius() const {
+    int radius = MatrixFilter::haloRadius();
+    return radius < 0 ? radius : 2 * radius;
 }
 
-Erosion::Erosion(const Kernel &kernel) : MathematicalMorphologyFilter(kernel) {
-    stdData.red = 255; stdData.green = 255; stdData.blue = 255;
+void Opening::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    processRows(img, y, y + 1, result, img.width());
 }
 
-Opening::Opening(const Kernel &kernel) : MatrixFilter(kernel) {}
+void Opening::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    compositeRows(img, yBegin, yEnd, result, stride, true);
+}
+
+Closing::Closing(const Kernel &kernel) : MathematicalMorphologyFilter(kernel) {}
 
-QImage Opening::process(const QImage &img) const {
-    Dilation dilation(mKernel);
-    Erosion erosion(mKernel);
-    return dilation.process(erosion.process(img));
+int Closing::haloRadius() const {
+    int radius = MatrixFilter::haloRadius();
+    return radius < 0 ? radius : 2 * radius;
 }
 
-Closing::Closing(const Kernel &kernel) : MatrixFilter(kernel) {}
+void Closing::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    processRows(img, y, y + 1, result, img.width());
+}
 
-QImage Closing::process(const QImage &img) const {
-    Dilation dilation(mKernel);
-    Erosion erosion(mKernel);
-    return erosion.process(dilation.process(img));
+void Closing::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    compositeRows(img, yBegin, yEnd, result, stride, false);
 }
 
-MorphologicalGradient::MorphologicalGradient(const Kernel &kernel) : MatrixFilter(kernel) {}
+MorphologicalGradient::MorphologicalGradient(const Kernel &kernel) : MathematicalMorphologyFilter(kernel) {}
 
-QImage MorphologicalGradient::process(const QImage &img) const {
-    Dilation dilation(mKernel);
-    Erosion erosion(mKernel);
+void MorphologicalGradient::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    int width = img.width();
+    int radius = mKernel.getRadius();
+    BorderRows borders(width, radius, borderMode, borderColor);
+    std::vector<const QRgb *> rows;
+    windowRows([&](int line) { return constRow(img, line); }, img.height(), y, borders, rows);
+    std::vector<int> tapRows, tapColumns;
+    kernelTaps(tapRows, tapColumns);
+
+    auto apply = [&](const QRgb *const *window, int origin, int xBegin, int xEnd) {
+        for (int x = xBegin; x < xEnd; x++) {
+            int maxR = 0, maxG = 0, maxB = 0;
+            int minR = 255, minG = 255, minB = 255;
+
+            for (std::size_t k = 0; k < tapRows.size(); k++) {
+                QRgb color = window[tapRows[k]][x - radius - origin + tapColumns[k]];
+                maxR = std::max(maxR, qRed(color));
+                maxG = std::max(maxG, qGreen(color));
+                maxB = std::max(maxB, qBlue(color));
+                minR = std::min(minR, qRed(color));
+                minG = std::min(minG, qGreen(color));
+                minB = std::min(minB, qBlue(color));
+            }
+
+            result[x] = qRgb(clamp(maxR - minR, 0, 255), clamp(maxG - minG, 0, 255), clamp(maxB - minB, 0, 255));
+        }
+    };
+    apply(rows.data(), 0, borders.interiorBegin(), borders.interiorEnd());
+    borders.forEachBorderRun(rows.data(), static_cast<int>(rows.size()), [&](const QRgb *const *window, int xBegin, int xEnd) {
+        apply(window, xBegin - radius, xBegin, xEnd);
+    });
+}
+
+void MorphologicalGradient::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    if (rectangles.empty()) {
+        Filter::processRows(img, yBegin, yEnd, result, stride);
+        return;
+    }
 
-    return imageDifference(dilation.process(img), erosion.process(img));
+    // The van Herk passes keep one extremum per prefix, so the erosion goes to a side buffer, a chunk at a time
+    int width = img.width(), height = img.height();
+    int chunk = chunkRows(mKernel.getRadius());
+    auto imageLines = [&](int y) { return constRow(img, y); };
+    std::vector<QRgb> eroded(std::size_t(std::min(chunk, yEnd - yBegin)) * width);
+    for (int c0 = yBegin; c0 < yEnd; c0 += chunk) {
+        int c1 = std::min(c0 + chunk, yEnd);
+        int64_t pixels = int64_t(c1 - c0) * width;
+        QRgb *rows = result + std::size_t(c0 - yBegin) * stride;
+        {
+            TraceSpan dilation("dilation", pixels);
+            rectangleRows(imageLines, width, height, c0, c1, rows, stride, maximum);
+        }
+        {
+            TraceSpan erosion("erosion", pixels);
+            rectangleRows(imageLines, width, height, c0, c1, eroded.data(), width, minimum);
+        }
+        TraceSpan difference("difference", pixels);
+        for (int y = c0; y < c1; y++, rows += stride) {
+            differenceRow(rows, &eroded[std::size_t(y - c0) * width], width, rows);
+        }
+    }
+}
+
+MorphologicalTopHat::MorphologicalTopHat(const Kernel &kernel) : MathematicalMorphologyFilter(kernel) {}
+
+int MorphologicalTopHat::haloRadius() const {
+    int radius = MatrixFilter::haloRadius();
+    return radius < 0 ? radius : 2 * radius;
+}
+
+void MorphologicalTopHat::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    processRows(img, y, y + 1, result, img.width());
+}
+
+void MorphologicalTopHat::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    {
+        TraceSpan opening("opening", int64_t(yEnd - yBegin) * img.width());
+        compositeRows(img, yBegin, yEnd, result, stride, true);
+    }
+    TraceSpan difference("difference", int64_t(yEnd - yBegin) * img.width());
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        differenceRow(constRow(img, y), result, img.width(), result);
+    }
 }
 
-MorphologicalTopHat::MorphologicalTopHat(const Kernel &kernel) : MatrixFilter(kernel) {}
+MorphologicalBlackHat::MorphologicalBlackHat(const Kernel &kernel) : MathematicalMorphologyFilter(kernel) {}
 
-QImage MorphologicalTopHat::process(const QImage &img) const {
-    Opening opening(mKernel);
+int MorphologicalBlackHat::haloRadius() const {
+    int radius = MatrixFilter::haloRadius();
+    return radius < 0 ? radius : 2 * radius;
+}
 
-    return imageDifference(img, opening.process(img));
+void MorphologicalBlackHat::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    processRows(img, y, y + 1, result, img.width());
 }
 
-MorphologicalBlackHat::MorphologicalBlackHat(const Kernel &kernel) : MatrixFilter(kernel) {}
+void MorphologicalBlackHat::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    {
+        TraceSpan closing("closing", int64_t(yEnd - yBegin) * img.width());
+        compositeRows(img, yBegin, yEnd, result, stride, false);
+    }
+    TraceSpan difference("difference", int64_t(yEnd - yBegin) * img.width());
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        differenceRow(result, constRow(img, y), img.width(), result);
+    }
+}
+
+void MedianFilter::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    int width = img.width();
+    std::vector<int> red(size), green(size), blue(size);
+    BorderRows borders(width, radius, borderMode, borderColor);
+
+    std::vector<const QRgb *> lines(diameter);
+    for (int j = 0; j < diameter; j++) {
+        lines[j] = borders.row([&](int line) { return constRow(img, line); }, y + j - radius, img.height());
+    }
+
+    // rows[j][k] is pixel origin + k of window row j
+    auto select = [&](const QRgb *const *rows, int origin, int xBegin, int xEnd) {
+        for (int x = xBegin; x < xEnd; x++) {
+            for (int i = 0; i < diameter; i++) {
+                int sourceX = x + i - radius - origin;
+                for (int j = 0; j < diameter; j++) {
+                    QRgb temp = rows[j][sourceX];
+                    red[i * diameter + j] = qRed(temp);
+                    green[i * diameter + j] = qGreen(temp);
+                    blue[i * diameter + j] = qBlue(temp);
+                }
+            }
 
-QImage MorphologicalBlackHat::process(const QImage &img) const {
-    Closing closing(mKernel);
+            std::nth_element(red.begin(), red.begin() + rank, red.end());
+            std::nth_element(green.begin(), green.begin() + rank, green.end());
+            std::nth_element(blue.begin(), blue.begin() + rank, blue.end());
 
-    return imageDifference(closing.process(img), img);
+            result[x] = qRgb(red[rank], green[rank], blue[rank]);
+        }
+    };
+    select(lines.data(), 0, borders.interiorBegin(), borders.interiorEnd());
+    borders.forEachBorderRun(lines.data(), diameter, [&](const QRgb *const *rows, int xBegin, int xEnd) {
+        select(rows, xBegin - radius, xBegin, xEnd);
+    });
 }
 
-QColor MedianFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    int red[size], green[size], blue[size];
-    for (int i = 0; i < diameter; i++) {
-        for (int j = 0; j < diameter; j++) {
-            QColor temp = img.pixelColor(clamp(x + i - radius, 0, img.width() - 1), clamp(y + j - radius, 0, img.width() - 1));
-            red[i * diameter + j] = temp.red();
-            green[i * diameter + j] = temp.green();
-            blue[i * diameter + j] = temp.blue();
+// Window histogram of one channel, the 16 coarse bins bound a rank lookup to 32 steps
+struct RankHistogram {
+    std::uint32_t coarse[16];
+    std::uint32_t fine[256];
+
+    void clear() {
+        std::fill(coarse, coarse + 16, 0u);
+        std::fill(fine, fine + 256, 0u);
+    }
+
+    void add(int value) {
+        coarse[value >> 4]++;
+        fine[value]++;
+    }
+
+    void remove(int value) {
+        coarse[value >> 4]--;
+        fine[value]--;
+    }
+
+    int select(std::uint32_t rank) const {
+        int bin = 0;
+        while (rank >= coarse[bin]) {
+            rank -= coarse[bin++];
+        }
+        int value = bin << 4;
+        while (rank >= fine[value]) {
+            rank -= fine[value++];
         }
+        return value;
     }
+};
 
-    std::sort(red, red + size);
-    std::sort(green, green + size);
-    std::sort(blue, blue + size);
+// Histogram of one channel over the 2r+1 window rows of one image column
+struct ColumnHistogram {
+    std::uint16_t coarse[16];
+    std::uint16_t fine[256];
+};
 
-    return QColor(red[size / 2], green[size / 2], blue[size / 2]);
+static void addColumn(RankHistogram &histogram, const ColumnHistogram &column) {
+    for (int i = 0; i < 16; i++) {
+        histogram.coarse[i] += column.coarse[i];
+    }
+    for (int i = 0; i < 256; i++) {
+        histogram.fine[i] += column.fine[i];
+    }
 }
 
-MedianFilter::MedianFilter(size_t radius) : radius(radius), diameter(2 * radius + 1), size(diameter * diameter) {}
+static void replaceColumn(RankHistogram &histogram, const ColumnHistogram &added, const ColumnHistogram &removed) {
+    for (int i = 0; i < 16; i++) {
+        histogram.coarse[i] += added.coarse[i] - removed.coarse[i];
+    }
+    for (int i = 0; i < 256; i++) {
+        histogram.fine[i] += added.fine[i] - removed.fine[i];
+    }
+}
 
-QColor BaseColorCorrection::calcNewPixelColor(const QImage &img, int x, int y) const {
-    QColor color = img.pixelColor(x, y);
-    color.setRgb(clamp(coeffR * color.red(), 0.f, 255.f), clamp(coeffG * color.green(), 0.f, 255.f), clamp(coeffB * color.blue(), 0.f, 255.f));
-    return color;
+void MedianFilter::slidingHistogramRow(const ImageBuffer &img, int y, QRgb *result) const {
+    int width = img.width();
+    BorderRows borders(width, radius, borderMode, borderColor);
+    std::vector<const QRgb *> lines(diameter);
+    for (int j = 0; j < diameter; j++) {
+        lines[j] = borders.row([&](int line) { return constRow(img, line); }, y + j - radius, img.height());
+    }
+
+    RankHistogram histograms[3];
+    for (RankHistogram &histogram : histograms) {
+        histogram.clear();
+    }
+    // Columns outside the image only come up within a radius of its sides
+    auto updateColumn = [&](int x, bool add) {
+        bool inside = x >= 0 && x < width;
+        for (const QRgb *line : lines) {
+            QRgb color = inside ? line[x] : borders.pixel(line, x);
+            if (add) {
+                histograms[0].add(qRed(color)); histograms[1].add(qGreen(color)); histograms[2].add(qBlue(color));
+            } else {
+                histograms[0].remove(qRed(color)); histograms[1].remove(qGreen(color)); histograms[2].remove(qBlue(color));
+            }
+        }
+    };
+
+    for (int i = -radius; i <= radius; i++) {
+        updateColumn(i, true);
+    }
+    for (int x = 0; x < width; x++) {
+        if (x > 0) {
+            updateColumn(x - radius - 1, false);
+            updateColumn(x + radius, true);
+        }
+        result[x] = qRgb(histograms[0].select(rank), histograms[1].select(rank), histograms[2].select(rank));
+    }
+}
+
+void MedianFilter::columnHistogramRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    int width = img.width(), height = img.height();
+    BorderRows borders(width, radius, borderMode, borderColor);
+    // Three histograms per column, red, green and blue. Column width holds the constant colour in every row.
+    std::vector<ColumnHistogram> columns(std::size_t(width + 1) * 3, ColumnHistogram());
+    int values[3] = {qRed(borderColor), qGreen(borderColor), qBlue(borderColor)};
+    for (int channel = 0; channel < 3; channel++) {
+        ColumnHistogram &column = columns[std::size_t(width) * 3 + channel];
+        column.coarse[values[channel] >> 4] = static_cast<std::uint16_t>(diameter);
+        column.fine[values[channel]] = static_cast<std::uint16_t>(diameter);
+    }
+    auto columnIndex = [&](int x) {
+        int source = borderCoordinate(x, width, borderMode);
+        return std::size_t(source < 0 ? width : source) * 3;
+    };
+    auto updateRow = [&](int y, int delta) {
+        const QRgb *line = borders.row([&](int row) { return constRow(img, row); }, y, height);
+        for (int x = 0; x < width; x++) {
+            int values[3] = {qRed(line[x]), qGreen(line[x]), qBlue(line[x])};
+            for (int channel = 0; channel < 3; channel++) {
+                ColumnHistogram &column = columns[std::size_t(x) * 3 + channel];
+                column.coarse[values[channel] >> 4] += delta;
+                column.fine[values[channel]] += delta;
+            }
+        }
+    };
+
+    for (int i = -radius; i <= radius; i++) {
+        updateRow(yBegin + i, 1);
+    }
+
+    RankHistogram histograms[3];
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        if (y > yBegin) {
+            updateRow(y - radius - 1, -1);
+            updateRow(y + radius, 1);
+        }
+
+        for (int channel = 0; channel < 3; channel++) {
+            histograms[channel].clear();
+            for (int i = -radius; i <= radius; i++) {
+                addColumn(histograms[channel], columns[columnIndex(i) + channel]);
+            }
+        }
+        for (int x = 0; x < width; x++) {
+            if (x > 0) {
+                std::size_t added = columnIndex(x + radius), removed = columnIndex(x - radius - 1);
+                for (int channel = 0; channel < 3; channel++) {
+                    replaceColumn(histograms[channel], columns[added + channel], columns[removed + channel]);
+                }
+            }
+            result[x] = qRgb(histograms[0].select(rank), histograms[1].select(rank), histograms[2].select(rank));
+        }
+    }
+}
+
+void MedianFilter::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    if (radius <= maxSortRadius) {
+        Filter::processRows(img, yBegin, yEnd, result, stride);
+    } else if (radius <= maxSlidingHistogramRadius) {
+        for (int y = yBegin; y < yEnd; y++, result += stride) {
+            slidingHistogramRow(img, y, result);
+        }
+    } else {
+        columnHistogramRows(img, yBegin, yEnd, result, stride);
+    }
+}
+
+MedianFilter::MedianFilter(size_t radius, float percentile) : radius(radius), diameter(2 * radius + 1), size(diameter * diameter), rank(std::lround(clamp(percentile, 0.f, 1.f) * (size - 1))) {}
+
+int MedianFilter::haloRadius() const {
+    if (borderMode == BorderMode::Wrap) {
+        return -1;
+    }
+    return radius;
+}
+
+QRgb BaseColorCorrection::map(QRgb color) const {
+    return qRgb(clamp(coeffR * qRed(color), 0.f, 255.f), clamp(coeffG * qGreen(color), 0.f, 255.f), clamp(coeffB * qBlue(color), 0.f, 255.f));
 }
 
 BaseColorCorrection::BaseColorCorrection(float coeffR, float coeffG, float coeffB) : coeffR(coeffR), coeffG(coeffG), coeffB(coeffB) {}
@@ -462,29 +1767,24 @@ BaseColorCorrection::BaseColorCorrection(float coeffR, float coeffG, float coeff
 BaseColorCorrection::BaseColorCorrection(int sourceR, int sourceG, int sourceB, int destR, int destG, int destB) : coeffR(float(destR) / float(sourceR)), coeffG(float(destG) / float(sourceG)), coeffB(float(destB) / float(sourceB)) {}
 
 QImage BaseColorCorrection::process(const QImage &img) const {
-    return Filter::process(img);
+    return PointFilter::process(img);
 }
 
 QImage BaseColorCorrection::process(const QImage &img, int sourceX, int sourceY, int destR, int destG, int destB) {
     float baseR = coeffR, baseG = coeffG, baseB = coeffB;
-    QColor color = img.pixelColor(sourceX, sourceY);
-    coeffR = (float(destR) / float(color.red()));
-    coeffG = (float(destG) / float(color.green()));
-    coeffB = (float(destB) / float(color.blue()));
+    QRgb color = img.pixel(sourceX, sourceY);
+    coeffR = (float(destR) / float(qRed(color)));
+    coeffG = (float(destG) / float(qGreen(color)));
+    coeffB = (float(destB) / float(qBlue(color)));
 
-    QImage result = Filter::process(img);
+    QImage result = PointFilter::process(img);
     coeffR = baseR; coeffG = baseG; coeffB = baseB;
 
     return result;
 }
 
-QColor MoveFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    x += deltaX; y += deltaY;
-    if (clamp(x, 0, img.width() - 1) == x && clamp(y, 0, img.height() - 1) == y) {
-        return img.pixelColor(x, y);
-    } else {
-        return QColor(0, 0, 0);
-    }
+void MoveFilter::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    Warp::translateRow(img, y, deltaX, deltaY, result);
 }
 
 MoveFilter::MoveFilter(int deltaX, int deltaY) : deltaX(deltaX), deltaY(deltaY) {}
@@ -501,20 +1801,18 @@ QImage MoveFilter::process(const QImage &img, int dX, int dY) {
     return result;
 }
 
-QColor RotateFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-//    float tmpX = x + centerX * (cos(angle) - 1) - centerY * sin(angle), tmpY = y + centerX * sin(angle) + centerY * (cos(angle) - 1);
-//    x = cos(angle) * tmpX + sin(angle) * tmpY;
-//    y = cos(angle) * tmpY - sin(angle) * tmpX;
-    int tmpX = (x - centerX) * cos(angle) - (y - centerY) * sin(angle) + centerY, tmpY = (x - centerX) * sin(angle) + (y - centerY) * cos(angle) + centerY;
-    if (clamp(tmpX, 0, img.width() - 1) == tmpX && clamp(tmpY, 0, img.height() - 1) == tmpY) {
-        return img.pixelColor(tmpX, tmpY);
-    } else {
-        return QColor(0, 0, 0);
-    }
+// Source of (x, y) is the centre plus (x - centerX, y - centerY) rotated by angle
+AffineMap RotateFilter::inverseMap() const {
+    double cosAngle = std::cos(angle), sinAngle = std::sin(angle);
+    return {cosAngle, -sinAngle, centerX - centerX * cosAngle + centerY * sinAngle,
+            sinAngle, cosAngle, centerY - centerX * sinAngle - centerY * cosAngle};
+}
 
+void RotateFilter::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    Warp::affineRow(img, inverseMap(), y, interpolation, result);
 }
 
-RotateFilter::RotateFilter(int centerX, int centerY, float angle) : centerX(centerX), centerY(centerY), angle(angle) {}
+RotateFilter::RotateFilter(int centerX, int centerY, float angle, Interpolation interpolation) : centerX(centerX), centerY(centerY), angle(angle), interpolation(interpolation) {}
 
 QImage RotateFilter::process(const QImage &img) const {
     return Filter::process(img);
@@ -529,13 +1827,34 @@ QImage RotateFilter::process(const QImage &img, int cX, int cY, float ang) {
     return result;
 }
 
-QColor WavesFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    int tmpX = x + 20 * sin(2 * M_PI * (filterType == 0 ? x : y) / coefficient);
-    if (clamp(tmpX, 0, img.width() - 1) == tmpX) {
-        return img.pixelColor(tmpX, y);
+void WavesFilter::sourceColumns(int width, int y, std::vector<int> &columns) const {
+    columns.resize(width);
+    if (filterType == 0) {
+        for (int x = 0; x < width; x++) {
+            columns[x] = x + 20 * sin(2 * M_PI * x / coefficient);
+        }
+    } else {
+        double offset = 20 * sin(2 * M_PI * y / coefficient);
+        for (int x = 0; x < width; x++) {
+            columns[x] = x + offset;
+        }
     }
-    else {
-        return QColor(0, 0, 0);
+}
+
+void WavesFilter::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    std::vector<int> columns;
+    sourceColumns(img.width(), y, columns);
+    Warp::remapRow(img, y, columns.data(), result);
+}
+
+void WavesFilter::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const {
+    // Waves along x displace every row the same way, waves along y shift each row by one offset
+    std::vector<int> columns;
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        if (y == yBegin || filterType != 0) {
+            sourceColumns(img.width(), y, columns);
+        }
+        Warp::remapRow(img, y, columns.data(), result);
     }
 }
 
@@ -545,6 +1864,11 @@ QImage WavesFilter::process(const QImage &img) const {
     return Filter::process(img);
 }
 
+int WavesFilter::haloRadius() const {
+    // Waves along y shift each row by an amount that depends on the row
+    return filterType == 0 ? 0 : -1;
+}
+
 QImage WavesFilter::process(const QImage &img, float sigma, int filterAxis) {
     float baseCoeff = coefficient; WavesFilterType baseType = filterType;
     coefficient = sigma; filterType = static_cast<WavesFilterType>(filterAxis);
@@ -553,14 +1877,18 @@ QImage WavesFilter::process(const QImage &img, float sigma, int filterAxis) {
     return result;
 }
 
-QColor GlassFilter::calcNewPixelColor(const QImage &img, int x, int y) const {
-    int tmpX = x + 10 * (static_cast<float>(rand()) / static_cast<float>(RAND_MAX) - 0.5f), tmpY = y + 10 * (static_cast<float>(rand()) / static_cast<float>(RAND_MAX) - 0.5f);
-    return img.pixelColor(clamp(tmpX, 0, img.width() - 1), clamp(tmpY, 0, img.height() - 1));
+void GlassFilter::processRow(const ImageBuffer &img, int y, QRgb *result) const {
+    int width = img.width();
+    std::vector<float> offsetsX(width), offsetsY(width);
+    random.uniformRow(y, 0, width, offsetsX.data());
+    random.uniformRow(y, 1, width, offsetsY.data());
+    for (int x = 0; x < width; x++) {
+        int tmpX = x + 10 * (offsetsX[x] - 0.5f), tmpY = y + 10 * (offsetsY[x] - 0.5f);
+        result[x] = constRow(img, clamp(tmpY, 0, img.height() - 1))[clamp(tmpX, 0, width - 1)];
+    }
 }
 
-GlassFilter::GlassFilter() {
-    srand(static_cast<unsigned int>(time(0)));
-}
+GlassFilter::GlassFilter(uint64_t seed) : random(seed) {}
 
 MotionBlurKernel::MotionBlurKernel(size_t n) : Kernel(n) {
     for (size_t i = 0; i < n ; i++) {
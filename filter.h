@@ -2,23 +2,96 @@
 
 #include <memory>
 #include <cmath>
+#include <vector>
 #include <QImage>
+#include <QRect>
+#include "border.h"
+#include "fftconvolution.h"
+#include "fixedpoint.h"
+#include "imagebuffer.h"
+#include "imagestatistics.h"
+#include "random.h"
+#include "stencil.h"
+#include "warp.h"
 
 QImage imageDifference(const QImage &img1, const QImage &img2);
 
 class Filter {
 protected:
-    virtual QColor calcNewPixelColor(const QImage &img, int x, int y) const = 0;
-    static float calcColorIntensity(const QColor &color);
+    virtual void processRow(const ImageBuffer &img, int y, QRgb *result) const = 0;
+    // Computes rows [yBegin, yEnd), result points at row yBegin and rows are stride pixels apart
+    virtual void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const;
+    // Whether different rows may be processed concurrently
+    virtual bool isReentrant() const;
+    static float calcColorIntensity(QRgb color);
+
+    BorderMode borderMode;
+    QRgb borderColor;
 
 public:
+    Filter();
     virtual ~Filter() = default;
     virtual QImage process(const QImage &img) const;
+    // Rows of input needed above and below an output row, -1 when the filter needs the whole image or depends
+    // on where the row lies in it. FilterGraph streams filters with a radius through strips of rows.
+    virtual int haloRadius() const;
+    // What the neighbourhood filters (convolutions, gradients, morphology and rank filters) read outside the
+    // image, Clamp by default. color is the one of Constant. Wrap reads the opposite edge, so a filter wrapping
+    // has no halo radius.
+    void setBorderMode(BorderMode mode, QRgb color = qRgb(0, 0, 0));
+    BorderMode getBorderMode() const { return borderMode; }
+
+    friend class FilterGraph;
+};
+
+// Lookup tables of a chain of point filters. Channels go through their own table first; once a filter of the
+// chain works on the intensity, the rest of the chain is tabulated over that intensity in 1/intensitySteps steps.
+struct PointTable {
+    static const int intensitySteps = 16;
+
+    uchar red[256], green[256], blue[256];
+    // Weighted terms of calcColorIntensity() for every value of red[], green[] and blue[]
+    float redIntensity[256], greenIntensity[256], blueIntensity[256];
+    // Output over intensity * intensitySteps, empty while the channels stay independent
+    std::vector<QRgb> intensity;
+
+    PointTable();
+    void applyRow(const QRgb *line, int width, QRgb *result) const;
+    ImageBuffer apply(const ImageBuffer &img) const;
+    QImage apply(const QImage &img) const;
+};
+
+// Filters whose output pixel only depends on the same input pixel. They are evaluated through a PointTable,
+// so a pixel costs three lookups whatever the filter, and chains of them fuse into one pass (PointFilterChain).
+class PointFilter : public Filter {
+protected:
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
+public:
+    // Output for one input color. Unless compose() is overridden, every output channel must only depend
+    // on the same input channel
+    virtual QRgb map(QRgb color) const = 0;
+    // Appends this filter to the tables of the filters before it
+    virtual void compose(PointTable &table) const;
+    PointTable table() const;
+    QImage process(const QImage &img) const override;
+    int haloRadius() const override;
 };
 
-class InvertFilter : public Filter {
-protected:
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+// Point filters that only look at calcColorIntensity() of the input. Their table is exact when the output only
+// changes at multiples of 1 / PointTable::intensitySteps of the intensity, as for GrayScaleFilter. Otherwise pixels
+// right next to a step may land one level off, e.g. about 1 in 30000 for SepiaFilter, where float rounding of
+// intensity + coefficient moves its steps slightly.
+class IntensityFilter : public PointFilter {
+public:
+    virtual QRgb mapIntensity(float intensity) const = 0;
+    QRgb map(QRgb color) const override;
+    void compose(PointTable &table) const override;
+};
+
+class InvertFilter : public PointFilter {
+public:
+    QRgb map(QRgb color) const override;
 };
 
 class Kernel {
@@ -34,11 +107,14 @@ public:
     Kernel(const Kernel &other);
     Kernel(float *kernel, size_t len);
     Kernel(std::string path);
+    Kernel(const std::vector<float> &factor);
+    Kernel(const std::vector<float> &columnFactor, const std::vector<float> &rowFactor);
 
     std::size_t getRadius() const;
     std::size_t getSize() const;
     void print() const;
     void setKernel(float *kernel, size_t len);
+    bool separate(std::vector<float> &columnFactor, std::vector<float> &rowFactor) const;
     float operator[](std::size_t id) const;
     float& operator[](std::size_t id);
 };
@@ -46,11 +122,32 @@ public:
 class MatrixFilter : public Filter {
 protected:
     Kernel mKernel;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    // Non-empty when mKernel is rank-1, i.e. mKernel[i * size + j] == columnFactor[i] * rowFactor[j]
+    std::vector<float> columnFactor, rowFactor;
+    // Non-empty when mKernel is a 3x3 integer stencil evaluated by Stencil3x3
+    std::vector<int> stencil;
+    // Set by the built-in 3x3 filters, the stencil with its weights compiled in
+    StencilRow staticStencil;
+    // Set for the other kernels, used for the rows where its cost model beats the direct path
+    std::shared_ptr<const FftConvolution> fft;
+    // Integer weights of the separable and direct paths, exact for integer kernels. Unset when the float path
+    // has to do the work, the sums could overflow or fixed point is turned off.
+    std::shared_ptr<const FixedPointConvolution> fixedPoint;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
+
+    // The kernel is a structuring element, never a set of convolution weights: none of the paths above is set up
+    struct StructuringElement {};
+    MatrixFilter(const Kernel &kernel, StructuringElement);
 
 public:
     MatrixFilter(const Kernel &kernel);
     virtual ~MatrixFilter() = default;
+    // Fraction bits of the rounded weights of non-integer kernels, 0 for the float path. Defaults to
+    // FixedPointConvolution::defaultFractionBits.
+    void setFractionBits(int bits);
+    QImage process(const QImage &img) const override;
+    int haloRadius() const override;
 };
 
 class BlurKernel : public Kernel {
@@ -58,7 +155,12 @@ public:
     BlurKernel(std::size_t radius = 2);
 };
 
+// Mean of the (2r+1)x(2r+1) window from integer running sums: a constant amount of work per pixel
+// whatever the radius, and the exact truncated mean rather than a sum of float weights. Border modes other
+// than Clamp go through the kernel.
 class BlurFilter : public MatrixFilter {
+protected:
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
     BlurFilter(std::size_t radius = 2);
 };
@@ -68,59 +170,102 @@ public:
     GaussianKernel(std::size_t radius = 2, float sigma = 3.f);
 };
 
+// With approximate set and sigma >= 2, the filter runs three box blurs whose widths are chosen so that their
+// variance matches sigma (the radius is then ignored and the Gaussian is not truncated). Cost no longer depends
+// on sigma, at the price of a piecewise quadratic instead of a Gaussian profile: about one level of mean
+// difference, more next to hard edges. Smaller sigmas keep the exact kernel, three boxes cannot resolve them.
+//
+// Otherwise, from sigma = minRecursiveSigma on and when the radius covers at least two sigmas, the kernel is
+// replaced by the third order recursive Gaussian of Young and van Vliet, with Triggs-Sdika initialisation of the
+// backward pass so the border is clamped exactly like the kernel's. It costs the same for any sigma. Its impulse
+// response deviates from the true Gaussian by up to 2.5% of the peak at sigma 8 and less for larger sigmas, and
+// it is not truncated at the radius: against an untruncated Gaussian, results are within one level on average,
+// with at most a few levels next to hard edges.
+//
+// Both approximations clamp the border, the kernel is used with the other border modes.
 class GaussianFilter : public MatrixFilter {
+protected:
+    // Box radii of the approximation, empty for the exact kernel
+    std::vector<int> boxRadii;
+    // Sigma of the recursive filter, 0 when the kernel is used
+    float recursiveSigma;
+
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
-    GaussianFilter(std::size_t radius = 2, float sigma = 3.f);
+    static constexpr float minRecursiveSigma = 8.f;
+
+    QImage process(const QImage &img) const override;
+    int haloRadius() const override;
+    GaussianFilter(std::size_t radius = 2, float sigma = 3.f, bool approximate = false);
 };
 
-class GrayScaleFilter : public Filter {
-protected:
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+class GrayScaleFilter : public IntensityFilter {
+public:
+    QRgb mapIntensity(float intensity) const override;
 };
 
-class SepiaFilter : public Filter {
+class SepiaFilter : public IntensityFilter {
 protected:
     float coefficient;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
 public:
     SepiaFilter(float coefficient = 15.f);
+    QRgb mapIntensity(float intensity) const override;
 };
 
-class BrightnessFilter : public Filter {
+class BrightnessFilter : public PointFilter {
 protected:
     float coefficient;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
 public:
     BrightnessFilter(float coefficient = 100.f);
+    QRgb map(QRgb color) const override;
+};
+
+// Point filters applied one after the other, compiled into a single table and a single pass over the image
+class PointFilterChain : public PointFilter {
+protected:
+    std::vector<std::shared_ptr<const PointFilter>> filters;
+public:
+    PointFilterChain(std::initializer_list<std::shared_ptr<const PointFilter>> filters = {});
+    void append(std::shared_ptr<const PointFilter> filter);
+    QRgb map(QRgb color) const override;
+    void compose(PointTable &table) const override;
 };
 
+// Radius 1 is the classic 3x3 operator, larger radii use binomial smoothing (5x5 Sobel etc.)
 class SobelKernelX : public Kernel {
 public:
-    SobelKernelX();
+    SobelKernelX(std::size_t radius = 1);
 };
 
 class SobelKernelY : public Kernel {
 public:
-    SobelKernelY();
+    SobelKernelY(std::size_t radius = 1);
 };
 
 class SobelFilterX : public MatrixFilter {
 public:
-    SobelFilterX();
+    SobelFilterX(std::size_t radius = 1);
 };
 
 class SobelFilterY : public MatrixFilter {
 public:
-    SobelFilterY();
+    SobelFilterY(std::size_t radius = 1);
 };
 
+// Combines the responses of two kernels of any (possibly different) radius into a gradient magnitude,
+// fetching every neighbourhood pixel once for both kernels
 class DualFilter : public Filter {
 protected:
     Kernel kernelX;
     Kernel kernelY;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    GradientMagnitude magnitudeType;
+    std::vector<int> stencilX, stencilY;
+    // Set by the built-in 3x3 filters, the pair of stencils with their weights compiled in
+    GradientRow staticGradient;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
 public:
-    DualFilter(Kernel kernelX, Kernel kernelY);
+    int haloRadius() const override;
+    DualFilter(Kernel kernelX, Kernel kernelY, GradientMagnitude magnitudeType = GradientMagnitude::Euclidean);
 };
 
 class SharpnessKernel : public Kernel {
@@ -133,28 +278,30 @@ public:
     SharpnessFilter();
 };
 
+// The three filters below measure the image first and then apply a per-channel correction table. Only process()
+// runs them, it takes the statistics once for the whole image; processRow() throws std::logic_error.
 class GrayWorldFilter : public Filter {
 protected:
-    float avgR, avgG, avgB, avgFull;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
 public:
-    QImage process(const QImage &img);
+    PointTable correction(const ImageStatistics &statistics) const;
+    QImage process(const QImage &img) const override;
 };
 
 class PerfectReflectorFilter : public Filter {
 protected:
-    float maxR, maxG, maxB;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
 public:
-    QImage process(const QImage &img);
+    PointTable correction(const ImageStatistics &statistics) const;
+    QImage process(const QImage &img) const override;
 };
 
 class HistogramLinearChange : public Filter {
 protected:
-    float deltaR, deltaG, deltaB, minR, minG, minB;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
 public:
-    QImage process(const QImage &img);
+    PointTable correction(const ImageStatistics &statistics) const;
+    QImage process(const QImage &img) const override;
 };
 
 class ScharrKernelX : public Kernel {
@@ -169,12 +316,12 @@ public:
 
 class SobelFilter : public DualFilter {
 public:
-    SobelFilter();
+    SobelFilter(std::size_t radius = 1, GradientMagnitude magnitudeType = GradientMagnitude::Euclidean);
 };
 
 class ScharrFilter : public DualFilter {
 public:
-    ScharrFilter();
+    ScharrFilter(GradientMagnitude magnitudeType = GradientMagnitude::Euclidean);
 };
 
 class PrewittKernelX : public Kernel {
@@ -189,7 +336,7 @@ public:
 
 class PrewittFilter : public DualFilter {
 public:
-    PrewittFilter();
+    PrewittFilter(GradientMagnitude magnitudeType = GradientMagnitude::Euclidean);
 };
 
 class Sharpness2Kernel : public Kernel {
@@ -202,78 +349,123 @@ public:
     Sharpness2Filter();
 };
 
+// The nonzero cells of the kernel form the structuring element. When it splits into few enough
+// rectangles (squares, rectangles, horizontal and vertical lines and unions of them) every rectangle
+// is processed with the van Herk/Gil-Werman algorithm, about three comparisons per pixel whatever its size.
 class MathematicalMorphologyFilter : public MatrixFilter {
 protected:
-    virtual void pixelProcess(int processData, int &storageData) const = 0;
-    struct StdData {
-        int red; int green; int blue;
-    } stdData;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    // Offsets relative to the kernel centre, empty when visiting every cell is cheaper
+    std::vector<QRect> rectangles;
+
+    // Sources are given by lines(y), row y of a width x height image for y inside it
+    template <typename Lines>
+    void windowRows(Lines lines, int height, int y, const BorderRows &borders, std::vector<const QRgb *> &rows) const;
+    // Window row and column of every cell of the structuring element
+    void kernelTaps(std::vector<int> &tapRows, std::vector<int> &tapColumns) const;
+    template <typename Lines, typename Operation>
+    void morphologyRow(Lines lines, int width, int height, int y, QRgb *result, int initial, Operation operation) const;
+    template <typename Lines, typename Operation>
+    void rectangleRows(Lines lines, int width, int height, int yBegin, int yEnd, QRgb *result, int stride, Operation operation) const;
+    template <typename Lines, typename Operation>
+    void morphologyRows(Lines lines, int width, int height, int yBegin, int yEnd, QRgb *result, int stride, int initial, Operation operation) const;
+    // Rows [yBegin, yEnd) of an erosion followed by a dilation (opening) or the reverse (closing).
+    // The band goes through in chunks, the first pass rows they read wait in a ring of a chunk and 2 * radius
+    // rows, so no intermediate image is allocated and the buffers do not grow with the band, whatever the border.
+    void compositeRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, bool opening) const;
 public:
     MathematicalMorphologyFilter(const Kernel &kernel);
 };
 
 class Dilation : public MathematicalMorphologyFilter {
 protected:
-    void pixelProcess(int processData, int &storageData) const;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
     Dilation(const Kernel &kernel);
 };
 
 class Erosion : public MathematicalMorphologyFilter {
 protected:
-    void pixelProcess(int processData, int &storageData) const;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
     Erosion(const Kernel &kernel);
 };
 
-class Opening : public MatrixFilter {
+class Opening : public MathematicalMorphologyFilter {
+protected:
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
     Opening(const Kernel &kernel);
-    QImage process(const QImage &img) const override;
+    // The second pass reads the first one's rows up to a radius away
+    int haloRadius() const override;
 };
 
-class Closing : public MatrixFilter {
+class Closing : public MathematicalMorphologyFilter {
+protected:
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
     Closing(const Kernel &kernel);
-    QImage process(const QImage &img) const override;
+    int haloRadius() const override;
 };
 
-class MorphologicalGradient : public MatrixFilter {
+// Dilation minus erosion, both taken in the same sweep over the neighbourhood
+class MorphologicalGradient : public MathematicalMorphologyFilter {
+protected:
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
     MorphologicalGradient(const Kernel &kernel);
-    QImage process(const QImage &img) const override;
 };
 
-class MorphologicalTopHat : public MatrixFilter {
+class MorphologicalTopHat : public MathematicalMorphologyFilter {
+protected:
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
     MorphologicalTopHat(const Kernel &kernel);
-    QImage process(const QImage &img) const override;
+    int haloRadius() const override;
 };
 
-class MorphologicalBlackHat : public MatrixFilter {
+class MorphologicalBlackHat : public MathematicalMorphologyFilter {
+protected:
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
     MorphologicalBlackHat(const Kernel &kernel);
-    QImage process(const QImage &img) const override;
+    int haloRadius() const override;
 };
 
+// Rank filter over a (2r+1)x(2r+1) window, percentile 0.5 is the median, 0 the minimum and 1 the maximum.
+// Radius 0 goes through the sorting path, radii up to maxSlidingHistogramRadius use Huang's sliding
+// histogram (O(r) per pixel) and larger ones the Perreault-Hebert column histograms (O(1) per pixel).
 class MedianFilter : public Filter {
 protected:
     int radius;
     int diameter;
     int size;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    int rank;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
+    void slidingHistogramRow(const ImageBuffer &img, int y, QRgb *result) const;
+    void columnHistogramRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const;
 public:
-    MedianFilter(size_t radius = 2);
+    static const int maxSortRadius = 0;
+    static const int maxSlidingHistogramRadius = 14;
+
+    MedianFilter(size_t radius = 2, float percentile = 0.5f);
+    int haloRadius() const override;
 };
 
-class BaseColorCorrection : public Filter {
+class BaseColorCorrection : public PointFilter {
 protected:
     float coeffR, coeffG, coeffB;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
 public:
     BaseColorCorrection(float coeffR = 1.f, float coeffG = 1.f, float coeffB = 1.f);
     BaseColorCorrection(int sourceR, int sourceG, int sourceB, int destR, int destG, int destB);
+    QRgb map(QRgb color) const override;
     QImage process(const QImage &img) const override;
     QImage process(const QImage &img, int sourceX, int sourceY, int destR, int destG, int destB);
 };
@@ -281,7 +473,7 @@ public:
 class MoveFilter : public Filter {
 protected:
     int deltaX, deltaY;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
 public:
     MoveFilter(int deltaX = 0, int deltaY = 0);
     QImage process(const QImage &img) const override;
@@ -291,9 +483,11 @@ public:
 class RotateFilter : public Filter {
     int centerX, centerY;
     float angle;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    Interpolation interpolation;
+    AffineMap inverseMap() const;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
 public:
-    RotateFilter(int centerX = 0, int centerY = 0, float angle = 0);
+    RotateFilter(int centerX = 0, int centerY = 0, float angle = 0, Interpolation interpolation = Interpolation::Nearest);
     QImage process(const QImage &img) const override;
     QImage process(const QImage &img, int cX, int cY, float ang);
 };
@@ -303,18 +497,25 @@ protected:
     typedef enum {x, y} WavesFilterType;
     float coefficient;
     WavesFilterType filterType;
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    // Source column of every pixel of row y, the same for all rows when the waves run along x
+    void sourceColumns(int width, int y, std::vector<int> &columns) const;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride) const override;
 public:
     WavesFilter(float sigma = 30.f, int filterType = 0);
     QImage process(const QImage &img) const override;
     QImage process(const QImage &img, float sigma, int filterType = 0);
+    int haloRadius() const override;
 };
 
+// Every pixel is taken from a random spot up to 5 pixels away. The offsets only depend on the seed and the pixel,
+// so the output is the same for a given seed whatever the threads or tiles
 class GlassFilter : public Filter {
 protected:
-    QColor calcNewPixelColor(const QImage &img, int x, int y) const override;
+    CounterRandom random;
+    void processRow(const ImageBuffer &img, int y, QRgb *result) const override;
 public:
-    GlassFilter();
+    GlassFilter(uint64_t seed = 0);
 };
 
 class MotionBlurKernel : public Kernel {
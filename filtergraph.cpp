@@ -0,0 +1,367 @@
+#include "filtergraph.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// Bytes of one intermediate strip, so the strips of a few stages fit in L2 next to the filters' own buffers
+static const int stripBytes = 256 * 1024;
+
+struct FilterGraph::Stage {
+    std::shared_ptr<const Filter> filter;
+    Node input;
+    int halo;
+    // Set when the stage is a chain of point filters, evaluated through its table
+    std::shared_ptr<PointFilterChain> points;
+    // Point filters fused after a stage that is not one, applied in place to its rows
+    std::shared_ptr<PointFilterChain> tail;
+    PointTable table, tailTable;
+    std::vector<Node> consumers;
+    bool needed, output, fused;
+    // Whole output, once materialized
+    ImageBuffer image;
+};
+
+const FilterGraph::Node FilterGraph::source;
+
+FilterGraph::FilterGraph() : filters(1), inputs(1, source) {}
+
+FilterGraph::Node FilterGraph::add(std::shared_ptr<const Filter> filter, Node input) {
+    if (!filter || input < 0 || input >= static_cast<Node>(filters.size())) throw std::invalid_argument("FilterGraph: no filter or no such input node");
+    filters.push_back(filter);
+    inputs.push_back(input);
+    return static_cast<Node>(filters.size()) - 1;
+}
+
+FilterGraph::Node FilterGraph::chain(std::initializer_list<std::shared_ptr<const Filter>> chainFilters, Node input) {
+    for (const std::shared_ptr<const Filter> &filter : chainFilters) {
+        input = add(filter, input);
+    }
+    return input;
+}
+
+std::vector<FilterGraph::Stage> FilterGraph::plan(const ImageBuffer &img, std::vector<Node> &outputs) const {
+    std::vector<Stage> stages(filters.size());
+    for (std::size_t n = 0; n < stages.size(); n++) {
+        stages[n].filter = filters[n];
+        stages[n].input = inputs[n];
+        stages[n].halo = n == 0 ? 0 : filters[n]->haloRadius();
+        stages[n].needed = stages[n].output = stages[n].fused = false;
+    }
+    stages[source].image = img;
+
+    // Inputs always come before their nodes, so one backward sweep finds everything the outputs depend on
+    for (Node output : outputs) {
+        if (output < 0 || output >= static_cast<Node>(stages.size())) throw std::out_of_range("FilterGraph: no such output node");
+        stages[output].needed = stages[output].output = true;
+    }
+    for (Node n = static_cast<Node>(stages.size()) - 1; n > 0; n--) {
+        if (stages[n].needed) {
+            stages[stages[n].input].needed = true;
+            stages[stages[n].input].consumers.push_back(n);
+        }
+    }
+
+    std::vector<Node> alias(stages.size());
+    for (Node n = 0; n < static_cast<Node>(stages.size()); n++) {
+        alias[n] = n;
+        std::shared_ptr<const PointFilter> point = std::dynamic_pointer_cast<const PointFilter>(stages[n].filter);
+        if (!stages[n].needed || !point) {
+            continue;
+        }
+
+        // A point filter joins the stage before it when nothing else reads that stage's output
+        Stage &previous = stages[stages[n].input];
+        if (stages[n].input == source || previous.halo < 0 || previous.output || previous.consumers.size() != 1) {
+            stages[n].points = std::make_shared<PointFilterChain>(std::initializer_list<std::shared_ptr<const PointFilter>>{point});
+            continue;
+        }
+        if (previous.points) {
+            previous.points->append(point);
+        } else {
+            if (!previous.tail) {
+                previous.tail = std::make_shared<PointFilterChain>();
+            }
+            previous.tail->append(point);
+        }
+        stages[n].fused = true;
+        alias[n] = stages[n].input;
+        previous.output = stages[n].output;
+        previous.consumers = stages[n].consumers;
+        for (Node consumer : stages[n].consumers) {
+            stages[consumer].input = alias[n];
+        }
+    }
+
+    for (Stage &stage : stages) {
+        if (stage.points) {
+            stage.table = stage.points->table();
+        }
+        if (stage.tail) {
+            stage.tailTable = stage.tail->table();
+        }
+    }
+    for (Node &output : outputs) {
+        output = alias[output];
+    }
+    return stages;
+}
+
+const ImageBuffer &FilterGraph::whole(std::vector<Stage> &stages, Node n) const {
+    Stage &stage = stages[n];
+    if (stage.image.isNull()) {
+        if (stage.halo < 0) {
+            stage.image = ImageBuffer::wrap(stage.filter->process(whole(stages, stage.input).toQImage()));
+        } else {
+            stage.image = stream(stages, {n})[0];
+        }
+    }
+    return stage.image;
+}
+
+std::vector<ImageBuffer> FilterGraph::stream(std::vector<Stage> &stages, const std::vector<Node> &targets) const {
+    const ImageBuffer &img = stages[source].image;
+    int width = img.width(), height = img.height();
+    int count = static_cast<int>(stages.size());
+
+    // Filters without a radius only ever see whole inputs, the ones the targets depend on run first
+    std::vector<bool> upstream(count, false);
+    std::vector<Node> barriers;
+    for (Node target : targets) {
+        upstream[target] = true;
+    }
+    for (Node n = count - 1; n > 0; n--) {
+        if (!upstream[n] || !stages[n].image.isNull()) {
+            continue;
+        }
+        if (stages[n].halo < 0) {
+            barriers.push_back(n);
+        } else {
+            upstream[stages[n].input] = true;
+        }
+    }
+    for (auto barrier = barriers.rbegin(); barrier != barriers.rend(); ++barrier) {
+        whole(stages, *barrier);
+    }
+
+    // Rows the targets read from the nearest materialized images. Strips are made at least twice that high,
+    // so recomputed halos never cost more than the strip itself.
+    std::vector<int> depth(count, 0);
+    int deepest = 0;
+    for (Node n = 1; n < count; n++) {
+        if (upstream[n] && stages[n].image.isNull()) {
+            depth[n] = depth[stages[n].input] + stages[n].halo;
+        }
+    }
+    for (Node target : targets) {
+        deepest = std::max(deepest, depth[target]);
+    }
+    int stripHeight = std::max({16, stripBytes / std::max(width * 4, 1), 2 * deepest});
+
+    std::vector<ImageBuffer> results;
+    for (std::size_t t = 0; t < targets.size(); t++) {
+        results.emplace_back(width, height, ImageBuffer::Layout::Interleaved, ImageBuffer::Sample::UInt8, img.hasAlpha());
+    }
+
+    int strips = (height + stripHeight - 1) / stripHeight;
+    TraceSpan span("strips", int64_t(width) * height);
+    ThreadPool::instance().parallelFor(0, strips, 1, [&](int stripBegin, int stripEnd) {
+        TraceBand band(span);
+        std::vector<int> top(count), bottom(count);
+        std::vector<ImageBuffer> buffers(count);
+        for (int strip = stripBegin; strip < stripEnd; strip++) {
+            int yBegin = strip * stripHeight, yEnd = std::min(yBegin + stripHeight, height);
+            std::fill(top.begin(), top.end(), height);
+            std::fill(bottom.begin(), bottom.end(), 0);
+            for (Node target : targets) {
+                top[target] = yBegin;
+                bottom[target] = yEnd;
+            }
+
+            // Rows every stage has to produce, consumers always come after their inputs
+            for (Node n = count - 1; n > 0; n--) {
+                if (top[n] >= bottom[n] || !stages[n].image.isNull()) {
+                    continue;
+                }
+                Node input = stages[n].input;
+                top[input] = std::min(top[input], std::max(top[n] - stages[n].halo, 0));
+                bottom[input] = std::max(bottom[input], std::min(bottom[n] + stages[n].halo, height));
+            }
+
+            for (Node n = 1; n < count; n++) {
+                const Stage &stage = stages[n];
+                if (top[n] >= bottom[n] || !stage.image.isNull()) {
+                    continue;
+                }
+
+                // The input rows cover the halo unless they stop at the image border, where the border
+                // mode of the strip is that of the image, so the filter cannot tell the strip from the image.
+                // Wrap reads the opposite edge, filters using it need the whole image (halo -1).
+                bool materialized = !stages[stage.input].image.isNull();
+                const ImageBuffer &input = materialized ? stages[stage.input].image : buffers[stage.input];
+                int offset = materialized ? 0 : top[stage.input];
+                int rows = bottom[n] - top[n];
+                if (buffers[n].width() != width || buffers[n].height() != rows) {
+                    buffers[n] = ImageBuffer(width, rows, ImageBuffer::Layout::Interleaved, ImageBuffer::Sample::UInt8, img.hasAlpha());
+                }
+                QRgb *result = buffers[n].line(0);
+                int stride = buffers[n].bytesPerLine() / sizeof(QRgb);
+
+                TraceSpan stageSpan(stage.points ? static_cast<const Filter *>(stage.points.get()) : stage.filter.get(), int64_t(rows) * width);
+                if (stage.points) {
+                    for (int y = top[n]; y < bottom[n]; y++) {
+                        stage.table.applyRow(input.constLine(y - offset), width, result + std::size_t(y - top[n]) * stride);
+                    }
+                } else {
+                    stage.filter->processRows(input, top[n] - offset, bottom[n] - offset, result, stride);
+                }
+                if (stage.tail) {
+                    for (int row = 0; row < rows; row++) {
+                        QRgb *line = result + std::size_t(row) * stride;
+                        stage.tailTable.applyRow(line, width, line);
+                    }
+                }
+            }
+
+            // A target may have been materialized as the input of a filter without a radius
+            for (std::size_t t = 0; t < targets.size(); t++) {
+                const Stage &stage = stages[targets[t]];
+                const ImageBuffer &buffer = stage.image.isNull() ? buffers[targets[t]] : stage.image;
+                int offset = stage.image.isNull() ? top[targets[t]] : 0;
+                for (int y = yBegin; y < yEnd; y++) {
+                    std::memcpy(results[t].line(y), buffer.constLine(y - offset), width * sizeof(QRgb));
+                }
+            }
+        }
+    });
+    return results;
+}
+
+QImage FilterGraph::evaluate(const QImage &img, Node output) const {
+    return evaluate(img, std::vector<Node>{output})[0];
+}
+
+std::vector<QImage> FilterGraph::evaluate(const QImage &img, std::vector<Node> outputs) const {
+    TraceSpan span(this, int64_t(img.width()) * img.height());
+    std::vector<Stage> stages = plan(ImageBuffer::wrap(img), outputs);
+
+    std::vector<Node> targets;
+    for (Node output : outputs) {
+        if (stages[output].image.isNull() && stages[output].halo >= 0 && std::find(targets.begin(), targets.end(), output) == targets.end()) {
+            targets.push_back(output);
+        }
+    }
+    std::vector<ImageBuffer> streamed = stream(stages, targets);
+
+    std::vector<QImage> results;
+    for (Node output : outputs) {
+        std::size_t t = std::find(targets.begin(), targets.end(), output) - targets.begin();
+        results.push_back(t < targets.size() ? streamed[t].toQImage() : whole(stages, output).toQImage());
+    }
+    return results;
+}
+
+bool FilterGraph::evaluate(ImageReader &reader, Node output, ImageWriter &writer) const {
+    TraceSpan span(this, int64_t(reader.width()) * reader.height());
+    std::vector<Node> outputs{output};
+    std::vector<Stage> stages = plan(ImageBuffer(), outputs);
+    output = outputs[0];
+    int width = reader.width(), height = reader.height();
+    int count = static_cast<int>(stages.size());
+
+    // Rows each stage is read beyond a strip of the output, the reach of the source is the deepest
+    std::vector<int> reach(count, -1);
+    reach[output] = 0;
+    for (Node n = count - 1; n > 0; n--) {
+        if (reach[n] < 0) {
+            continue;
+        }
+        if (stages[n].halo < 0) {
+            return false;
+        }
+        reach[stages[n].input] = std::max(reach[stages[n].input], reach[n] + stages[n].halo);
+    }
+    // A strip also has to give every thread a few rows
+    int threads = static_cast<int>(ThreadPool::instance().getThreadCount());
+    int stripHeight = std::max({16, stripBytes / std::max(width * 4, 1), 2 * reach[source], 4 * threads});
+
+    // Window of rows [top, bottom) of every stage, a strip high plus the reach on both sides
+    std::vector<ImageBuffer> windows(count);
+    std::vector<int> top(count, 0), bottom(count, 0);
+    for (Node n = 0; n < count; n++) {
+        if (reach[n] >= 0) {
+            windows[n] = ImageBuffer(width, std::min(height, stripHeight + 2 * reach[n]), ImageBuffer::Layout::Interleaved, ImageBuffer::Sample::UInt8, reader.hasAlpha());
+        }
+    }
+
+    std::vector<int> nextTop(count), nextBottom(count);
+    for (int yBegin = 0; yBegin < height; yBegin += stripHeight) {
+        int yEnd = std::min(yBegin + stripHeight, height);
+        std::fill(nextTop.begin(), nextTop.end(), height);
+        std::fill(nextBottom.begin(), nextBottom.end(), 0);
+        nextTop[output] = yBegin;
+        nextBottom[output] = yEnd;
+        for (Node n = count - 1; n > 0; n--) {
+            if (reach[n] < 0) {
+                continue;
+            }
+            Node input = stages[n].input;
+            nextTop[input] = std::min(nextTop[input], std::max(nextTop[n] - stages[n].halo, 0));
+            nextBottom[input] = std::max(nextBottom[input], std::min(nextBottom[n] + stages[n].halo, height));
+        }
+
+        for (Node n = 0; n < count; n++) {
+            if (reach[n] < 0) {
+                continue;
+            }
+            // Windows only move down and overlap the previous strip's, whose last rows move to the top
+            ImageBuffer &window = windows[n];
+            int kept = std::max(bottom[n] - nextTop[n], 0);
+            if (kept > 0 && nextTop[n] > top[n]) {
+                std::memmove(window.line(0), window.constLine(nextTop[n] - top[n]), kept * window.bytesPerLine());
+            }
+            int first = std::max(bottom[n], nextTop[n]);
+            top[n] = nextTop[n];
+            bottom[n] = nextBottom[n];
+            int stride = window.bytesPerLine() / sizeof(QRgb);
+            if (n == source) {
+                if (!reader.read(window.line(first - top[n]), bottom[n] - first, stride)) {
+                    return false;
+                }
+                continue;
+            }
+
+            // The input window covers the halo of the new rows unless it stops at the image border, as in stream()
+            const Stage &stage = stages[n];
+            ImageBuffer input = windows[stage.input].rows(0, bottom[stage.input] - top[stage.input]);
+            int offset = top[stage.input];
+            int rows = bottom[n] - first;
+            int grain = stage.filter->isReentrant() ? std::max(4, (rows + threads - 1) / threads) : std::max(rows, 1);
+            TraceSpan stageSpan(stage.points ? static_cast<const Filter *>(stage.points.get()) : stage.filter.get(), int64_t(rows) * width);
+            ThreadPool::instance().parallelFor(first, bottom[n], grain, [&](int rowBegin, int rowEnd) {
+                TraceBand band(stageSpan);
+                QRgb *result = window.line(rowBegin - top[n]);
+                if (stage.points) {
+                    for (int y = rowBegin; y < rowEnd; y++) {
+                        stage.table.applyRow(input.constLine(y - offset), width, result + std::size_t(y - rowBegin) * stride);
+                    }
+                } else {
+                    stage.filter->processRows(input, rowBegin - offset, rowEnd - offset, result, stride);
+                }
+                if (stage.tail) {
+                    for (int row = 0; row < rowEnd - rowBegin; row++) {
+                        QRgb *line = result + std::size_t(row) * stride;
+                        stage.tailTable.applyRow(line, width, line);
+                    }
+                }
+            });
+        }
+
+        const ImageBuffer &result = windows[output];
+        if (!writer.write(result.constLine(yBegin - top[output]), yEnd - yBegin, result.bytesPerLine() / sizeof(QRgb))) {
+            return false;
+        }
+    }
+    return writer.finish();
+}
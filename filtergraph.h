@@ -0,0 +1,53 @@
+#pragma once
+
+#include <initializer_list>
+#include <memory>
+#include <vector>
+#include <QImage>
+#include "filter.h"
+#include "imagebuffer.h"
+#include "imageio.h"
+
+// Filters composed into a DAG whose outputs are evaluated lazily, strip by strip. A strip of an output pulls
+// from every stage only the rows the stages after it read (their haloRadius() more on each side), so the
+// intermediates are a few rows high and stay in cache instead of being whole images. Point filters are fused
+// into the stage before them: their combined table is applied in place to the rows that stage just produced.
+// A filter without a radius needs its whole input, which is materialized for it and reused by every strip.
+// The result is the same as running the filters one after the other with process(), except for kernels
+// convolved through the FFT: whether a band takes the FFT or the fixed point path depends on its height, and
+// their rounding may differ by one level.
+// Streamed from a reader to a writer, each stage instead keeps a window of its rows that slides down the image,
+// so rows are computed once and memory only depends on the width and the radii, never on the height.
+class FilterGraph {
+public:
+    typedef int Node;
+
+protected:
+    struct Stage;
+
+    // filters[n] is applied to the output of inputs[n], node 0 (the source) has no filter
+    std::vector<std::shared_ptr<const Filter>> filters;
+    std::vector<Node> inputs;
+
+    std::vector<Stage> plan(const ImageBuffer &img, std::vector<Node> &outputs) const;
+    // Materializes the output of node n
+    const ImageBuffer &whole(std::vector<Stage> &stages, Node n) const;
+    // Outputs of the targets, which must not be materialized yet, computed strip by strip
+    std::vector<ImageBuffer> stream(std::vector<Stage> &stages, const std::vector<Node> &targets) const;
+
+public:
+    // The image given to evaluate()
+    static const Node source = 0;
+
+    FilterGraph();
+    // Adds a node applying filter to the output of input
+    Node add(std::shared_ptr<const Filter> filter, Node input = source);
+    // Adds the filters one after the other and returns the last node
+    Node chain(std::initializer_list<std::shared_ptr<const Filter>> chainFilters, Node input = source);
+    QImage evaluate(const QImage &img, Node output) const;
+    // Outputs are evaluated together, nodes they share are only computed once
+    std::vector<QImage> evaluate(const QImage &img, std::vector<Node> outputs) const;
+    // Reads the source strip by strip and writes the output as its strips are done. False when a filter the
+    // output depends on has no radius, or the reader or writer fails.
+    bool evaluate(ImageReader &reader, Node output, ImageWriter &writer) const;
+};
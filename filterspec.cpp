@@ -0,0 +1,130 @@
+#include "filterspec.h"
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <utility>
+
+// Largest radius or size a spec can ask for, and largest offset or seed, all exact in a float
+static const float maxRadius = 1024;
+static const float maxOffset = 1 << 24;
+static const float maxSeed = 1 << 24;
+
+static bool parseBorderMode(const std::string &name, BorderMode &mode) {
+    const std::pair<const char *, BorderMode> modes[] = {
+        {"clamp", BorderMode::Clamp}, {"reflect", BorderMode::Reflect}, {"wrap", BorderMode::Wrap}, {"constant", BorderMode::Constant}};
+    for (const auto &entry : modes) {
+        if (name == entry.first) {
+            mode = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::shared_ptr<const Filter>> FilterSpec::chain(const std::string &spec, const Kernel &morphologyKernel) {
+    std::vector<std::shared_ptr<const Filter>> filters;
+    std::stringstream items(spec);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        std::size_t at = item.find('@');
+        std::stringstream fields(item.substr(0, at));
+        std::string name, field;
+        std::getline(fields, name, ':');
+        std::vector<float> arguments;
+        while (std::getline(fields, field, ':')) {
+            char *end = nullptr;
+            arguments.push_back(std::strtof(field.c_str(), &end));
+            if (field.empty() || *end != '\0' || !std::isfinite(arguments.back())) {
+                return {};
+            }
+        }
+
+        std::shared_ptr<Filter> filter = create(name, arguments, morphologyKernel);
+        if (!filter) {
+            return {};
+        }
+        if (at != std::string::npos) {
+            BorderMode mode;
+            if (!parseBorderMode(item.substr(at + 1), mode)) {
+                return {};
+            }
+            filter->setBorderMode(mode);
+        }
+        filters.push_back(filter);
+    }
+    return filters;
+}
+
+FilterGraph::Node FilterSpec::parse(const std::string &spec, FilterGraph &graph, const Kernel &morphologyKernel, FilterGraph::Node input) {
+    std::vector<std::shared_ptr<const Filter>> filters = chain(spec, morphologyKernel);
+    if (filters.empty()) {
+        return -1;
+    }
+    for (const std::shared_ptr<const Filter> &filter : filters) {
+        input = graph.add(filter, input);
+    }
+    return input;
+}
+
+std::shared_ptr<Filter> FilterSpec::create(const std::string &name, const std::vector<float> &arguments, const Kernel &morphologyKernel) {
+    auto argument = [&](std::size_t i, float fallback) {
+        return i < arguments.size() ? arguments[i] : fallback;
+    };
+    // Argument i is a whole number in [min, max], or missing
+    auto whole = [&](std::size_t i, float min, float max) {
+        float value = argument(i, min);
+        return value == std::floor(value) && value >= min && value <= max;
+    };
+    // Radii and sizes are at least 1, larger ones than maxRadius would only allocate their way to a crash
+    auto radius = [&](std::size_t i) {
+        return whole(i, 1, maxRadius);
+    };
+    // A square of the given radius, or the configured kernel (3x3 when there is none)
+    auto structuringElement = [&]() {
+        if (arguments.empty() && morphologyKernel.getRadius() != std::size_t(-1)) {
+            return morphologyKernel;
+        }
+        return Kernel(std::vector<float>(2 * static_cast<std::size_t>(argument(0, 1)) + 1, 1.f));
+    };
+    bool morphology = name == "dilation" || name == "erosion" || name == "opening" || name == "closing" || name == "gradient" || name == "tophat" || name == "blackhat";
+
+    if ((name == "blur" || name == "sobel" || name == "sobelx" || name == "sobely" || name == "motionblur" || morphology) && !radius(0)) return nullptr;
+    if (name == "gauss" && (!radius(0) || !(argument(1, 3.f) > 0) || !whole(2, 0, 1))) return nullptr;
+    if (name == "median" && (!radius(0) || argument(1, 0.5f) < 0 || argument(1, 0.5f) > 1)) return nullptr;
+    if (name == "move" && (!whole(0, -maxOffset, maxOffset) || !whole(1, -maxOffset, maxOffset))) return nullptr;
+    if (name == "rotate" && (!whole(0, -maxOffset, maxOffset) || !whole(1, -maxOffset, maxOffset) || !whole(3, 0, 2))) return nullptr;
+    if (name == "waves" && (argument(0, 30.f) == 0 || !whole(1, 0, 1))) return nullptr;
+    if (name == "glass" && !whole(0, 0, maxSeed)) return nullptr;
+
+    if (name == "invert") return std::make_shared<InvertFilter>();
+    if (name == "grayscale") return std::make_shared<GrayScaleFilter>();
+    if (name == "sepia") return std::make_shared<SepiaFilter>(argument(0, 15.f));
+    if (name == "brightness") return std::make_shared<BrightnessFilter>(argument(0, 100.f));
+    if (name == "basecolor") return std::make_shared<BaseColorCorrection>(argument(0, 1.f), argument(1, 1.f), argument(2, 1.f));
+    if (name == "blur") return std::make_shared<BlurFilter>(argument(0, 2));
+    if (name == "gauss") return std::make_shared<GaussianFilter>(argument(0, 2), argument(1, 3.f), argument(2, 0) != 0);
+    if (name == "sobel") return std::make_shared<SobelFilter>(argument(0, 1));
+    if (name == "sobelx") return std::make_shared<SobelFilterX>(argument(0, 1));
+    if (name == "sobely") return std::make_shared<SobelFilterY>(argument(0, 1));
+    if (name == "scharr") return std::make_shared<ScharrFilter>();
+    if (name == "prewitt") return std::make_shared<PrewittFilter>();
+    if (name == "sharpness") return std::make_shared<SharpnessFilter>();
+    if (name == "sharpness2") return std::make_shared<Sharpness2Filter>();
+    if (name == "grayworld") return std::make_shared<GrayWorldFilter>();
+    if (name == "perfectreflector") return std::make_shared<PerfectReflectorFilter>();
+    if (name == "histogram") return std::make_shared<HistogramLinearChange>();
+    if (name == "median") return std::make_shared<MedianFilter>(argument(0, 2), argument(1, 0.5f));
+    if (name == "motionblur") return std::make_shared<MotionBlurFilter>(argument(0, 10));
+    if (name == "dilation") return std::make_shared<Dilation>(structuringElement());
+    if (name == "erosion") return std::make_shared<Erosion>(structuringElement());
+    if (name == "opening") return std::make_shared<Opening>(structuringElement());
+    if (name == "closing") return std::make_shared<Closing>(structuringElement());
+    if (name == "gradient") return std::make_shared<MorphologicalGradient>(structuringElement());
+    if (name == "tophat") return std::make_shared<MorphologicalTopHat>(structuringElement());
+    if (name == "blackhat") return std::make_shared<MorphologicalBlackHat>(structuringElement());
+    if (name == "move") return std::make_shared<MoveFilter>(argument(0, 0), argument(1, 0));
+    if (name == "rotate") return std::make_shared<RotateFilter>(argument(0, 0), argument(1, 0), argument(2, 0), static_cast<Interpolation>(static_cast<int>(argument(3, 0))));
+    if (name == "waves") return std::make_shared<WavesFilter>(argument(0, 30.f), argument(1, 0));
+    if (name == "glass") return std::make_shared<GlassFilter>(argument(0, 0));
+    return nullptr;
+}
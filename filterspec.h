@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include "filter.h"
+#include "filtergraph.h"
+
+// Chains of filters written as text, e.g. "gauss:3:2,invert,dilation:1". Filters are separated by commas and
+// their numeric arguments by colons, missing arguments take the constructor defaults. Morphology filters take
+// the radius of a square structuring element, or use morphologyKernel when it is not given. A suffix
+// "@clamp", "@reflect", "@wrap" or "@constant" (black) picks what the filter reads outside the image.
+// Radii and sizes are whole numbers from 1 to 1024, sigmas positive, percentiles in [0, 1], offsets and seeds
+// whole numbers, the waves axis 0 or 1; anything else makes the spec invalid. gauss takes 1 as a third argument
+// for the box approximation, rotate 0, 1 or 2 as a fourth for nearest, bilinear or bicubic interpolation.
+//
+//   invert grayscale sepia:k brightness:k basecolor:r:g:b blur:r gauss:r:sigma:approximate sobel:r sobelx:r sobely:r
+//   scharr prewitt sharpness sharpness2 grayworld perfectreflector histogram median:r:percentile motionblur:n
+//   dilation:r erosion:r opening:r closing:r gradient:r tophat:r blackhat:r
+//   move:dx:dy rotate:cx:cy:angle:interpolation waves:sigma:axis glass:seed
+class FilterSpec {
+public:
+    // Filters of the chain in order, empty when the spec is not valid
+    static std::vector<std::shared_ptr<const Filter>> chain(const std::string &spec, const Kernel &morphologyKernel = Kernel());
+    // Appends the chain after input and returns its last node, or -1 when the spec is not valid
+    static FilterGraph::Node parse(const std::string &spec, FilterGraph &graph, const Kernel &morphologyKernel = Kernel(), FilterGraph::Node input = FilterGraph::source);
+    static std::shared_ptr<Filter> create(const std::string &name, const std::vector<float> &arguments, const Kernel &morphologyKernel = Kernel());
+};
@@ -0,0 +1,246 @@
+#include "fixedpoint.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+template <typename T>
+static T clampTo(T value, T min, T max) {
+    return value > max ? max : value < min ? min : value;
+}
+
+static bool isIntegral(const std::vector<float> &values) {
+    for (float value : values) {
+        if (std::abs(value - std::round(value)) > 1e-4f * std::max(1.f, std::abs(value))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int64_t absoluteSum(const std::vector<int16_t> &weights) {
+    int64_t sum = 0;
+    for (int16_t weight : weights) {
+        sum += std::abs(weight);
+    }
+    return sum;
+}
+
+// Weights times 2^bits, 0 bits when they are integers already. The rounding error of their sum goes to the
+// largest weight, so a flat area keeps its exact level. -1 when the weights need bits and none are allowed.
+static int quantize(const std::vector<float> &values, int fractionBits, std::vector<int16_t> &weights) {
+    int bits = isIntegral(values) ? 0 : fractionBits;
+    weights.clear();
+    if (bits < 0 || bits > FixedPointConvolution::maxFractionBits || (bits == 0 && !isIntegral(values))) {
+        return -1;
+    }
+    double scale = std::ldexp(1.0, bits), sum = 0;
+    int64_t quantizedSum = 0;
+    std::size_t largest = 0;
+    for (std::size_t i = 0; i < values.size(); i++) {
+        double scaled = std::round(values[i] * scale);
+        if (std::abs(scaled) > INT16_MAX) {
+            weights.clear();
+            return -1;
+        }
+        weights.push_back(static_cast<int16_t>(scaled));
+        sum += values[i];
+        quantizedSum += weights.back();
+        if (std::abs(values[i]) > std::abs(values[largest])) {
+            largest = i;
+        }
+    }
+    if (bits > 0 && !weights.empty()) {
+        int64_t corrected = weights[largest] + std::llround(sum * scale) - quantizedSum;
+        if (std::abs(corrected) > INT16_MAX) {
+            weights.clear();
+            return -1;
+        }
+        weights[largest] = static_cast<int16_t>(corrected);
+    }
+    return bits;
+}
+
+static void unpackPixel(QRgb color, int16_t *pixel) {
+    pixel[0] = static_cast<int16_t>(qRed(color));
+    pixel[1] = static_cast<int16_t>(qGreen(color));
+    pixel[2] = static_cast<int16_t>(qBlue(color));
+}
+
+// The row with radius pixels of border at both ends, as int16 channels one pixel after another
+static void unpackRow(const QRgb *line, int width, int radius, const BorderRows &borders, int16_t *padded) {
+    for (int x = -radius; x < 0; x++) {
+        unpackPixel(borders.pixel(line, x), padded + std::size_t(x + radius) * 3);
+    }
+    for (int x = 0; x < width; x++) {
+        unpackPixel(line[x], padded + std::size_t(x + radius) * 3);
+    }
+    for (int x = width; x < width + radius; x++) {
+        unpackPixel(borders.pixel(line, x), padded + std::size_t(x + radius) * 3);
+    }
+}
+
+// Sums at the binary point of bits back to levels. The shift rounds down, as the float path's conversion does
+// for the values that are not clamped to 0.
+static void packRow(const int32_t *sums, int width, int bits, QRgb *result) {
+    for (int x = 0; x < width; x++) {
+        const int32_t *pixel = sums + std::size_t(x) * 3;
+        result[x] = qRgb(clampTo(pixel[0] >> bits, 0, 255), clampTo(pixel[1] >> bits, 0, 255), clampTo(pixel[2] >> bits, 0, 255));
+    }
+}
+
+FixedPointConvolution::FixedPointConvolution() : radius(0), rowBits(0), columnBits(0), intermediateBits(0), tapBits(0) {}
+
+FixedPointConvolution::FixedPointConvolution(const std::vector<float> &columnFactor, const std::vector<float> &rowFactor, int fractionBits)
+    : radius(static_cast<int>(rowFactor.size() / 2)), rowBits(0), columnBits(0), intermediateBits(0), tapBits(0) {
+    if (columnFactor.size() != rowFactor.size() || rowFactor.size() % 2 == 0) throw std::invalid_argument("FixedPointConvolution: factors of different or even sizes");
+
+    // The factors of an integer kernel need not be integers themselves, scaling by the row's smallest weight
+    // turns the usual ones (binomial smoothing times a difference) into integers again
+    std::vector<float> column(columnFactor), row(rowFactor);
+    float smallest = 0;
+    for (float value : row) {
+        if (value != 0.f && (smallest == 0.f || std::abs(value) < smallest)) {
+            smallest = std::abs(value);
+        }
+    }
+    if (smallest == 0.f) {
+        return;
+    }
+    std::vector<float> scaledColumn(column), scaledRow(row);
+    for (std::size_t i = 0; i < row.size(); i++) {
+        scaledColumn[i] *= smallest;
+        scaledRow[i] /= smallest;
+    }
+    if (isIntegral(scaledColumn) && isIntegral(scaledRow)) {
+        column.swap(scaledColumn);
+        row.swap(scaledRow);
+    } else {
+        // Otherwise the row is normalized, so its weights keep all the fraction bits and the column's scale
+        // is that of the kernel
+        float rowSum = 0;
+        for (float value : row) {
+            rowSum += std::abs(value);
+        }
+        for (std::size_t i = 0; i < row.size(); i++) {
+            column[i] *= rowSum;
+            row[i] /= rowSum;
+        }
+    }
+
+    rowBits = quantize(row, fractionBits, rowWeights);
+    columnBits = quantize(column, fractionBits, columnWeights);
+    if (rowBits < 0 || columnBits < 0) {
+        rowWeights.clear();
+        return;
+    }
+
+    // As many fraction bits between the passes as int16 holds, at most those of the row weights
+    int64_t rowRange = 255 * absoluteSum(rowWeights);
+    intermediateBits = rowBits;
+    while (intermediateBits > 0 && (rowRange >> (rowBits - intermediateBits)) >= INT16_MAX) {
+        intermediateBits--;
+    }
+    if ((rowRange >> (rowBits - intermediateBits)) >= INT16_MAX || int64_t(INT16_MAX) * absoluteSum(columnWeights) > INT32_MAX || rowRange > INT32_MAX) {
+        rowWeights.clear();
+    }
+}
+
+FixedPointConvolution::FixedPointConvolution(const std::vector<float> &taps, int radius, int fractionBits)
+    : radius(radius), rowBits(0), columnBits(0), intermediateBits(0), tapBits(0) {
+    if (taps.size() != std::size_t(2 * radius + 1) * (2 * radius + 1)) throw std::invalid_argument("FixedPointConvolution: taps do not match the radius");
+    tapBits = quantize(taps, fractionBits, this->taps);
+    if (tapBits < 0 || 255 * absoluteSum(this->taps) > INT32_MAX) {
+        this->taps.clear();
+    }
+}
+
+void FixedPointConvolution::processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, BorderMode mode, QRgb constant) const {
+    if (!isValid()) throw std::logic_error("FixedPointConvolution: no weights to convolve with");
+    BorderRows borders(img.width(), radius, mode, constant);
+    if (taps.empty()) {
+        processSeparable(img, yBegin, yEnd, result, stride, borders);
+    } else {
+        processDirect(img, yBegin, yEnd, result, stride, borders);
+    }
+}
+
+void FixedPointConvolution::processSeparable(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, const BorderRows &borders) const {
+    int size = 2 * radius + 1;
+    int width = img.width(), height = img.height(), channels = width * 3;
+    int shift = rowBits - intermediateBits;
+    int32_t half = shift > 0 ? 1 << (shift - 1) : 0;
+
+    // Horizontally filtered rows, window row v (row y + i of output row y) lives in slot v mod size
+    std::vector<int16_t> ring(std::size_t(size) * channels);
+    std::vector<int16_t> padded(std::size_t(width + 2 * radius) * 3);
+    std::vector<int32_t> accumulator(channels);
+    auto lines = [&](int row) { return img.constLine(row); };
+    auto slot = [&](int v) { return ((v % size) + size) % size; };
+    int nextRow = yBegin - radius;
+
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        for (; nextRow <= y + radius; nextRow++) {
+            unpackRow(borders.row(lines, nextRow, height), width, radius, borders, padded.data());
+            std::fill(accumulator.begin(), accumulator.end(), 0);
+            for (int j = 0; j < size; j++) {
+                const int16_t weight = rowWeights[j];
+                const int16_t *shifted = &padded[std::size_t(j) * 3];
+                if (weight == 0) {
+                    continue;
+                }
+                for (int k = 0; k < channels; k++) {
+                    accumulator[k] += int32_t(weight) * shifted[k];
+                }
+            }
+            int16_t *filtered = &ring[std::size_t(slot(nextRow)) * channels];
+            for (int k = 0; k < channels; k++) {
+                filtered[k] = static_cast<int16_t>((accumulator[k] + half) >> shift);
+            }
+        }
+
+        std::fill(accumulator.begin(), accumulator.end(), 0);
+        for (int i = -radius; i <= radius; i++) {
+            const int16_t weight = columnWeights[i + radius];
+            const int16_t *filtered = &ring[std::size_t(slot(y + i)) * channels];
+            if (weight == 0) {
+                continue;
+            }
+            for (int k = 0; k < channels; k++) {
+                accumulator[k] += int32_t(weight) * filtered[k];
+            }
+        }
+        packRow(accumulator.data(), width, intermediateBits + columnBits, result);
+    }
+}
+
+void FixedPointConvolution::processDirect(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, const BorderRows &borders) const {
+    int size = 2 * radius + 1;
+    int width = img.width(), height = img.height(), channels = width * 3;
+    std::vector<int16_t> padded(std::size_t(width + 2 * radius) * 3);
+    std::vector<int32_t> accumulator(channels);
+    auto lines = [&](int row) { return img.constLine(row); };
+
+    for (int y = yBegin; y < yEnd; y++, result += stride) {
+        std::fill(accumulator.begin(), accumulator.end(), 0);
+        for (int i = -radius; i <= radius; i++) {
+            const int16_t *weights = &taps[std::size_t(i + radius) * size];
+            if (std::all_of(weights, weights + size, [](int16_t weight) { return weight == 0; })) {
+                continue;
+            }
+            unpackRow(borders.row(lines, y + i, height), width, radius, borders, padded.data());
+            for (int j = 0; j < size; j++) {
+                const int16_t weight = weights[j];
+                const int16_t *shifted = &padded[std::size_t(j) * 3];
+                if (weight == 0) {
+                    continue;
+                }
+                for (int k = 0; k < channels; k++) {
+                    accumulator[k] += int32_t(weight) * shifted[k];
+                }
+            }
+        }
+        packRow(accumulator.data(), width, tapBits, result);
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <QImage>
+#include "border.h"
+#include "imagebuffer.h"
+
+// Convolution in integer arithmetic. Kernels with integer weights are evaluated exactly. The weights of other
+// kernels are rounded to multiples of 2^-fractionBits, which keeps the result within one level of the float path
+// for any normalized kernel. Channels are held as int16 between the passes, half the bytes of a float, and the
+// loops over them have no conversions, so the compiler packs twice as many lanes in a vector register. Weights
+// are int16 too, the products of two int16 are what SSE2 widens to int32 in a single step.
+class FixedPointConvolution {
+protected:
+    int radius;
+    // Separable kernels: weights of the horizontal and vertical passes. Others: all taps, row after row.
+    std::vector<int16_t> rowWeights, columnWeights, taps;
+    // Binary point of the weights of each pass, of the int16 values between the passes and of the taps
+    int rowBits, columnBits, intermediateBits, tapBits;
+
+    void processSeparable(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, const BorderRows &borders) const;
+    void processDirect(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, const BorderRows &borders) const;
+
+public:
+    static const int defaultFractionBits = 14;
+    static const int maxFractionBits = 16;
+
+    FixedPointConvolution();
+    // Kernel of columnFactor[i] * rowFactor[j], as Kernel::separate gives it
+    FixedPointConvolution(const std::vector<float> &columnFactor, const std::vector<float> &rowFactor, int fractionBits = defaultFractionBits);
+    // taps[(dy + radius) * size + dx + radius]
+    FixedPointConvolution(const std::vector<float> &taps, int radius, int fractionBits = defaultFractionBits);
+
+    // False when a weight or a sum would overflow, the float path is then left to do the work
+    bool isValid() const { return !taps.empty() || !rowWeights.empty(); }
+    // True when no weight was rounded
+    bool isExact() const { return rowBits == 0 && columnBits == 0 && tapBits == 0; }
+    void processRows(const ImageBuffer &img, int yBegin, int yEnd, QRgb *result, int stride, BorderMode mode = BorderMode::Clamp, QRgb constant = 0) const;
+};
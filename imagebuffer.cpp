@@ -0,0 +1,184 @@
+#include "imagebuffer.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+// Blocks up to this much larger than asked for are reused rather than allocated anew
+static const std::size_t reuseSlack = 2;
+
+BufferPool::BufferPool() : pooledBytes(0), capacity(std::size_t(512) << 20) {}
+
+BufferPool::~BufferPool() {
+    trim();
+}
+
+BufferPool &BufferPool::instance() {
+    // Never destroyed, buffers may still be released by static destructors after main()
+    static BufferPool *pool = new BufferPool();
+    return *pool;
+}
+
+std::shared_ptr<uchar> BufferPool::acquire(std::size_t bytes) {
+    bytes = std::max<std::size_t>(bytes, 1);
+    Trace::allocated(bytes);
+    Block block;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = freeBlocks.lower_bound(bytes);
+        if (found != freeBlocks.end() && found->first <= bytes * reuseSlack) {
+            block = found->second;
+            pooledBytes -= block.bytes;
+            freeBlocks.erase(found);
+        } else {
+            block.allocation = nullptr;
+        }
+    }
+
+    if (!block.allocation) {
+        block.allocation = std::malloc(bytes + ImageBuffer::alignment);
+        if (!block.allocation) throw std::bad_alloc();
+        std::uintptr_t address = reinterpret_cast<std::uintptr_t>(block.allocation);
+        block.data = reinterpret_cast<uchar *>((address + ImageBuffer::alignment) & ~std::uintptr_t(ImageBuffer::alignment - 1));
+        block.bytes = bytes;
+    }
+    return std::shared_ptr<uchar>(block.data, [this, block](uchar *) { release(block); });
+}
+
+void BufferPool::release(const Block &block) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pooledBytes + block.bytes > capacity) {
+        std::free(block.allocation);
+        return;
+    }
+    freeBlocks.emplace(block.bytes, block);
+    pooledBytes += block.bytes;
+}
+
+void BufferPool::setCapacity(std::size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity = bytes;
+}
+
+void BufferPool::trim() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &entry : freeBlocks) {
+        std::free(entry.second.allocation);
+    }
+    freeBlocks.clear();
+    pooledBytes = 0;
+}
+
+ImageBuffer::ImageBuffer() : data(nullptr), bufferWidth(0), bufferHeight(0), stride(0), planeBytes(0), bufferLayout(Layout::Interleaved), bufferSample(Sample::UInt8), alpha(false) {}
+
+ImageBuffer::ImageBuffer(int width, int height, Layout layout, Sample sample, bool alpha)
+    : bufferWidth(width), bufferHeight(height), bufferLayout(layout), bufferSample(sample), alpha(alpha) {
+    if (width < 0 || height < 0 || (layout == Layout::Interleaved && sample != Sample::UInt8)) throw std::invalid_argument("ImageBuffer: negative size or interleaved samples other than UInt8");
+    std::size_t pixelBytes = layout == Layout::Interleaved ? sizeof(QRgb) : sample == Sample::Float ? sizeof(float) : 1;
+    stride = (std::size_t(width) * pixelBytes + alignment - 1) / alignment * alignment;
+    planeBytes = stride * height;
+    memory = BufferPool::instance().acquire(planeBytes * (layout == Layout::Interleaved ? 1 : 3));
+    data = memory.get();
+}
+
+ImageBuffer ImageBuffer::wrap(const QImage &img) {
+    ImageBuffer buffer;
+    if (img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32) {
+        buffer.image = std::make_shared<const QImage>(img);
+    } else {
+        buffer.image = std::make_shared<const QImage>(img.convertToFormat(img.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32));
+    }
+    buffer.data = const_cast<uchar *>(buffer.image->constBits());
+    buffer.bufferWidth = img.width();
+    buffer.bufferHeight = img.height();
+    buffer.stride = buffer.image->bytesPerLine();
+    buffer.planeBytes = buffer.stride * buffer.bufferHeight;
+    buffer.alpha = buffer.image->format() == QImage::Format_ARGB32;
+    if (img.isNull()) {
+        buffer.data = nullptr;
+    }
+    return buffer;
+}
+
+ImageBuffer ImageBuffer::wrap(std::shared_ptr<uchar> pixels, int width, int height, std::size_t bytesPerLine, bool alpha) {
+    if (width < 0 || height < 0 || bytesPerLine < std::size_t(width) * sizeof(QRgb)) throw std::invalid_argument("ImageBuffer: negative size or rows shorter than the width");
+    ImageBuffer buffer;
+    buffer.memory = std::move(pixels);
+    buffer.data = buffer.memory.get();
+    buffer.bufferWidth = width;
+    buffer.bufferHeight = height;
+    buffer.stride = bytesPerLine;
+    buffer.planeBytes = bytesPerLine * height;
+    buffer.alpha = alpha;
+    return buffer;
+}
+
+QImage ImageBuffer::toQImage() const {
+    if (isNull()) {
+        return QImage();
+    }
+    if (bufferLayout == Layout::Planar) {
+        return converted(Layout::Interleaved).toQImage();
+    }
+    if (image) {
+        // Views of a few rows of the image are copied out of it
+        int y = static_cast<int>((data - image->constBits()) / stride);
+        return y == 0 && bufferHeight == image->height() ? *image : image->copy(0, y, bufferWidth, bufferHeight);
+    }
+
+    // The image keeps a reference to the block, which goes back to the pool when Qt is done with it
+    QImageCleanupFunction cleanup = [](void *info) { delete static_cast<std::shared_ptr<uchar> *>(info); };
+    return QImage(data, bufferWidth, bufferHeight, static_cast<int>(stride), alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32, cleanup, new std::shared_ptr<uchar>(memory));
+}
+
+ImageBuffer ImageBuffer::rows(int y, int count) const {
+    if (y < 0 || count < 0 || y + count > bufferHeight) throw std::out_of_range("ImageBuffer: rows outside the image");
+    ImageBuffer view(*this);
+    view.data = isNull() ? nullptr : data + y * stride;
+    view.bufferHeight = count;
+    return view;
+}
+
+ImageBuffer ImageBuffer::converted(Layout layout, Sample sample) const {
+    ImageBuffer result(bufferWidth, bufferHeight, layout, sample, alpha);
+    std::vector<float> samples(std::size_t(bufferWidth) * 3);
+    for (int y = 0; y < bufferHeight; y++) {
+        if (bufferLayout == Layout::Interleaved && layout == Layout::Interleaved) {
+            std::copy(constLine(y), constLine(y) + bufferWidth, result.line(y));
+            continue;
+        }
+
+        // Through one row of float samples, exact for uint8 values; floats are rounded and clamped on the way back
+        for (int channel = 0; channel < 3; channel++) {
+            for (int x = 0; x < bufferWidth; x++) {
+                float &value = samples[x * 3 + channel];
+                if (bufferLayout == Layout::Interleaved) {
+                    value = (constLine(y)[x] >> (16 - 8 * channel)) & 0xff;
+                } else if (bufferSample == Sample::Float) {
+                    value = constFloatLine(channel, y)[x];
+                } else {
+                    value = constPlaneLine(channel, y)[x];
+                }
+            }
+        }
+
+        for (int x = 0; x < bufferWidth; x++) {
+            int levels[3];
+            for (int channel = 0; channel < 3; channel++) {
+                float value = samples[x * 3 + channel];
+                levels[channel] = static_cast<int>(std::min(std::max(value, 0.f), 255.f) + 0.5f);
+                if (layout == Layout::Planar && sample == Sample::Float) {
+                    result.floatLine(channel, y)[x] = value;
+                } else if (layout == Layout::Planar) {
+                    result.planeLine(channel, y)[x] = levels[channel];
+                }
+            }
+            if (layout == Layout::Interleaved) {
+                result.line(y)[x] = qRgb(levels[0], levels[1], levels[2]);
+            }
+        }
+    }
+    return result;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <QImage>
+
+// Recycles the blocks behind ImageBuffers. Filters allocate images of the same few sizes over and over
+// (results, strips, float planes), so released blocks go to a free list instead of back to the heap.
+class BufferPool {
+protected:
+    struct Block {
+        void *allocation;
+        uchar *data;
+        std::size_t bytes;
+    };
+
+    std::mutex mutex;
+    std::multimap<std::size_t, Block> freeBlocks;
+    std::size_t pooledBytes, capacity;
+
+    BufferPool();
+    void release(const Block &block);
+
+public:
+    ~BufferPool();
+    BufferPool(const BufferPool &other) = delete;
+    BufferPool &operator=(const BufferPool &other) = delete;
+
+    static BufferPool &instance();
+    // At least `bytes` bytes aligned to ImageBuffer::alignment, back to the pool with the last reference
+    std::shared_ptr<uchar> acquire(std::size_t bytes);
+    // Bytes kept for reuse, blocks released beyond it are freed
+    void setCapacity(std::size_t bytes);
+    // Frees every pooled block
+    void trim();
+};
+
+// Pixels of an image in the working representation of the filters. Interleaved buffers hold one QRgb per
+// pixel, planar ones a plane of uint8 or float samples per channel (red, green, blue). Buffers either own a
+// pooled block, whose rows start on `alignment` bytes and are padded to a multiple of it, or wrap the bits
+// of a QImage with its own row padding. Copies share the pixels.
+class ImageBuffer {
+public:
+    enum class Layout { Interleaved, Planar };
+    enum class Sample { UInt8, Float };
+    static const int alignment = 64;
+
+protected:
+    std::shared_ptr<uchar> memory;
+    // Wrapped image, kept so its bits stay valid
+    std::shared_ptr<const QImage> image;
+    uchar *data;
+    int bufferWidth, bufferHeight;
+    // Bytes between rows, and between the planes of planar buffers
+    std::size_t stride, planeBytes;
+    Layout bufferLayout;
+    Sample bufferSample;
+    bool alpha;
+
+public:
+    ImageBuffer();
+    // Interleaved buffers are always UInt8. Alpha only tells toQImage() which format to give back.
+    ImageBuffer(int width, int height, Layout layout = Layout::Interleaved, Sample sample = Sample::UInt8, bool alpha = false);
+    // The pixels of img without a copy, once converted to 32 bits when it is in another format. The QImage
+    // may be shared, so a view of it is only ever read.
+    static ImageBuffer wrap(const QImage &img);
+    // Rows that live elsewhere, a mapped file for instance, kept alive by pixels which points at the first one.
+    // Rows must be 4 byte aligned, alignment gives the fast paths.
+    static ImageBuffer wrap(std::shared_ptr<uchar> pixels, int width, int height, std::size_t bytesPerLine, bool alpha = false);
+    // Interleaved buffers hand their pixels over without a copy, planar ones are converted
+    QImage toQImage() const;
+    ImageBuffer converted(Layout layout, Sample sample = Sample::UInt8) const;
+    // Rows [y, y + count) as a buffer of their own, sharing the pixels
+    ImageBuffer rows(int y, int count) const;
+
+    bool isNull() const { return data == nullptr; }
+    int width() const { return bufferWidth; }
+    int height() const { return bufferHeight; }
+    Layout layout() const { return bufferLayout; }
+    Sample sample() const { return bufferSample; }
+    bool hasAlpha() const { return alpha; }
+    std::size_t bytesPerLine() const { return stride; }
+
+    QRgb *line(int y) { return reinterpret_cast<QRgb *>(data + y * stride); }
+    const QRgb *constLine(int y) const { return reinterpret_cast<const QRgb *>(data + y * stride); }
+    uchar *planeLine(int channel, int y) { return data + channel * planeBytes + y * stride; }
+    const uchar *constPlaneLine(int channel, int y) const { return data + channel * planeBytes + y * stride; }
+    float *floatLine(int channel, int y) { return reinterpret_cast<float *>(planeLine(channel, y)); }
+    const float *constFloatLine(int channel, int y) const { return reinterpret_cast<const float *>(constPlaneLine(channel, y)); }
+};
@@ -0,0 +1,147 @@
+#include "imageio.h"
+#include "tiledimage.h"
+#include <algorithm>
+#include <cctype>
+
+// Next number of a PNM header, skipping whitespace and comments. -1 when there is none.
+static int headerNumber(FILE *file) {
+    int c = std::fgetc(file);
+    while (c != EOF && (std::isspace(c) || c == '#')) {
+        if (c == '#') {
+            while (c != EOF && c != '\n') {
+                c = std::fgetc(file);
+            }
+        }
+        c = std::fgetc(file);
+    }
+    if (c == EOF || !std::isdigit(c)) {
+        return -1;
+    }
+    long value = 0;
+    while (c != EOF && std::isdigit(c)) {
+        value = std::min(value * 10 + (c - '0'), 1L << 30);
+        c = std::fgetc(file);
+    }
+    // A single whitespace separates the header from the pixels, so the last one read must not be put back
+    if (c != EOF && !std::isspace(c)) {
+        return -1;
+    }
+    return static_cast<int>(value);
+}
+
+static bool hasSuffix(const std::string &path, const char *suffix) {
+    std::string lower(path);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+    std::string end(suffix);
+    return lower.size() >= end.size() && lower.compare(lower.size() - end.size(), end.size(), end) == 0;
+}
+
+PnmReader::PnmReader(const std::string &path) : file(std::fopen(path.c_str(), "rb")), imageWidth(0), imageHeight(0), channels(0), maxValue(0) {
+    if (!file) {
+        return;
+    }
+    char magic[2];
+    if (std::fread(magic, 1, 2, file) == 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6')) {
+        channels = magic[1] == '5' ? 1 : 3;
+        imageWidth = headerNumber(file);
+        imageHeight = headerNumber(file);
+        maxValue = headerNumber(file);
+    }
+    if (imageWidth <= 0 || imageHeight <= 0 || maxValue <= 0 || maxValue > 65535) {
+        std::fclose(file);
+        file = nullptr;
+        return;
+    }
+    line.resize(std::size_t(imageWidth) * channels * (maxValue > 255 ? 2 : 1));
+}
+
+PnmReader::~PnmReader() {
+    if (file) {
+        std::fclose(file);
+    }
+}
+
+bool PnmReader::read(QRgb *rows, int count, int stride) {
+    if (!file) {
+        return false;
+    }
+    for (int row = 0; row < count; row++, rows += stride) {
+        if (std::fread(line.data(), 1, line.size(), file) != line.size()) {
+            return false;
+        }
+        int levels[3];
+        for (int x = 0, i = 0; x < imageWidth; x++) {
+            for (int c = 0; c < channels; c++, i++) {
+                // 16 bit samples are big-endian
+                int sample = maxValue > 255 ? line[2 * i] << 8 | line[2 * i + 1] : line[i];
+                levels[c] = maxValue == 255 ? sample : (sample * 255 + maxValue / 2) / maxValue;
+            }
+            rows[x] = channels == 1 ? qRgb(levels[0], levels[0], levels[0]) : qRgb(levels[0], levels[1], levels[2]);
+        }
+    }
+    return true;
+}
+
+PnmWriter::PnmWriter(const std::string &path, int width, int height, bool gray) : file(std::fopen(path.c_str(), "wb")), imageWidth(width), gray(gray) {
+    if (!file) {
+        return;
+    }
+    std::fprintf(file, "P%c\n%d %d\n255\n", gray ? '5' : '6', width, height);
+    line.resize(std::size_t(width) * (gray ? 1 : 3));
+}
+
+PnmWriter::~PnmWriter() {
+    if (file) {
+        std::fclose(file);
+    }
+}
+
+bool PnmWriter::write(const QRgb *rows, int count, int stride) {
+    if (!file) {
+        return false;
+    }
+    for (int row = 0; row < count; row++, rows += stride) {
+        unsigned char *out = line.data();
+        for (int x = 0; x < imageWidth; x++) {
+            if (gray) {
+                *out++ = static_cast<unsigned char>(qGray(rows[x]));
+            } else {
+                *out++ = static_cast<unsigned char>(qRed(rows[x]));
+                *out++ = static_cast<unsigned char>(qGreen(rows[x]));
+                *out++ = static_cast<unsigned char>(qBlue(rows[x]));
+            }
+        }
+        if (std::fwrite(line.data(), 1, line.size(), file) != line.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PnmWriter::finish() {
+    return file && std::fflush(file) == 0;
+}
+
+std::unique_ptr<ImageReader> openImageReader(const std::string &path) {
+    if (hasSuffix(path, ".tiles")) {
+        std::unique_ptr<TiledImageReader> reader(new TiledImageReader(path));
+        return reader->isOpen() ? std::move(reader) : nullptr;
+    }
+    if (hasSuffix(path, ".ppm") || hasSuffix(path, ".pgm") || hasSuffix(path, ".pnm")) {
+        std::unique_ptr<PnmReader> reader(new PnmReader(path));
+        return reader->isOpen() ? std::move(reader) : nullptr;
+    }
+    return nullptr;
+}
+
+std::unique_ptr<ImageWriter> createImageWriter(const std::string &path, int width, int height, bool alpha) {
+    if (hasSuffix(path, ".tiles")) {
+        std::unique_ptr<TiledImageWriter> writer(new TiledImageWriter(path, width, height, alpha));
+        return writer->isOpen() ? std::move(writer) : nullptr;
+    }
+    if (hasSuffix(path, ".ppm") || hasSuffix(path, ".pgm") || hasSuffix(path, ".pnm")) {
+        std::unique_ptr<PnmWriter> writer(new PnmWriter(path, width, height, hasSuffix(path, ".pgm")));
+        return writer->isOpen() ? std::move(writer) : nullptr;
+    }
+    return nullptr;
+}
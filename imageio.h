@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <QImage>
+
+// Source of an image read from top to bottom a few rows at a time, so images far larger than memory can be filtered
+class ImageReader {
+public:
+    virtual ~ImageReader() = default;
+    virtual int width() const = 0;
+    virtual int height() const = 0;
+    virtual bool hasAlpha() const { return false; }
+    // Reads the next `count` rows into rows, `stride` pixels apart. False on a short or failed read.
+    virtual bool read(QRgb *rows, int count, int stride) = 0;
+};
+
+// Destination of an image written from top to bottom a few rows at a time
+class ImageWriter {
+public:
+    virtual ~ImageWriter() = default;
+    // Writes the next `count` rows, `stride` pixels apart
+    virtual bool write(const QRgb *rows, int count, int stride) = 0;
+    // Flushes what is still buffered once every row has been written
+    virtual bool finish() { return true; }
+};
+
+// Binary PGM (P5) and PPM (P6) with 8 or 16 bit samples, 16 bit ones are scaled down to 8
+class PnmReader : public ImageReader {
+protected:
+    FILE *file;
+    int imageWidth, imageHeight, channels, maxValue;
+    std::vector<unsigned char> line;
+
+public:
+    PnmReader(const std::string &path);
+    ~PnmReader() override;
+    PnmReader(const PnmReader &other) = delete;
+    PnmReader &operator=(const PnmReader &other) = delete;
+
+    bool isOpen() const { return file != nullptr; }
+    int width() const override { return imageWidth; }
+    int height() const override { return imageHeight; }
+    bool read(QRgb *rows, int count, int stride) override;
+};
+
+// Writes 8 bit binary PPM, or PGM of the pixels' gray level when gray is set
+class PnmWriter : public ImageWriter {
+protected:
+    FILE *file;
+    int imageWidth;
+    bool gray;
+    std::vector<unsigned char> line;
+
+public:
+    PnmWriter(const std::string &path, int width, int height, bool gray = false);
+    ~PnmWriter() override;
+    PnmWriter(const PnmWriter &other) = delete;
+    PnmWriter &operator=(const PnmWriter &other) = delete;
+
+    bool isOpen() const { return file != nullptr; }
+    bool write(const QRgb *rows, int count, int stride) override;
+    bool finish() override;
+};
+
+// Readers and writers chosen by file type: .ppm and .pgm, or the tiled container of tiledimage.h (.tiles).
+// Return nullptr when the file cannot be opened or is not in a streamable format.
+std::unique_ptr<ImageReader> openImageReader(const std::string &path);
+std::unique_ptr<ImageWriter> createImageWriter(const std::string &path, int width, int height, bool alpha = false);
@@ -0,0 +1,88 @@
+#include "imagestatistics.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+ImageStatistics::ImageStatistics(const ImageBuffer &img) : histograms(), pixelCount(uint64_t(img.width()) * img.height()) {
+    int width = img.width(), height = img.height();
+    int bands = 4 * static_cast<int>(ThreadPool::instance().getThreadCount());
+    TraceSpan span(this, int64_t(width) * height);
+
+    std::mutex merge;
+    ThreadPool::instance().parallelFor(0, height, std::max(16, (height + bands - 1) / bands), [&](int yBegin, int yEnd) {
+        TraceBand band(span);
+        uint32_t counts[3][256] = {};
+        for (int y = yBegin; y < yEnd; y++) {
+            const QRgb *line = img.constLine(y);
+            for (int x = 0; x < width; x++) {
+                counts[Red][qRed(line[x])]++;
+                counts[Green][qGreen(line[x])]++;
+                counts[Blue][qBlue(line[x])]++;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(merge);
+        for (int channel = 0; channel < 3; channel++) {
+            for (int value = 0; value < 256; value++) {
+                histograms[channel][value] += counts[channel][value];
+            }
+        }
+    });
+}
+
+ImageStatistics::ImageStatistics(const QImage &img) : ImageStatistics(ImageBuffer::wrap(img)) {}
+
+uint64_t ImageStatistics::count() const {
+    return pixelCount;
+}
+
+uint64_t ImageStatistics::frequency(Channel channel, int value) const {
+    return histograms[channel][value];
+}
+
+uint64_t ImageStatistics::sum(Channel channel) const {
+    uint64_t total = 0;
+    for (int value = 1; value < 256; value++) {
+        total += histograms[channel][value] * value;
+    }
+    return total;
+}
+
+float ImageStatistics::mean(Channel channel) const {
+    return pixelCount ? float(sum(channel)) / pixelCount : 0.f;
+}
+
+int ImageStatistics::minimum(Channel channel) const {
+    for (int value = 0; value < 256; value++) {
+        if (histograms[channel][value]) {
+            return value;
+        }
+    }
+    return 0;
+}
+
+int ImageStatistics::maximum(Channel channel) const {
+    for (int value = 255; value >= 0; value--) {
+        if (histograms[channel][value]) {
+            return value;
+        }
+    }
+    return 0;
+}
+
+int ImageStatistics::percentile(Channel channel, float fraction) const {
+    if (pixelCount == 0) {
+        return 0;
+    }
+    uint64_t needed = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(double(std::min(std::max(fraction, 0.f), 1.f)) * pixelCount)));
+    uint64_t seen = 0;
+    for (int value = 0; value < 256; value++) {
+        seen += histograms[channel][value];
+        if (seen >= needed) {
+            return value;
+        }
+    }
+    return 255;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include "imagebuffer.h"
+
+// Per-channel histograms of an image, built in one pass over its rows on the thread pool: every band counts
+// into its own histograms, which are merged at the end. Sums, extremes and percentiles are all read from them.
+class ImageStatistics {
+public:
+    enum Channel { Red, Green, Blue };
+
+protected:
+    uint64_t histograms[3][256];
+    uint64_t pixelCount;
+
+public:
+    explicit ImageStatistics(const ImageBuffer &img);
+    explicit ImageStatistics(const QImage &img);
+
+    uint64_t count() const;
+    uint64_t frequency(Channel channel, int value) const;
+    uint64_t sum(Channel channel) const;
+    float mean(Channel channel) const;
+    // Smallest and largest values present, 0 for an empty image
+    int minimum(Channel channel) const;
+    int maximum(Channel channel) const;
+    // Smallest value that at least `fraction` of the pixels do not exceed, fraction in [0, 1]
+    int percentile(Channel channel, float fraction) const;
+};
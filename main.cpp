@@ -2,12 +2,22 @@
 #include <iostream>
 #include <fstream>
 #include <QImage>
+#include "batch.h"
 #include "filter.h"
+#include "filterspec.h"
+#include "imageio.h"
+#include "threadpool.h"
+#include "tiledimage.h"
+#include "trace.h"
 
 int main(int argc, char *argv[]) {
 
-    bool mathMorphology = false;
+    bool mathMorphology = false, raw = false;
     std::string s, mathMorphologyKernelPath;
+    std::string batchInput, batchOutput = "images/batch", filterSpec;
+    std::string streamInput, streamOutput;
+    std::string tracePath;
+    int decoders = 2, filterWorkers = 1, encoders = 2, queueCapacity = 4;
     int mathMorphologyKernelSize = 0;
     Kernel mathMorphologyKernel;
 
@@ -26,15 +36,60 @@ int main(int argc, char *argv[]) {
         if (!strcmp(argv[i], "-m")) {
             mathMorphology = true;
         }
+        if (!strcmp(argv[i], "-t") && (i + 1 < argc)) {
+            ThreadPool::instance().setThreadCount(atoi(argv[i + 1]));
+        }
+        // Batch mode: -b <directory or file list> -f <filter spec> [-o <output directory>]
+        if (!strcmp(argv[i], "-b") && (i + 1 < argc)) {
+            batchInput = argv[i + 1];
+        }
+        if (!strcmp(argv[i], "-f") && (i + 1 < argc)) {
+            filterSpec = argv[i + 1];
+        }
+        if (!strcmp(argv[i], "-o") && (i + 1 < argc)) {
+            batchOutput = argv[i + 1];
+        }
+        if (!strcmp(argv[i], "--decoders") && (i + 1 < argc)) {
+            decoders = atoi(argv[i + 1]);
+        }
+        if (!strcmp(argv[i], "--filter-workers") && (i + 1 < argc)) {
+            filterWorkers = atoi(argv[i + 1]);
+        }
+        if (!strcmp(argv[i], "--encoders") && (i + 1 < argc)) {
+            encoders = atoi(argv[i + 1]);
+        }
+        if (!strcmp(argv[i], "--queue") && (i + 1 < argc)) {
+            queueCapacity = atoi(argv[i + 1]);
+        }
+        // Results and intermediates in the raw tiled container instead of PNG
+        if (!strcmp(argv[i], "--raw")) {
+            raw = true;
+        }
+        // Streaming mode for images larger than memory: --stream <input> <output> -f <filter spec>,
+        // both .ppm, .pgm or .tiles
+        if (!strcmp(argv[i], "--stream") && (i + 2 < argc)) {
+            streamInput = argv[i + 1];
+            streamOutput = argv[i + 2];
+        }
+        // Records every filter run: --trace <file> writes a Chrome trace (chrome://tracing, Perfetto) and a
+        // summary table goes to the standard output
+        if (!strcmp(argv[i], "--trace") && (i + 1 < argc)) {
+            tracePath = argv[i + 1];
+        }
     }
 
-    if (s.empty()) {
-        img.load(QString("images/source.png"));
-    }
-    else {
-        img.load(QString(s.c_str()));
-        img.save(QString("images/source.png"));
+    if (!tracePath.empty()) {
+        Trace::enable();
     }
+    auto writeTrace = [&]() {
+        if (tracePath.empty()) {
+            return;
+        }
+        if (!Trace::save(tracePath)) {
+            printf("Cannot write %s\n", tracePath.c_str());
+        }
+        Trace::report(std::cout);
+    };
 
     if (mathMorphology) {
         std::unique_ptr<float[]> temp;
@@ -69,96 +124,167 @@ int main(int argc, char *argv[]) {
         temp.reset();
     }
 
+    if (!batchInput.empty()) {
+        FilterGraph graph;
+        FilterGraph::Node output = FilterSpec::parse(filterSpec, graph, mathMorphologyKernel);
+        if (filterSpec.empty() || output < 0) {
+            printf("Invalid filter spec \"%s\"\n", filterSpec.c_str());
+            return 1;
+        }
+
+        BatchProcessor batch(graph, output, decoders, filterWorkers, encoders, queueCapacity);
+        batch.setRawOutput(raw);
+        int failures = batch.run(BatchProcessor::listInputs(batchInput), batchOutput);
+        batch.report(std::cout);
+        writeTrace();
+        return failures == 0 ? 0 : 1;
+    }
+
+    if (!streamInput.empty()) {
+        FilterGraph graph;
+        FilterGraph::Node output = FilterSpec::parse(filterSpec, graph, mathMorphologyKernel);
+        if (filterSpec.empty() || output < 0) {
+            printf("Invalid filter spec \"%s\"\n", filterSpec.c_str());
+            return 1;
+        }
+
+        std::unique_ptr<ImageReader> reader = openImageReader(streamInput);
+        if (!reader) {
+            printf("Cannot read %s\n", streamInput.c_str());
+            return 1;
+        }
+        std::unique_ptr<ImageWriter> writer = createImageWriter(streamOutput, reader->width(), reader->height(), reader->hasAlpha());
+        if (!writer) {
+            printf("Cannot write %s\n", streamOutput.c_str());
+            return 1;
+        }
+        bool streamed = graph.evaluate(*reader, output, *writer);
+        writeTrace();
+        if (!streamed) {
+            printf("Streaming failed, every filter needs a radius and the files must be complete\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // images/<name>.png, or images/<name>.tiles with --raw, which is mapped back instead of decoded
+    auto save = [&](const QImage &result, const char *name) {
+        std::string path = std::string("images/") + name + (raw ? ".tiles" : ".png");
+        if (raw) {
+            MappedTiledImage::save(path, result);
+        } else {
+            result.save(QString(path.c_str()));
+        }
+    };
+
+    if (s.empty()) {
+        if (raw) {
+            img = MappedTiledImage::load("images/source.tiles");
+        }
+        if (img.isNull()) {
+            img.load(QString("images/source.png"));
+        }
+    }
+    else if (s.size() > 6 && s.compare(s.size() - 6, 6, ".tiles") == 0) {
+        // Already raw, mapped rather than decoded
+        img = MappedTiledImage::load(s);
+    }
+    else {
+        img.load(QString(s.c_str()));
+        save(img, "source");
+    }
+
 //    InvertFilter invert;
-//    invert.process(img).save("images/invert.png");
+//    save(invert.process(img), "invert");
 
 //    BlurFilter blur;
-//    blur.process(img).save("images/blur.png");
+//    save(blur.process(img), "blur");
 
 //    GaussianFilter gauss;
-//    gauss.process(img).save("images/gauss.png");
+//    save(gauss.process(img), "gauss");
 
 //    GrayScaleFilter grayScale;
-//    grayScale.process(img).save("images/grayScale.png");
+//    save(grayScale.process(img), "grayScale");
 
 //    SepiaFilter sepia;
-//    sepia.process(img).save("images/sepia.png");
+//    save(sepia.process(img), "sepia");
 
 //    BrightnessFilter brightness;
-//    brightness.process(img).save("images/brightness.png");
+//    save(brightness.process(img), "brightness");
 
     SobelFilterX sobelX;
-    sobelX.process(img).save("images/sobelX.png");
+    save(sobelX.process(img), "sobelX");
 
     SobelFilterY sobelY;
-    sobelY.process(img).save("images/sobelY.png");
+    save(sobelY.process(img), "sobelY");
 
 //    SharpnessFilter sharpness;
-//    sharpness.process(img).save("images/sharpness.png");
+//    save(sharpness.process(img), "sharpness");
 
 //    GrayWorldFilter grayWorld;
-//    grayWorld.process(img).save("images/grayWorld.png");
+//    save(grayWorld.process(img), "grayWorld");
 
 //    PerfectReflectorFilter perfectReflector;
-//    perfectReflector.process(img).save("images/perfectReflector.png");
+//    save(perfectReflector.process(img), "perfectReflector");
 
 //    HistogramLinearChange histogramLinearChange;
-//    histogramLinearChange.process(img).save("images/histogramLinearChange.png");
+//    save(histogramLinearChange.process(img), "histogramLinearChange");
 
     SobelFilter sobel;
-    sobel.process(img).save("images/sobel.png");
+    save(sobel.process(img), "sobel");
 
     ScharrFilter scharr;
-    scharr.process(img).save("images/scharr.png");
+    save(scharr.process(img), "scharr");
 
     PrewittFilter prewitt;
-    prewitt.process(img).save("images/prewitt.png");
+    save(prewitt.process(img), "prewitt");
 
 //    Sharpness2Filter sharpness2;
-//    sharpness2.process(img).save("images/sharpness2.png");
+//    save(sharpness2.process(img), "sharpness2");
 
     Dilation dilation(mathMorphologyKernel);
-    dilation.process(img).save("images/dilation.png");
+    save(dilation.process(img), "dilation");
 
     Erosion erosion(mathMorphologyKernel);
-    erosion.process(img).save("images/erosion.png");
+    save(erosion.process(img), "erosion");
 
     Opening opening(mathMorphologyKernel);
-    opening.process(img).save("images/opening.png");
+    save(opening.process(img), "opening");
 
     Closing closing(mathMorphologyKernel);
-    closing.process(img).save("images/closing.png");
+    save(closing.process(img), "closing");
 
     MorphologicalGradient morphGrad(mathMorphologyKernel);
-    morphGrad.process(img).save("images/morphGrad.png");
+    save(morphGrad.process(img), "morphGrad");
 
     MorphologicalTopHat morphTopHat(mathMorphologyKernel);
-    morphTopHat.process(img).save("images/morphTopHat.png");
+    save(morphTopHat.process(img), "morphTopHat");
 
     MorphologicalBlackHat morphBlackHat(mathMorphologyKernel);
-    morphBlackHat.process(img).save("images/morphBlackHat.png");
+    save(morphBlackHat.process(img), "morphBlackHat");
 
 //    MedianFilter median;
-//    median.process(img).save("images/median.png");
+//    save(median.process(img), "median");
 
 //    BaseColorCorrection baseColor(0.67f, 0.34f, 0.18f);
-//    baseColor.process(img).save("images/baseColor.png");
+//    save(baseColor.process(img), "baseColor");
 
 //    MoveFilter move;
-//    move.process(img, 50, 0).save("images/move.png");
+//    save(move.process(img, 50, 0), "move");
 
 //    RotateFilter rotate;
-//    rotate.process(img, img.width() / 2, img.height() / 2, M_PI_4).save("images/rotate.png");
+//    save(rotate.process(img, img.width() / 2, img.height() / 2, M_PI_4), "rotate");
 
 //    WavesFilter waves;
-//    waves.process(img, 60, 0).save("images/waves1.png");
-//    waves.process(img, 30, 1).save("images/waves2.png");
+//    save(waves.process(img, 60, 0), "waves1");
+//    save(waves.process(img, 30, 1), "waves2");
 
 //    GlassFilter glass;
-//    glass.process(img).save("images/glass.png");
+//    save(glass.process(img), "glass");
 
 //    MotionBlurFilter motionBlur;
-//    motionBlur.process(img).save("images/motionBlur.png");
+//    save(motionBlur.process(img), "motionBlur");
 
+    writeTrace();
     return 0;
 }
@@ -0,0 +1,43 @@
+#include "random.h"
+
+static uint64_t splitMix64(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ull;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
+
+// Chris Wellons' lowbias32 integer hash
+static uint32_t hash32(uint32_t value) {
+    value ^= value >> 16;
+    value *= 0x7feb352du;
+    value ^= value >> 15;
+    value *= 0x846ca68bu;
+    return value ^ (value >> 16);
+}
+
+// The top 24 bits fill a float mantissa exactly
+static float toUniform(uint32_t value) {
+    return (value >> 8) * (1.f / 16777216.f);
+}
+
+CounterRandom::CounterRandom(uint64_t seed) : seed(seed) {}
+
+uint32_t CounterRandom::rowKey(int y, int stream) const {
+    return static_cast<uint32_t>(splitMix64(splitMix64(seed ^ (uint64_t(uint32_t(stream)) << 32)) ^ uint32_t(y)));
+}
+
+uint32_t CounterRandom::value(int x, int y, int stream) const {
+    return hash32(rowKey(y, stream) ^ uint32_t(x));
+}
+
+float CounterRandom::uniform(int x, int y, int stream) const {
+    return toUniform(value(x, y, stream));
+}
+
+void CounterRandom::uniformRow(int y, int stream, int count, float *result) const {
+    uint32_t key = rowKey(y, stream);
+    for (int x = 0; x < count; x++) {
+        result[x] = toUniform(hash32(key ^ uint32_t(x)));
+    }
+}
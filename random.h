@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+// Stateless random numbers for stochastic filters. The number drawn for pixel (x, y) of a stream is a hash of the
+// seed, the stream, y and x, so pixels can be generated on any thread and in any order with the same result.
+// Rows are keyed once with the SplitMix64 finaliser, pixels then only need a 32-bit hash of (key, x), which the
+// compiler vectorizes over a whole row.
+class CounterRandom {
+protected:
+    uint64_t seed;
+    uint32_t rowKey(int y, int stream) const;
+
+public:
+    explicit CounterRandom(uint64_t seed = 0);
+
+    uint32_t value(int x, int y, int stream = 0) const;
+    // Uniform in [0, 1)
+    float uniform(int x, int y, int stream = 0) const;
+    // uniform() of pixels [0, count) of row y
+    void uniformRow(int y, int stream, int count, float *result) const;
+};
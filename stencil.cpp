@@ -0,0 +1,625 @@
+#include "stencil.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STENCIL_X86
+#include <immintrin.h>
+#endif
+
+static int channelSum(const QRgb *const lines[3], int width, int x, const int weights[9], int shift) {
+    int sum = 0;
+    for (int k = 0; k < 9; k++) {
+        sum += weights[k] * ((lines[k / 3][std::min(std::max(x + k % 3 - 1, 0), width - 1)] >> shift) & 0xff);
+    }
+    return sum;
+}
+
+// Alpha max plus beta min coefficients with the smallest largest error
+static const float alphaMax = 0.96043387f, betaMin = 0.39782473f;
+
+static void convolvePixels(const QRgb *const lines[3], int width, int xBegin, int xEnd, const int weights[9], QRgb *result) {
+    for (int x = xBegin; x < xEnd; x++) {
+        int red = channelSum(lines, width, x, weights, 16), green = channelSum(lines, width, x, weights, 8), blue = channelSum(lines, width, x, weights, 0);
+        result[x] = qRgb(std::min(std::max(red, 0), 255), std::min(std::max(green, 0), 255), std::min(std::max(blue, 0), 255));
+    }
+}
+
+static void gradientPixels(const QRgb *const lines[3], int width, int xBegin, int xEnd, const int weightsX[9], const int weightsY[9], GradientMagnitude type, QRgb *result) {
+    for (int x = xBegin; x < xEnd; x++) {
+        result[x] = qRgb(Stencil3x3::gradientMagnitude(channelSum(lines, width, x, weightsX, 16), channelSum(lines, width, x, weightsY, 16), type),
+                         Stencil3x3::gradientMagnitude(channelSum(lines, width, x, weightsX, 8), channelSum(lines, width, x, weightsY, 8), type),
+                         Stencil3x3::gradientMagnitude(channelSum(lines, width, x, weightsX, 0), channelSum(lines, width, x, weightsY, 0), type));
+    }
+}
+
+// Vector bodies cover the interior pixels [1, returned x), the scalar code does the rest
+typedef int (*ConvolveBody)(const QRgb *const lines[3], int width, const int weights[9], QRgb *result);
+typedef int (*GradientBody)(const QRgb *const lines[3], int width, const int weightsX[9], const int weightsY[9], GradientMagnitude type, QRgb *result);
+
+static int convolveScalar(const QRgb *const *, int, const int *, QRgb *) {
+    return 1;
+}
+
+static int gradientScalar(const QRgb *const *, int, const int *, const int *, GradientMagnitude, QRgb *) {
+    return 1;
+}
+
+// Compile-time weights. A weight whose magnitude has at most two bits set is applied as one or two shifts
+// and an addition (1, 2, 3, 5, 9 and 10 all are), any other one with a multiply.
+constexpr int log2Of(int value) {
+    return value <= 1 ? 0 : 1 + log2Of(value / 2);
+}
+
+template <int W>
+struct StaticWeight {
+    static const int magnitude = W < 0 ? -W : W;
+    static const int low = magnitude & -magnitude;
+    static const int high = magnitude - low;
+    static const bool shifts = high == 0 || (high & (high - 1)) == 0;
+};
+
+// Interior pixels [1, returned x) of the static stencils without vector instructions
+template <int... W, std::size_t... K>
+static inline int staticChannelSum(const QRgb *const lines[3], int x, int shift, std::index_sequence<K...>) {
+    int sum = 0;
+    int expand[] = {(sum += W * static_cast<int>((lines[K / 3][x + static_cast<int>(K % 3) - 1] >> shift) & 0xff), 0)...};
+    (void)expand;
+    return sum;
+}
+
+template <int... W>
+static int convolveStaticScalar(const QRgb *const lines[3], int width, QRgb *result) {
+    int x = 1;
+    for (; x < width - 1; x++) {
+        int red = staticChannelSum<W...>(lines, x, 16, std::make_index_sequence<9>());
+        int green = staticChannelSum<W...>(lines, x, 8, std::make_index_sequence<9>());
+        int blue = staticChannelSum<W...>(lines, x, 0, std::make_index_sequence<9>());
+        result[x] = qRgb(std::min(std::max(red, 0), 255), std::min(std::max(green, 0), 255), std::min(std::max(blue, 0), 255));
+    }
+    return x;
+}
+
+template <typename WeightsX, typename WeightsY>
+struct StaticGradientScalar;
+
+template <int... WX, int... WY>
+struct StaticGradientScalar<StaticKernel<3, WX...>, StaticKernel<3, WY...>> {
+    static int run(const QRgb *const lines[3], int width, GradientMagnitude type, QRgb *result) {
+        int x = 1;
+        for (; x < width - 1; x++) {
+            int channels[3];
+            for (int c = 0; c < 3; c++) {
+                int shift = 16 - 8 * c;
+                channels[c] = Stencil3x3::gradientMagnitude(staticChannelSum<WX...>(lines, x, shift, std::make_index_sequence<9>()), staticChannelSum<WY...>(lines, x, shift, std::make_index_sequence<9>()), type);
+            }
+            result[x] = qRgb(channels[0], channels[1], channels[2]);
+        }
+        return x;
+    }
+};
+
+#ifdef STENCIL_X86
+
+// The alpha byte is filtered like the colour bytes and then overwritten
+static const int alphaMask = static_cast<int>(0xff000000u);
+
+// Pixels per unrolled step: four SSE or two AVX2 registers in flight hide
+// the load and multiply latency that one register per step leaves exposed
+static const int unrolledPixels = 16;
+
+__attribute__((target("sse4.1")))
+static inline void accumulateSse41(const QRgb *const lines[3], int x, const int weights[9], const __m128i factors[9], __m128i &low, __m128i &high) {
+    const __m128i zero = _mm_setzero_si128();
+    low = zero; high = zero;
+    for (int k = 0; k < 9; k++) {
+        if (weights[k]) {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lines[k / 3] + x + k % 3 - 1));
+            low = _mm_add_epi16(low, _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), factors[k]));
+            high = _mm_add_epi16(high, _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), factors[k]));
+        }
+    }
+}
+
+__attribute__((target("sse4.1")))
+static inline void accumulatePairSse41(const QRgb *const lines[3], int x, const int weightsX[9], const int weightsY[9], const __m128i factorsX[9], const __m128i factorsY[9], __m128i gx[2], __m128i gy[2]) {
+    const __m128i zero = _mm_setzero_si128();
+    gx[0] = zero; gx[1] = zero; gy[0] = zero; gy[1] = zero;
+    for (int k = 0; k < 9; k++) {
+        if (weightsX[k] || weightsY[k]) {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lines[k / 3] + x + k % 3 - 1));
+            __m128i low = _mm_unpacklo_epi8(pixels, zero), high = _mm_unpackhi_epi8(pixels, zero);
+            if (weightsX[k]) {
+                gx[0] = _mm_add_epi16(gx[0], _mm_mullo_epi16(low, factorsX[k]));
+                gx[1] = _mm_add_epi16(gx[1], _mm_mullo_epi16(high, factorsX[k]));
+            }
+            if (weightsY[k]) {
+                gy[0] = _mm_add_epi16(gy[0], _mm_mullo_epi16(low, factorsY[k]));
+                gy[1] = _mm_add_epi16(gy[1], _mm_mullo_epi16(high, factorsY[k]));
+            }
+        }
+    }
+}
+
+// Eight 16-bit responses in, eight magnitudes clamped to 255 out, in the same order as the scalar code
+__attribute__((target("sse4.1")))
+static inline __m128i magnitudeSse41(__m128i gx, __m128i gy, GradientMagnitude type) {
+    if (type == GradientMagnitude::L1) {
+        return _mm_min_epu16(_mm_add_epi16(_mm_abs_epi16(gx), _mm_abs_epi16(gy)), _mm_set1_epi16(255));
+    }
+    if (type == GradientMagnitude::Approximate) {
+        __m128i absX = _mm_abs_epi16(gx), absY = _mm_abs_epi16(gy);
+        gx = _mm_max_epi16(absX, absY);
+        gy = _mm_min_epi16(absX, absY);
+    }
+
+    __m128i magnitudes[2];
+    for (int half = 0; half < 2; half++) {
+        __m128i wideX = half ? _mm_unpackhi_epi16(gx, gx) : _mm_unpacklo_epi16(gx, gx);
+        __m128i wideY = half ? _mm_unpackhi_epi16(gy, gy) : _mm_unpacklo_epi16(gy, gy);
+        __m128 fx = _mm_cvtepi32_ps(_mm_srai_epi32(wideX, 16)), fy = _mm_cvtepi32_ps(_mm_srai_epi32(wideY, 16));
+        __m128 magnitude = type == GradientMagnitude::Euclidean ? _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)))
+                                                                : _mm_add_ps(_mm_mul_ps(_mm_set1_ps(alphaMax), fx), _mm_mul_ps(_mm_set1_ps(betaMin), fy));
+        magnitudes[half] = _mm_cvttps_epi32(_mm_min_ps(magnitude, _mm_set1_ps(255.f)));
+    }
+    return _mm_packus_epi32(magnitudes[0], magnitudes[1]);
+}
+
+template <int N>
+__attribute__((target("sse4.1")))
+static int convolveStepsSse41(const QRgb *const lines[3], int width, const int weights[9], const __m128i factors[9], int x, QRgb *result) {
+    for (; x + 4 * N <= width - 1; x += 4 * N) {
+        for (int n = 0; n < 4 * N; n += 4) {
+            __m128i low, high;
+            accumulateSse41(lines, x + n, weights, factors, low, high);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result + x + n), _mm_or_si128(_mm_packus_epi16(low, high), _mm_set1_epi32(alphaMask)));
+        }
+    }
+    return x;
+}
+
+__attribute__((target("sse4.1")))
+static int convolveSse41(const QRgb *const lines[3], int width, const int weights[9], QRgb *result) {
+    __m128i factors[9];
+    for (int k = 0; k < 9; k++) {
+        factors[k] = _mm_set1_epi16(static_cast<short>(weights[k]));
+    }
+    int x = convolveStepsSse41<unrolledPixels / 4>(lines, width, weights, factors, 1, result);
+    return convolveStepsSse41<1>(lines, width, weights, factors, x, result);
+}
+
+template <int N>
+__attribute__((target("sse4.1")))
+static int gradientStepsSse41(const QRgb *const lines[3], int width, const int weightsX[9], const int weightsY[9], const __m128i factorsX[9], const __m128i factorsY[9], GradientMagnitude type, int x, QRgb *result) {
+    for (; x + 4 * N <= width - 1; x += 4 * N) {
+        for (int n = 0; n < 4 * N; n += 4) {
+            __m128i gx[2], gy[2];
+            accumulatePairSse41(lines, x + n, weightsX, weightsY, factorsX, factorsY, gx, gy);
+            __m128i magnitude = _mm_packus_epi16(magnitudeSse41(gx[0], gy[0], type), magnitudeSse41(gx[1], gy[1], type));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result + x + n), _mm_or_si128(magnitude, _mm_set1_epi32(alphaMask)));
+        }
+    }
+    return x;
+}
+
+__attribute__((target("sse4.1")))
+static int gradientSse41(const QRgb *const lines[3], int width, const int weightsX[9], const int weightsY[9], GradientMagnitude type, QRgb *result) {
+    __m128i factorsX[9], factorsY[9];
+    for (int k = 0; k < 9; k++) {
+        factorsX[k] = _mm_set1_epi16(static_cast<short>(weightsX[k]));
+        factorsY[k] = _mm_set1_epi16(static_cast<short>(weightsY[k]));
+    }
+    int x = gradientStepsSse41<unrolledPixels / 4>(lines, width, weightsX, weightsY, factorsX, factorsY, type, 1, result);
+    return gradientStepsSse41<1>(lines, width, weightsX, weightsY, factorsX, factorsY, type, x, result);
+}
+
+// AVX2 unpacks and packs work within 128-bit lanes, which keeps the pixel order intact
+__attribute__((target("avx2")))
+static inline void accumulateAvx2(const QRgb *const lines[3], int x, const int weights[9], const __m256i factors[9], __m256i &low, __m256i &high) {
+    const __m256i zero = _mm256_setzero_si256();
+    low = zero; high = zero;
+    for (int k = 0; k < 9; k++) {
+        if (weights[k]) {
+            __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lines[k / 3] + x + k % 3 - 1));
+            low = _mm256_add_epi16(low, _mm256_mullo_epi16(_mm256_unpacklo_epi8(pixels, zero), factors[k]));
+            high = _mm256_add_epi16(high, _mm256_mullo_epi16(_mm256_unpackhi_epi8(pixels, zero), factors[k]));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void accumulatePairAvx2(const QRgb *const lines[3], int x, const int weightsX[9], const int weightsY[9], const __m256i factorsX[9], const __m256i factorsY[9], __m256i gx[2], __m256i gy[2]) {
+    const __m256i zero = _mm256_setzero_si256();
+    gx[0] = zero; gx[1] = zero; gy[0] = zero; gy[1] = zero;
+    for (int k = 0; k < 9; k++) {
+        if (weightsX[k] || weightsY[k]) {
+            __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lines[k / 3] + x + k % 3 - 1));
+            __m256i low = _mm256_unpacklo_epi8(pixels, zero), high = _mm256_unpackhi_epi8(pixels, zero);
+            if (weightsX[k]) {
+                gx[0] = _mm256_add_epi16(gx[0], _mm256_mullo_epi16(low, factorsX[k]));
+                gx[1] = _mm256_add_epi16(gx[1], _mm256_mullo_epi16(high, factorsX[k]));
+            }
+            if (weightsY[k]) {
+                gy[0] = _mm256_add_epi16(gy[0], _mm256_mullo_epi16(low, factorsY[k]));
+                gy[1] = _mm256_add_epi16(gy[1], _mm256_mullo_epi16(high, factorsY[k]));
+            }
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i magnitudeAvx2(__m256i gx, __m256i gy, GradientMagnitude type) {
+    if (type == GradientMagnitude::L1) {
+        return _mm256_min_epu16(_mm256_add_epi16(_mm256_abs_epi16(gx), _mm256_abs_epi16(gy)), _mm256_set1_epi16(255));
+    }
+    if (type == GradientMagnitude::Approximate) {
+        __m256i absX = _mm256_abs_epi16(gx), absY = _mm256_abs_epi16(gy);
+        gx = _mm256_max_epi16(absX, absY);
+        gy = _mm256_min_epi16(absX, absY);
+    }
+
+    __m256i magnitudes[2];
+    for (int half = 0; half < 2; half++) {
+        __m256i wideX = half ? _mm256_unpackhi_epi16(gx, gx) : _mm256_unpacklo_epi16(gx, gx);
+        __m256i wideY = half ? _mm256_unpackhi_epi16(gy, gy) : _mm256_unpacklo_epi16(gy, gy);
+        __m256 fx = _mm256_cvtepi32_ps(_mm256_srai_epi32(wideX, 16)), fy = _mm256_cvtepi32_ps(_mm256_srai_epi32(wideY, 16));
+        __m256 magnitude = type == GradientMagnitude::Euclidean ? _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(fx, fx), _mm256_mul_ps(fy, fy)))
+                                                                : _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(alphaMax), fx), _mm256_mul_ps(_mm256_set1_ps(betaMin), fy));
+        magnitudes[half] = _mm256_cvttps_epi32(_mm256_min_ps(magnitude, _mm256_set1_ps(255.f)));
+    }
+    return _mm256_packus_epi32(magnitudes[0], magnitudes[1]);
+}
+
+template <int N>
+__attribute__((target("avx2")))
+static int convolveStepsAvx2(const QRgb *const lines[3], int width, const int weights[9], const __m256i factors[9], int x, QRgb *result) {
+    for (; x + 8 * N <= width - 1; x += 8 * N) {
+        for (int n = 0; n < 8 * N; n += 8) {
+            __m256i low, high;
+            accumulateAvx2(lines, x + n, weights, factors, low, high);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(result + x + n), _mm256_or_si256(_mm256_packus_epi16(low, high), _mm256_set1_epi32(alphaMask)));
+        }
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static int convolveAvx2(const QRgb *const lines[3], int width, const int weights[9], QRgb *result) {
+    __m256i factors[9];
+    for (int k = 0; k < 9; k++) {
+        factors[k] = _mm256_set1_epi16(static_cast<short>(weights[k]));
+    }
+    int x = convolveStepsAvx2<unrolledPixels / 8>(lines, width, weights, factors, 1, result);
+    return convolveStepsAvx2<1>(lines, width, weights, factors, x, result);
+}
+
+template <int N>
+__attribute__((target("avx2")))
+static int gradientStepsAvx2(const QRgb *const lines[3], int width, const int weightsX[9], const int weightsY[9], const __m256i factorsX[9], const __m256i factorsY[9], GradientMagnitude type, int x, QRgb *result) {
+    for (; x + 8 * N <= width - 1; x += 8 * N) {
+        for (int n = 0; n < 8 * N; n += 8) {
+            __m256i gx[2], gy[2];
+            accumulatePairAvx2(lines, x + n, weightsX, weightsY, factorsX, factorsY, gx, gy);
+            __m256i magnitude = _mm256_packus_epi16(magnitudeAvx2(gx[0], gy[0], type), magnitudeAvx2(gx[1], gy[1], type));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(result + x + n), _mm256_or_si256(magnitude, _mm256_set1_epi32(alphaMask)));
+        }
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static int gradientAvx2(const QRgb *const lines[3], int width, const int weightsX[9], const int weightsY[9], GradientMagnitude type, QRgb *result) {
+    __m256i factorsX[9], factorsY[9];
+    for (int k = 0; k < 9; k++) {
+        factorsX[k] = _mm256_set1_epi16(static_cast<short>(weightsX[k]));
+        factorsY[k] = _mm256_set1_epi16(static_cast<short>(weightsY[k]));
+    }
+    int x = gradientStepsAvx2<unrolledPixels / 8>(lines, width, weightsX, weightsY, factorsX, factorsY, type, 1, result);
+    return gradientStepsAvx2<1>(lines, width, weightsX, weightsY, factorsX, factorsY, type, x, result);
+}
+
+template <int Shift>
+__attribute__((target("sse4.1")))
+static inline __m128i shiftedSse41(__m128i v) {
+    return Shift == 0 ? v : _mm_slli_epi16(v, Shift);
+}
+
+template <int W>
+__attribute__((target("sse4.1")))
+static inline __m128i addWeightedSse41(__m128i sum, __m128i v) {
+    typedef StaticWeight<W> Weight;
+    __m128i scaled;
+    if (Weight::shifts) {
+        scaled = shiftedSse41<log2Of(Weight::low)>(v);
+        if (Weight::high) {
+            scaled = _mm_add_epi16(scaled, shiftedSse41<log2Of(Weight::high)>(v));
+        }
+    } else {
+        scaled = _mm_mullo_epi16(v, _mm_set1_epi16(static_cast<short>(Weight::magnitude)));
+    }
+    return W < 0 ? _mm_sub_epi16(sum, scaled) : _mm_add_epi16(sum, scaled);
+}
+
+template <int WX, int WY, std::size_t K>
+__attribute__((target("sse4.1")))
+static inline void staticTapSse41(const QRgb *const lines[3], int x, __m128i gx[2], __m128i gy[2]) {
+    if (WX == 0 && WY == 0) {
+        return;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lines[K / 3] + x + static_cast<int>(K % 3) - 1));
+    __m128i low = _mm_unpacklo_epi8(pixels, zero), high = _mm_unpackhi_epi8(pixels, zero);
+    if (WX != 0) {
+        gx[0] = addWeightedSse41<WX>(gx[0], low);
+        gx[1] = addWeightedSse41<WX>(gx[1], high);
+    }
+    if (WY != 0) {
+        gy[0] = addWeightedSse41<WY>(gy[0], low);
+        gy[1] = addWeightedSse41<WY>(gy[1], high);
+    }
+}
+
+// A convolution is a gradient whose second kernel is all zeros, which then costs nothing
+template <typename WeightsX, typename WeightsY>
+struct StaticBodySse41;
+
+template <int... WX, int... WY>
+struct StaticBodySse41<StaticKernel<3, WX...>, StaticKernel<3, WY...>> {
+    template <std::size_t... K>
+    __attribute__((target("sse4.1")))
+    static inline void accumulate(const QRgb *const lines[3], int x, __m128i gx[2], __m128i gy[2], std::index_sequence<K...>) {
+        gx[0] = gx[1] = gy[0] = gy[1] = _mm_setzero_si128();
+        int expand[] = {(staticTapSse41<WX, WY, K>(lines, x, gx, gy), 0)...};
+        (void)expand;
+    }
+
+    template <int N>
+    __attribute__((target("sse4.1")))
+    static int convolveSteps(const QRgb *const lines[3], int width, int x, QRgb *result) {
+        for (; x + 4 * N <= width - 1; x += 4 * N) {
+            for (int n = 0; n < 4 * N; n += 4) {
+                __m128i gx[2], gy[2];
+                accumulate(lines, x + n, gx, gy, std::make_index_sequence<9>());
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(result + x + n), _mm_or_si128(_mm_packus_epi16(gx[0], gx[1]), _mm_set1_epi32(alphaMask)));
+            }
+        }
+        return x;
+    }
+
+    template <int N>
+    __attribute__((target("sse4.1")))
+    static int gradientSteps(const QRgb *const lines[3], int width, GradientMagnitude type, int x, QRgb *result) {
+        for (; x + 4 * N <= width - 1; x += 4 * N) {
+            for (int n = 0; n < 4 * N; n += 4) {
+                __m128i gx[2], gy[2];
+                accumulate(lines, x + n, gx, gy, std::make_index_sequence<9>());
+                __m128i magnitude = _mm_packus_epi16(magnitudeSse41(gx[0], gy[0], type), magnitudeSse41(gx[1], gy[1], type));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(result + x + n), _mm_or_si128(magnitude, _mm_set1_epi32(alphaMask)));
+            }
+        }
+        return x;
+    }
+
+    __attribute__((target("sse4.1")))
+    static int convolve(const QRgb *const lines[3], int width, QRgb *result) {
+        return convolveSteps<1>(lines, width, convolveSteps<unrolledPixels / 4>(lines, width, 1, result), result);
+    }
+
+    __attribute__((target("sse4.1")))
+    static int gradient(const QRgb *const lines[3], int width, GradientMagnitude type, QRgb *result) {
+        return gradientSteps<1>(lines, width, type, gradientSteps<unrolledPixels / 4>(lines, width, type, 1, result), result);
+    }
+};
+
+template <int Shift>
+__attribute__((target("avx2")))
+static inline __m256i shiftedAvx2(__m256i v) {
+    return Shift == 0 ? v : _mm256_slli_epi16(v, Shift);
+}
+
+template <int W>
+__attribute__((target("avx2")))
+static inline __m256i addWeightedAvx2(__m256i sum, __m256i v) {
+    typedef StaticWeight<W> Weight;
+    __m256i scaled;
+    if (Weight::shifts) {
+        scaled = shiftedAvx2<log2Of(Weight::low)>(v);
+        if (Weight::high) {
+            scaled = _mm256_add_epi16(scaled, shiftedAvx2<log2Of(Weight::high)>(v));
+        }
+    } else {
+        scaled = _mm256_mullo_epi16(v, _mm256_set1_epi16(static_cast<short>(Weight::magnitude)));
+    }
+    return W < 0 ? _mm256_sub_epi16(sum, scaled) : _mm256_add_epi16(sum, scaled);
+}
+
+template <int WX, int WY, std::size_t K>
+__attribute__((target("avx2")))
+static inline void staticTapAvx2(const QRgb *const lines[3], int x, __m256i gx[2], __m256i gy[2]) {
+    if (WX == 0 && WY == 0) {
+        return;
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lines[K / 3] + x + static_cast<int>(K % 3) - 1));
+    __m256i low = _mm256_unpacklo_epi8(pixels, zero), high = _mm256_unpackhi_epi8(pixels, zero);
+    if (WX != 0) {
+        gx[0] = addWeightedAvx2<WX>(gx[0], low);
+        gx[1] = addWeightedAvx2<WX>(gx[1], high);
+    }
+    if (WY != 0) {
+        gy[0] = addWeightedAvx2<WY>(gy[0], low);
+        gy[1] = addWeightedAvx2<WY>(gy[1], high);
+    }
+}
+
+template <typename WeightsX, typename WeightsY>
+struct StaticBodyAvx2;
+
+template <int... WX, int... WY>
+struct StaticBodyAvx2<StaticKernel<3, WX...>, StaticKernel<3, WY...>> {
+    template <std::size_t... K>
+    __attribute__((target("avx2")))
+    static inline void accumulate(const QRgb *const lines[3], int x, __m256i gx[2], __m256i gy[2], std::index_sequence<K...>) {
+        gx[0] = gx[1] = gy[0] = gy[1] = _mm256_setzero_si256();
+        int expand[] = {(staticTapAvx2<WX, WY, K>(lines, x, gx, gy), 0)...};
+        (void)expand;
+    }
+
+    template <int N>
+    __attribute__((target("avx2")))
+    static int convolveSteps(const QRgb *const lines[3], int width, int x, QRgb *result) {
+        for (; x + 8 * N <= width - 1; x += 8 * N) {
+            for (int n = 0; n < 8 * N; n += 8) {
+                __m256i gx[2], gy[2];
+                accumulate(lines, x + n, gx, gy, std::make_index_sequence<9>());
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(result + x + n), _mm256_or_si256(_mm256_packus_epi16(gx[0], gx[1]), _mm256_set1_epi32(alphaMask)));
+            }
+        }
+        return x;
+    }
+
+    template <int N>
+    __attribute__((target("avx2")))
+    static int gradientSteps(const QRgb *const lines[3], int width, GradientMagnitude type, int x, QRgb *result) {
+        for (; x + 8 * N <= width - 1; x += 8 * N) {
+            for (int n = 0; n < 8 * N; n += 8) {
+                __m256i gx[2], gy[2];
+                accumulate(lines, x + n, gx, gy, std::make_index_sequence<9>());
+                __m256i magnitude = _mm256_packus_epi16(magnitudeAvx2(gx[0], gy[0], type), magnitudeAvx2(gx[1], gy[1], type));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(result + x + n), _mm256_or_si256(magnitude, _mm256_set1_epi32(alphaMask)));
+            }
+        }
+        return x;
+    }
+
+    __attribute__((target("avx2")))
+    static int convolve(const QRgb *const lines[3], int width, QRgb *result) {
+        return convolveSteps<1>(lines, width, convolveSteps<unrolledPixels / 8>(lines, width, 1, result), result);
+    }
+
+    __attribute__((target("avx2")))
+    static int gradient(const QRgb *const lines[3], int width, GradientMagnitude type, QRgb *result) {
+        return gradientSteps<1>(lines, width, type, gradientSteps<unrolledPixels / 8>(lines, width, type, 1, result), result);
+    }
+};
+
+#endif
+
+enum class InstructionSet { Scalar, Sse41, Avx2 };
+
+struct StencilImplementation {
+    ConvolveBody convolve;
+    GradientBody gradient;
+    const char *name;
+    InstructionSet set;
+};
+
+static StencilImplementation chooseImplementation() {
+#ifdef STENCIL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {convolveAvx2, gradientAvx2, "avx2", InstructionSet::Avx2};
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return {convolveSse41, gradientSse41, "sse4.1", InstructionSet::Sse41};
+    }
+#endif
+    return {convolveScalar, gradientScalar, "scalar", InstructionSet::Scalar};
+}
+
+static const StencilImplementation &implementation() {
+    static const StencilImplementation chosen = chooseImplementation();
+    return chosen;
+}
+
+void Stencil3x3::convolveRow(const QRgb *const lines[3], int width, const int weights[9], QRgb *result) {
+    int end = implementation().convolve(lines, width, weights, result);
+    convolvePixels(lines, width, 0, std::min(1, width), weights, result);
+    convolvePixels(lines, width, end, width, weights, result);
+}
+
+void Stencil3x3::gradientRow(const QRgb *const lines[3], int width, const int weightsX[9], const int weightsY[9], GradientMagnitude type, QRgb *result) {
+    int end = implementation().gradient(lines, width, weightsX, weightsY, type, result);
+    gradientPixels(lines, width, 0, std::min(1, width), weightsX, weightsY, type, result);
+    gradientPixels(lines, width, end, width, weightsX, weightsY, type, result);
+}
+
+int Stencil3x3::gradientMagnitude(float gx, float gy, GradientMagnitude type) {
+    float magnitude;
+    if (type == GradientMagnitude::L1) {
+        magnitude = std::abs(gx) + std::abs(gy);
+    } else if (type == GradientMagnitude::Approximate) {
+        float high = std::max(std::abs(gx), std::abs(gy)), low = std::min(std::abs(gx), std::abs(gy));
+        magnitude = alphaMax * high + betaMin * low;
+    } else {
+        magnitude = std::sqrt(gx * gx + gy * gy);
+    }
+    return std::min(magnitude, 255.f);
+}
+
+const char *Stencil3x3::instructionSet() {
+    return implementation().name;
+}
+
+// The border pixels and the tail of the vector bodies go through the runtime weights, which give the same result
+template <int... W>
+static void staticConvolveRow(StaticKernel<3, W...>, const QRgb *const lines[3], int width, QRgb *result) {
+    typedef StaticKernel<3, W...> Weights;
+    const int weights[9] = {W...};
+    int end;
+    switch (implementation().set) {
+#ifdef STENCIL_X86
+    case InstructionSet::Avx2:
+        end = StaticBodyAvx2<Weights, StaticKernel<3, 0, 0, 0, 0, 0, 0, 0, 0, 0>>::convolve(lines, width, result);
+        break;
+    case InstructionSet::Sse41:
+        end = StaticBodySse41<Weights, StaticKernel<3, 0, 0, 0, 0, 0, 0, 0, 0, 0>>::convolve(lines, width, result);
+        break;
+#endif
+    default:
+        end = convolveStaticScalar<W...>(lines, width, result);
+    }
+    convolvePixels(lines, width, 0, std::min(1, width), weights, result);
+    convolvePixels(lines, width, end, width, weights, result);
+}
+
+template <int... WX, int... WY>
+static void staticGradientRow(StaticKernel<3, WX...>, StaticKernel<3, WY...>, const QRgb *const lines[3], int width, GradientMagnitude type, QRgb *result) {
+    typedef StaticKernel<3, WX...> WeightsX;
+    typedef StaticKernel<3, WY...> WeightsY;
+    const int weightsX[9] = {WX...}, weightsY[9] = {WY...};
+    int end;
+    switch (implementation().set) {
+#ifdef STENCIL_X86
+    case InstructionSet::Avx2:
+        end = StaticBodyAvx2<WeightsX, WeightsY>::gradient(lines, width, type, result);
+        break;
+    case InstructionSet::Sse41:
+        end = StaticBodySse41<WeightsX, WeightsY>::gradient(lines, width, type, result);
+        break;
+#endif
+    default:
+        end = StaticGradientScalar<WeightsX, WeightsY>::run(lines, width, type, result);
+    }
+    gradientPixels(lines, width, 0, std::min(1, width), weightsX, weightsY, type, result);
+    gradientPixels(lines, width, end, width, weightsX, weightsY, type, result);
+}
+
+template <typename Weights>
+void StaticStencil3x3<Weights>::convolveRow(const QRgb *const lines[3], int width, QRgb *result) {
+    staticConvolveRow(Weights(), lines, width, result);
+}
+
+template <typename WeightsX, typename WeightsY>
+void StaticGradient3x3<WeightsX, WeightsY>::gradientRow(const QRgb *const lines[3], int width, GradientMagnitude type, QRgb *result) {
+    staticGradientRow(WeightsX(), WeightsY(), lines, width, type, result);
+}
+
+template struct StaticStencil3x3<SobelWeightsX>;
+template struct StaticStencil3x3<SobelWeightsY>;
+template struct StaticStencil3x3<SharpnessWeights>;
+template struct StaticStencil3x3<Sharpness2Weights>;
+template struct StaticGradient3x3<SobelWeightsX, SobelWeightsY>;
+template struct StaticGradient3x3<ScharrWeightsX, ScharrWeightsY>;
+template struct StaticGradient3x3<PrewittWeightsX, PrewittWeightsY>;
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <QImage>
+
+// How DualFilter combines its two responses: sqrt(gx^2 + gy^2), |gx| + |gy|,
+// or the alpha max plus beta min estimate of the square root (within 4%, no sqrt)
+enum class GradientMagnitude { Euclidean, L1, Approximate };
+
+// 3x3 stencils with small integer weights on 32-bit pixels. Rows are evaluated with 16-bit
+// accumulators on packed 8-bit channels, using AVX2 or SSE4.1 when the CPU has them.
+// Results are exact, so every instruction set gives the same output as the scalar code.
+class Stencil3x3 {
+public:
+    // Largest sum of absolute weights that cannot overflow a 16-bit accumulator
+    static const int maxWeightSum = 128;
+
+    // lines are the rows y - 1, y and y + 1, already clamped to the image
+    static void convolveRow(const QRgb *const lines[3], int width, const int weights[9], QRgb *result);
+    // Both responses from a single fetch of every tap, combined by gradientMagnitude()
+    static void gradientRow(const QRgb *const lines[3], int width, const int weightsX[9], const int weightsY[9], GradientMagnitude type, QRgb *result);
+    static int gradientMagnitude(float gx, float gy, GradientMagnitude type);
+    static const char *instructionSet();
+};
+
+// Weights of an N x N kernel known at compile time, row after row
+template <int N, int... Weights>
+struct StaticKernel {
+    static_assert(sizeof...(Weights) == N * N, "an N x N kernel has N * N weights");
+    static const int size = N;
+    static const int radius = N / 2;
+
+    // Fills the storage of a runtime Kernel of the same size
+    static void copyTo(float *data) {
+        const int weights[] = {Weights...};
+        for (std::size_t i = 0; i < sizeof...(Weights); i++) {
+            data[i] = static_cast<float>(weights[i]);
+        }
+    }
+};
+
+typedef StaticKernel<3, -1, 0, 1, -2, 0, 2, -1, 0, 1> SobelWeightsX;
+typedef StaticKernel<3, -1, -2, -1, 0, 0, 0, 1, 2, 1> SobelWeightsY;
+typedef StaticKernel<3, 3, 0, -3, 10, 0, -10, 3, 0, -3> ScharrWeightsX;
+typedef StaticKernel<3, 3, 10, 3, 0, 0, 0, -3, -10, -3> ScharrWeightsY;
+typedef StaticKernel<3, -1, 0, 1, -1, 0, 1, -1, 0, 1> PrewittWeightsX;
+typedef StaticKernel<3, -1, -1, -1, 0, 0, 0, 1, 1, 1> PrewittWeightsY;
+typedef StaticKernel<3, 0, -1, 0, -1, 5, -1, 0, -1, 0> SharpnessWeights;
+typedef StaticKernel<3, -1, -1, -1, -1, 9, -1, -1, -1, -1> Sharpness2Weights;
+
+typedef void (*StencilRow)(const QRgb *const lines[3], int width, QRgb *result);
+typedef void (*GradientRow)(const QRgb *const lines[3], int width, GradientMagnitude type, QRgb *result);
+
+// Stencil3x3 with the weights of a StaticKernel<3> compiled in: taps are unrolled, zero taps are never loaded and
+// weights of one or two powers of two become shifts and additions instead of multiplies. The output is the same
+// as Stencil3x3's. Instantiated in stencil.cpp for the typedefs above only.
+template <typename Weights>
+struct StaticStencil3x3 {
+    static void convolveRow(const QRgb *const lines[3], int width, QRgb *result);
+};
+
+template <typename WeightsX, typename WeightsY>
+struct StaticGradient3x3 {
+    static void gradientRow(const QRgb *const lines[3], int width, GradientMagnitude type, QRgb *result);
+};
@@ -0,0 +1,143 @@
+#include "threadpool.h"
+#include <algorithm>
+
+static thread_local bool insideJob = false;
+
+ThreadPool::ThreadPool() : job(nullptr), generation(0), busy(0), stopping(false) {
+    start(0);
+}
+
+ThreadPool::~ThreadPool() {
+    stop();
+}
+
+ThreadPool &ThreadPool::instance() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::start(std::size_t count) {
+    if (count == 0) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    stopping = false;
+    threadCount = count;
+    for (std::size_t i = 1; i < count; i++) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+void ThreadPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+void ThreadPool::setThreadCount(std::size_t count) {
+    std::lock_guard<std::mutex> jobLock(jobMutex);
+    stop();
+    start(count);
+}
+
+std::size_t ThreadPool::getThreadCount() const {
+    return threadCount;
+}
+
+void ThreadPool::runJob(Job &job) {
+    struct NestingGuard {
+        bool nested = insideJob;
+        NestingGuard() { insideJob = true; }
+        ~NestingGuard() { insideJob = nested; }
+    } guard;
+
+    try {
+        for (int chunkBegin = job.next.fetch_add(job.grain); chunkBegin < job.end; chunkBegin = job.next.fetch_add(job.grain)) {
+            (*job.body)(chunkBegin, std::min(chunkBegin + job.grain, job.end));
+        }
+    } catch (...) {
+        // Chunks already taken by other threads still finish, the rest are dropped
+        job.next = job.end;
+        std::lock_guard<std::mutex> lock(job.errorMutex);
+        if (!job.error) {
+            job.error = std::current_exception();
+        }
+    }
+}
+
+void ThreadPool::workerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::size_t seen = generation;
+    while (true) {
+        wake.wait(lock, [&] { return stopping || (job && generation != seen); });
+        if (stopping) {
+            return;
+        }
+        seen = generation;
+        Job *current = job;
+        busy++;
+        lock.unlock();
+
+        runJob(*current);
+
+        lock.lock();
+        if (--busy == 0) {
+            done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::parallelFor(int begin, int end, int grain, const std::function<void(int, int)> &body) {
+    if (begin >= end) {
+        return;
+    }
+    grain = std::max(grain, 1);
+    if (insideJob || end - begin <= grain) {
+        body(begin, end);
+        return;
+    }
+
+    // The pool runs one job at a time, a caller that finds it taken does its work on its own thread
+    std::unique_lock<std::mutex> jobLock(jobMutex, std::try_to_lock);
+    if (!jobLock.owns_lock() || workers.empty()) {
+        body(begin, end);
+        return;
+    }
+
+    Job current;
+    current.body = &body;
+    current.end = end;
+    current.grain = grain;
+    current.next = begin;
+
+    // Workers only pick the job up while it is published, so once it is withdrawn nobody can touch it.
+    // This also runs while unwinding, current must never outlive its publication.
+    struct Withdrawal {
+        ThreadPool &pool;
+        ~Withdrawal() {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.job = nullptr;
+            pool.done.wait(lock, [&] { return pool.busy == 0; });
+        }
+    };
+    {
+        Withdrawal withdrawal{*this};
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &current;
+            generation++;
+        }
+        wake.notify_all();
+
+        runJob(current);
+    }
+
+    if (current.error) {
+        std::rethrow_exception(current.error);
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Process-wide pool of worker threads. The calling thread always takes part in the work,
+// so a pool of N threads owns N - 1 workers.
+class ThreadPool {
+protected:
+    struct Job {
+        const std::function<void(int, int)> *body;
+        int end, grain;
+        std::atomic<int> next;
+        // First exception thrown by the body, rethrown on the calling thread once every thread has left the job
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    std::vector<std::thread> workers;
+    std::mutex mutex, jobMutex;
+    std::condition_variable wake, done;
+    Job *job;
+    std::size_t generation, busy;
+    std::atomic<std::size_t> threadCount;
+    bool stopping;
+
+    ThreadPool();
+    void start(std::size_t count);
+    void stop();
+    void workerLoop();
+    static void runJob(Job &job);
+
+public:
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &other) = delete;
+    ThreadPool &operator=(const ThreadPool &other) = delete;
+
+    static ThreadPool &instance();
+    // 0 means one thread per hardware core
+    void setThreadCount(std::size_t count);
+    std::size_t getThreadCount() const;
+    // Splits [begin, end) into chunks of `grain` items and calls body(chunkBegin, chunkEnd) on every thread of the pool.
+    // Returns when every chunk is done. Calls made from inside a running job execute inline. If the body throws,
+    // no further chunks are started and the first exception is rethrown here once all threads are done.
+    void parallelFor(int begin, int end, int grain, const std::function<void(int, int)> &body);
+};
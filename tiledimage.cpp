@@ -0,0 +1,240 @@
+#include "tiledimage.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+const char TiledImageHeader::magic[8] = {'C', 'G', 'T', 'I', 'L', 'E', 'S', '1'};
+
+TiledImageHeader::TiledImageHeader() : width(0), height(0), tileWidth(0), tileHeight(0), format(0), tileStride(0), dataOffset(0) {
+    std::memset(signature, 0, sizeof(signature));
+}
+
+TiledImageHeader::TiledImageHeader(int width, int height, bool alpha, int tileWidth, int tileHeight)
+    : width(width), height(height), tileWidth(std::max(std::min(tileWidth, width), 1)), tileHeight(std::max(std::min(tileHeight, height), 1)), format(alpha ? 1 : 0), tileStride(0), dataOffset(pageBytes) {
+    // An empty image has no signature, so the header is invalid and nothing is written with it
+    std::memset(signature, 0, sizeof(signature));
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    std::memcpy(signature, magic, sizeof(signature));
+    tileStride = (this->tileWidth * sizeof(QRgb) + ImageBuffer::alignment - 1) / ImageBuffer::alignment * ImageBuffer::alignment;
+}
+
+bool TiledImageHeader::isValid() const {
+    return std::memcmp(signature, magic, sizeof(signature)) == 0 && width > 0 && height > 0 && tileWidth > 0 && tileWidth <= width && tileHeight > 0 && tileHeight <= height && format <= 1 &&
+           tileStride >= tileWidth * sizeof(QRgb) && tileStride % ImageBuffer::alignment == 0 && dataOffset >= sizeof(TiledImageHeader) && dataOffset % pageBytes == 0;
+}
+
+TiledImageReader::TiledImageReader(const std::string &path) : file(std::fopen(path.c_str(), "rb")), bandTop(0), bandBottom(0), next(0) {
+    if (!file) {
+        return;
+    }
+    if (std::fread(&header, sizeof(header), 1, file) != 1 || !header.isValid() || std::fseek(file, static_cast<long>(header.dataOffset), SEEK_SET) != 0) {
+        std::fclose(file);
+        file = nullptr;
+        return;
+    }
+    band = BufferPool::instance().acquire(header.tilesX() * header.tileBytes());
+}
+
+TiledImageReader::~TiledImageReader() {
+    if (file) {
+        std::fclose(file);
+    }
+}
+
+bool TiledImageReader::read(QRgb *rows, int count, int stride) {
+    if (!file || next + count > height()) {
+        return false;
+    }
+    std::size_t bandBytes = header.tilesX() * header.tileBytes();
+    for (int row = 0; row < count; row++, rows += stride, next++) {
+        // The tile rows are read in order, the file is never sought
+        if (next >= bandBottom) {
+            if (std::fread(band.get(), 1, bandBytes, file) != bandBytes) {
+                return false;
+            }
+            bandTop = bandBottom;
+            bandBottom = std::min(bandTop + static_cast<int>(header.tileHeight), height());
+        }
+        const uchar *tileRow = band.get() + std::size_t(next - bandTop) * header.tileStride;
+        for (int tileX = 0; tileX < header.tilesX(); tileX++, tileRow += header.tileBytes()) {
+            int x = tileX * header.tileWidth;
+            std::memcpy(rows + x, tileRow, std::min<int>(header.tileWidth, width() - x) * sizeof(QRgb));
+        }
+    }
+    return true;
+}
+
+TiledImageWriter::TiledImageWriter(const std::string &path, int width, int height, bool alpha, int tileWidth, int tileHeight)
+    : file(nullptr), header(width, height, alpha, tileWidth, tileHeight), bandRows(0), bandTop(0) {
+    if (!header.isValid()) {
+        return;
+    }
+    file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    std::vector<char> head(header.dataOffset, 0);
+    std::memcpy(head.data(), &header, sizeof(header));
+    if (std::fwrite(head.data(), 1, head.size(), file) != head.size()) {
+        std::fclose(file);
+        file = nullptr;
+        return;
+    }
+    band = BufferPool::instance().acquire(header.tilesX() * header.tileBytes());
+}
+
+TiledImageWriter::~TiledImageWriter() {
+    if (file) {
+        std::fclose(file);
+    }
+}
+
+bool TiledImageWriter::flush() {
+    // Padding of the edge tiles is left zero
+    std::size_t bandBytes = header.tilesX() * header.tileBytes();
+    if (std::fwrite(band.get(), 1, bandBytes, file) != bandBytes) {
+        return false;
+    }
+    bandTop += bandRows;
+    bandRows = 0;
+    return true;
+}
+
+bool TiledImageWriter::write(const QRgb *rows, int count, int stride) {
+    if (!file || bandTop + bandRows + count > static_cast<int>(header.height)) {
+        return false;
+    }
+    int width = static_cast<int>(header.width);
+    for (int row = 0; row < count; row++, rows += stride) {
+        if (bandRows == 0) {
+            std::memset(band.get(), 0, header.tilesX() * header.tileBytes());
+        }
+        uchar *tileRow = band.get() + std::size_t(bandRows) * header.tileStride;
+        for (int tileX = 0; tileX < header.tilesX(); tileX++, tileRow += header.tileBytes()) {
+            int x = tileX * header.tileWidth;
+            std::memcpy(tileRow, rows + x, std::min<int>(header.tileWidth, width - x) * sizeof(QRgb));
+        }
+        if (++bandRows == static_cast<int>(header.tileHeight) && !flush()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TiledImageWriter::finish() {
+    if (!file || (bandRows > 0 && !flush()) || bandTop != static_cast<int>(header.height)) {
+        return false;
+    }
+    return std::fflush(file) == 0;
+}
+
+// Mapping of the whole file, the file stays open until the mapping is released
+static std::shared_ptr<uchar> mapFile(const std::shared_ptr<QFile> &file, QFileDevice::MemoryMapFlags flags) {
+    uchar *address = file->map(0, file->size(), flags);
+    if (!address) {
+        return nullptr;
+    }
+    return std::shared_ptr<uchar>(address, [file](uchar *mapped) { file->unmap(mapped); });
+}
+
+MappedTiledImage::MappedTiledImage() {}
+
+MappedTiledImage MappedTiledImage::open(const std::string &path) {
+    MappedTiledImage mapped;
+    std::shared_ptr<QFile> file = std::make_shared<QFile>(QString::fromStdString(path));
+    if (!file->open(QFile::ReadOnly) || file->size() < static_cast<int64_t>(sizeof(TiledImageHeader))) {
+        return mapped;
+    }
+    std::shared_ptr<uchar> bytes = mapFile(file, QFileDevice::MapPrivateOption);
+    if (!bytes) {
+        return mapped;
+    }
+    std::memcpy(&mapped.header, bytes.get(), sizeof(TiledImageHeader));
+    if (mapped.header.isValid() && static_cast<uint64_t>(file->size()) >= mapped.header.fileBytes()) {
+        mapped.bytes = bytes;
+    }
+    return mapped;
+}
+
+MappedTiledImage MappedTiledImage::create(const std::string &path, int width, int height, bool alpha, int tileWidth, int tileHeight) {
+    MappedTiledImage mapped;
+    TiledImageHeader header(width, height, alpha, tileWidth > 0 ? tileWidth : width, tileHeight);
+    if (!header.isValid()) {
+        return mapped;
+    }
+    std::shared_ptr<QFile> file = std::make_shared<QFile>(QString::fromStdString(path));
+    if (!file->open(QFile::ReadWrite | QFile::Truncate) || !file->resize(static_cast<int64_t>(header.fileBytes()))) {
+        return mapped;
+    }
+    std::shared_ptr<uchar> bytes = mapFile(file, QFileDevice::NoOptions);
+    if (!bytes) {
+        return mapped;
+    }
+    std::memcpy(bytes.get(), &header, sizeof(TiledImageHeader));
+    mapped.bytes = bytes;
+    mapped.header = header;
+    return mapped;
+}
+
+bool MappedTiledImage::save(const std::string &path, const QImage &img) {
+    if (img.isNull()) {
+        return false;
+    }
+    ImageBuffer pixels = ImageBuffer::wrap(img);
+    MappedTiledImage mapped = create(path, pixels.width(), pixels.height(), pixels.hasAlpha());
+    if (mapped.isNull()) {
+        return false;
+    }
+    mapped.store(pixels);
+    return true;
+}
+
+QImage MappedTiledImage::load(const std::string &path) {
+    MappedTiledImage mapped = open(path);
+    return mapped.isNull() ? QImage() : mapped.image().toQImage();
+}
+
+ImageBuffer MappedTiledImage::tile(int tileX, int tileY) const {
+    if (isNull() || tileX < 0 || tileX >= header.tilesX() || tileY < 0 || tileY >= header.tilesY()) throw std::out_of_range("MappedTiledImage: no such tile");
+    int x = tileX * header.tileWidth, y = tileY * header.tileHeight;
+    int width = std::min<int>(header.tileWidth, header.width - x), height = std::min<int>(header.tileHeight, header.height - y);
+    std::shared_ptr<uchar> pixels(bytes, bytes.get() + header.tileOffset(tileX, tileY));
+    return ImageBuffer::wrap(pixels, width, height, header.tileStride, header.format == 1);
+}
+
+ImageBuffer MappedTiledImage::image() const {
+    if (isNull()) {
+        return ImageBuffer();
+    }
+    // In a single column the tiles follow each other, and so do their rows
+    if (isRowAligned()) {
+        std::shared_ptr<uchar> pixels(bytes, bytes.get() + header.dataOffset);
+        return ImageBuffer::wrap(pixels, header.width, header.height, header.tileStride, header.format == 1);
+    }
+
+    ImageBuffer result(header.width, header.height, ImageBuffer::Layout::Interleaved, ImageBuffer::Sample::UInt8, header.format == 1);
+    for (int tileY = 0; tileY < header.tilesY(); tileY++) {
+        for (int tileX = 0; tileX < header.tilesX(); tileX++) {
+            ImageBuffer source = tile(tileX, tileY);
+            for (int row = 0; row < source.height(); row++) {
+                std::memcpy(result.line(tileY * header.tileHeight + row) + tileX * header.tileWidth, source.constLine(row), source.width() * sizeof(QRgb));
+            }
+        }
+    }
+    return result;
+}
+
+void MappedTiledImage::store(const ImageBuffer &img) {
+    if (isNull() || img.width() != static_cast<int>(header.width) || img.height() != static_cast<int>(header.height) || img.layout() != ImageBuffer::Layout::Interleaved) throw std::invalid_argument("MappedTiledImage: image does not match the file");
+    for (int tileY = 0; tileY < header.tilesY(); tileY++) {
+        for (int tileX = 0; tileX < header.tilesX(); tileX++) {
+            ImageBuffer target = tile(tileX, tileY);
+            for (int row = 0; row < target.height(); row++) {
+                std::memcpy(target.line(row), img.constLine(tileY * header.tileHeight + row) + tileX * header.tileWidth, target.width() * sizeof(QRgb));
+            }
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <QFile>
+#include <QImage>
+#include "imagebuffer.h"
+#include "imageio.h"
+
+// Raw 32 bit pixels cut into fixed size tiles, so a region of a huge image is found without decoding anything.
+// The header is followed by padding up to dataOffset, then by the tiles row after row. Every tile has the same
+// size, edge tiles being padded, and its rows are tileStride bytes apart. A single column of tiles as wide as
+// the image is the row-aligned layout. Values are stored in the byte order of the machine, as QRgb is.
+struct TiledImageHeader {
+    static const char magic[8];
+    static const int defaultTileWidth = 256, defaultTileHeight = 64;
+    // The tiles start on a page, so in a mapped file their rows keep the alignment of ImageBuffer rows
+    static const int pageBytes = 4096;
+
+    char signature[8];
+    uint32_t width, height, tileWidth, tileHeight;
+    // 0 for RGB32, 1 for ARGB32
+    uint32_t format;
+    uint32_t tileStride;
+    uint64_t dataOffset;
+
+    TiledImageHeader();
+    // Invalid when the image is empty
+    TiledImageHeader(int width, int height, bool alpha, int tileWidth = defaultTileWidth, int tileHeight = defaultTileHeight);
+    // False when the signature or sizes are wrong
+    bool isValid() const;
+    int tilesX() const { return static_cast<int>((width + tileWidth - 1) / tileWidth); }
+    int tilesY() const { return static_cast<int>((height + tileHeight - 1) / tileHeight); }
+    uint64_t tileBytes() const { return uint64_t(tileStride) * tileHeight; }
+    uint64_t tileOffset(int tileX, int tileY) const { return dataOffset + (uint64_t(tileY) * tilesX() + tileX) * tileBytes(); }
+    uint64_t fileBytes() const { return tileOffset(0, tilesY()); }
+};
+
+// Reads a row of tiles at a time, so memory is the width of the image times the tile height
+class TiledImageReader : public ImageReader {
+protected:
+    FILE *file;
+    TiledImageHeader header;
+    std::shared_ptr<uchar> band;
+    // Image rows held in band, and the next row read() returns
+    int bandTop, bandBottom, next;
+
+public:
+    TiledImageReader(const std::string &path);
+    ~TiledImageReader() override;
+    TiledImageReader(const TiledImageReader &other) = delete;
+    TiledImageReader &operator=(const TiledImageReader &other) = delete;
+
+    bool isOpen() const { return file != nullptr; }
+    int width() const override { return static_cast<int>(header.width); }
+    int height() const override { return static_cast<int>(header.height); }
+    bool hasAlpha() const override { return header.format == 1; }
+    bool read(QRgb *rows, int count, int stride) override;
+};
+
+// Gathers a row of tiles before writing it out, the tiles of a row are next to each other in the file
+class TiledImageWriter : public ImageWriter {
+protected:
+    FILE *file;
+    TiledImageHeader header;
+    std::shared_ptr<uchar> band;
+    // Rows gathered in band so far, and the first image row of the band
+    int bandRows, bandTop;
+
+    bool flush();
+
+public:
+    TiledImageWriter(const std::string &path, int width, int height, bool alpha = false, int tileWidth = TiledImageHeader::defaultTileWidth, int tileHeight = TiledImageHeader::defaultTileHeight);
+    ~TiledImageWriter() override;
+    TiledImageWriter(const TiledImageWriter &other) = delete;
+    TiledImageWriter &operator=(const TiledImageWriter &other) = delete;
+
+    bool isOpen() const { return file != nullptr; }
+    bool write(const QRgb *rows, int count, int stride) override;
+    bool finish() override;
+};
+
+// A tiled image file mapped into memory. Tiles are ImageBuffers over the mapped pages, and so is the whole
+// image in the row-aligned layout, so reading one back costs the page faults of the rows actually touched
+// and nothing is encoded or decoded. Buffers keep the mapping alive after the MappedTiledImage is gone.
+class MappedTiledImage {
+protected:
+    // Start of the mapping, the header. The last reference unmaps the file.
+    std::shared_ptr<uchar> bytes;
+    TiledImageHeader header;
+
+public:
+    MappedTiledImage();
+    // Maps an existing file. Pages are copied on write, so buffers of it can be changed without changing the file.
+    static MappedTiledImage open(const std::string &path);
+    // Creates the file, of a column of tiles as wide as the image unless tileWidth is given, and maps it for writing
+    static MappedTiledImage create(const std::string &path, int width, int height, bool alpha = false, int tileWidth = 0, int tileHeight = TiledImageHeader::defaultTileHeight);
+    // Writes img to path in the row-aligned layout, and reads it back over the mapped pages
+    static bool save(const std::string &path, const QImage &img);
+    static QImage load(const std::string &path);
+
+    bool isNull() const { return !bytes; }
+    const TiledImageHeader &info() const { return header; }
+    bool isRowAligned() const { return header.tilesX() == 1; }
+    // The pixels of a tile, edge tiles without their padding
+    ImageBuffer tile(int tileX, int tileY) const;
+    // The whole image, over the mapped pages when row-aligned and gathered from the tiles otherwise
+    ImageBuffer image() const;
+    // Copies img, of the image's size, into the tiles
+    void store(const ImageBuffer &img);
+};
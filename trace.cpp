@@ -0,0 +1,255 @@
+#include "trace.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+struct Trace::Span {
+    Span *parent;
+    std::string name, path;
+    const void *owner;
+    int thread, threads, depth;
+    int64_t start, pixels;
+    // Opened on the parent's thread outside its bands, whose time the parent spent waiting on this span
+    bool inlined;
+    // Summed over the span's bands, and over its own allocations and those of the spans nested in it
+    std::atomic<int64_t> busy, bytes;
+    // Wall and busy time of the spans nested inline
+    std::atomic<int64_t> nestedWall, nestedBusy;
+};
+
+namespace {
+
+// A closed span or band, times in nanoseconds since enable()
+struct Event {
+    std::string name, path;
+    int thread, threads, depth;
+    int64_t start, duration, pixels, bytes, busy;
+    bool band;
+};
+
+std::chrono::steady_clock::time_point origin;
+std::mutex eventMutex;
+std::vector<Event> events;
+std::atomic<int> threadCount(0);
+thread_local Trace::Span *current = nullptr;
+// Span of the band running on this thread
+thread_local Trace::Span *band = nullptr;
+thread_local int threadIndex = -1;
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+// Threads are numbered in the order they first record something, the one calling enable() is 0
+int currentThread() {
+    if (threadIndex < 0) {
+        threadIndex = threadCount++;
+    }
+    return threadIndex;
+}
+
+std::string typeName(const std::type_info &type) {
+#ifdef __GNUG__
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+    if (status == 0 && demangled) {
+        std::string name(demangled);
+        std::free(demangled);
+        return name;
+    }
+#endif
+    // MSVC names are already readable, as "class Opening"
+    std::string name = type.name();
+    std::size_t space = name.rfind(' ');
+    return space == std::string::npos ? name : name.substr(space + 1);
+}
+
+void record(Event event) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    events.push_back(std::move(event));
+}
+
+std::string escape(const std::string &text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+}
+
+std::atomic<bool> Trace::enabled(false);
+
+void Trace::enable() {
+    origin = std::chrono::steady_clock::now();
+    currentThread();
+    enabled = true;
+}
+
+Trace::Span *Trace::open(const char *name, const std::type_info *type, const void *owner, int64_t pixels, bool &owned) {
+    Span *parent = current;
+    if (owner && parent && parent->owner == owner) {
+        owned = false;
+        return parent;
+    }
+
+    Span *span = new Span;
+    span->parent = parent;
+    span->name = type ? typeName(*type) : name;
+    span->path = parent ? parent->path + " > " + span->name : span->name;
+    span->owner = owner;
+    span->thread = currentThread();
+    span->threads = static_cast<int>(ThreadPool::instance().getThreadCount());
+    span->depth = parent ? parent->depth + 1 : 0;
+    span->pixels = pixels;
+    span->inlined = parent && parent != band && parent->thread == span->thread;
+    span->busy = 0;
+    span->bytes = 0;
+    span->nestedWall = 0;
+    span->nestedBusy = 0;
+    span->start = now();
+    current = span;
+    owned = true;
+    return span;
+}
+
+void Trace::close(Span *span) {
+    int64_t duration = now() - span->start;
+    // A span without bands did its work on its own thread, but for the spans nested in it
+    int64_t busy = span->busy ? span->busy.load() : duration - span->nestedWall + span->nestedBusy;
+    current = span->parent;
+    if (span->parent) {
+        span->parent->bytes += span->bytes;
+        if (span->inlined) {
+            span->parent->nestedWall += duration;
+            span->parent->nestedBusy += busy;
+        }
+    }
+    record({span->name, span->path, span->thread, span->threads, span->depth, span->start, duration, span->pixels, span->bytes, busy, false});
+    delete span;
+}
+
+int64_t Trace::beginBand(Span *span, Span *previous[2]) {
+    previous[0] = current;
+    previous[1] = band;
+    current = band = span;
+    return now();
+}
+
+void Trace::endBand(Span *span, Span *const previous[2], int64_t start) {
+    int64_t duration = now() - start;
+    span->busy += duration;
+    current = previous[0];
+    band = previous[1];
+    record({span->name, span->path, currentThread(), span->threads, span->depth + 1, start, duration, 0, 0, duration, true});
+}
+
+void Trace::countAllocation(std::size_t bytes) {
+    if (current) {
+        current->bytes += static_cast<int64_t>(bytes);
+    }
+}
+
+bool Trace::save(const std::string &path) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    std::ofstream out(path);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    char line[512];
+    for (int thread = 0; thread < threadCount; thread++) {
+        std::snprintf(line, sizeof(line), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}},\n", thread, thread);
+        out << line;
+    }
+    for (std::size_t i = 0; i < events.size(); i++) {
+        const Event &event = events[i];
+        std::snprintf(line, sizeof(line), "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", escape(event.name).c_str(),
+                      event.band ? "band" : "span", event.thread, event.start * 1e-3, event.duration * 1e-3);
+        out << line;
+        if (!event.band) {
+            double seconds = event.duration * 1e-9;
+            std::snprintf(line, sizeof(line), ",\"args\":{\"pixels\":%lld,\"MPix/s\":%.2f,\"bytes\":%lld,\"busy\":%.3f}", static_cast<long long>(event.pixels),
+                          seconds > 0 ? event.pixels * 1e-6 / seconds : 0., static_cast<long long>(event.bytes),
+                          event.duration > 0 ? double(event.busy) / (double(event.duration) * event.threads) : 0.);
+            out << line;
+        }
+        out << (i + 1 < events.size() ? "},\n" : "}\n");
+    }
+    out << "]}\n";
+    return bool(out);
+}
+
+void Trace::report(std::ostream &out) {
+    struct Row {
+        std::string name, parent;
+        int depth, calls;
+        int64_t first, nanoseconds, pixels, bytes, busy;
+        // Thread time the pool offered meanwhile
+        double capacity;
+    };
+    std::vector<Row> rows;
+    {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        std::map<std::string, std::size_t> index;
+        for (const Event &event : events) {
+            if (event.band) {
+                continue;
+            }
+            auto found = index.find(event.path);
+            if (found == index.end()) {
+                found = index.emplace(event.path, rows.size()).first;
+                std::size_t separator = event.path.rfind(" > ");
+                std::string parent = separator == std::string::npos ? std::string() : event.path.substr(0, separator);
+                rows.push_back({event.name, parent, event.depth, 0, event.start, 0, 0, 0, 0, 0});
+            }
+            Row &row = rows[found->second];
+            row.calls++;
+            row.first = std::min(row.first, event.start);
+            row.nanoseconds += event.duration;
+            row.pixels += event.pixels;
+            row.bytes += event.bytes;
+            row.busy += event.busy;
+            row.capacity += double(event.duration) * event.threads;
+        }
+    }
+    // Spans in the order of their first call, each followed by the ones nested in it
+    std::stable_sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) { return a.first < b.first; });
+    std::vector<const Row *> ordered;
+    std::function<void(const std::string &)> children = [&](const std::string &parent) {
+        for (const Row &row : rows) {
+            std::string path = row.parent.empty() ? row.name : row.parent + " > " + row.name;
+            if (row.parent == parent) {
+                ordered.push_back(&row);
+                children(path);
+            }
+        }
+    };
+    children(std::string());
+
+    int nameWidth = 4;
+    for (const Row *row : ordered) {
+        nameWidth = std::max(nameWidth, static_cast<int>(2 * row->depth + row->name.size()));
+    }
+    char line[512];
+    std::snprintf(line, sizeof(line), "%-*s %7s %10s %10s %9s %9s %6s\n", nameWidth, "span", "calls", "ms", "MPix", "MPix/s", "MB", "busy");
+    out << line;
+    for (const Row *row : ordered) {
+        std::string name = std::string(2 * row->depth, ' ') + row->name;
+        double seconds = row->nanoseconds * 1e-9;
+        std::snprintf(line, sizeof(line), "%-*s %7d %10.2f %10.2f %9.1f %9.1f %5.0f%%\n", nameWidth, name.c_str(), row->calls, row->nanoseconds * 1e-6, row->pixels * 1e-6,
+                      seconds > 0 ? row->pixels * 1e-6 / seconds : 0., row->bytes / 1048576., row->capacity > 0 ? 100 * row->busy / row->capacity : 0.);
+        out << line;
+    }
+}
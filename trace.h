@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <typeinfo>
+
+// Timeline of the filters a run went through. Spans are opened around process() and the graph's stages and
+// nest in the span open on their thread, bands are the parts of a span's work the pool threads took. Each span
+// records its wall time, pixels, the image buffer bytes acquired under it and how busy the pool was meanwhile.
+// Nothing is recorded until enable() is called, until then a span is a single relaxed load and a branch, so
+// the spans stay compiled in.
+class Trace {
+public:
+    struct Span;
+
+protected:
+    static std::atomic<bool> enabled;
+
+    static Span *open(const char *name, const std::type_info *type, const void *owner, int64_t pixels, bool &owned);
+    static void close(Span *span);
+    // previous keeps the span and the band the thread was in
+    static int64_t beginBand(Span *span, Span *previous[2]);
+    static void endBand(Span *span, Span *const previous[2], int64_t start);
+    static void countAllocation(std::size_t bytes);
+
+    friend class TraceSpan;
+    friend class TraceBand;
+
+public:
+    // Starts recording, timestamps count from here
+    static void enable();
+    static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+    // Called for every image buffer acquired, counted in the span open on the calling thread
+    static void allocated(std::size_t bytes) {
+        if (isEnabled()) {
+            countAllocation(bytes);
+        }
+    }
+    // Every span and band recorded so far as Chrome trace_event JSON (chrome://tracing, Perfetto)
+    static bool save(const std::string &path);
+    // Per span, nested ones indented under their parent: calls, wall time, megapixels, throughput, megabytes
+    // acquired and how busy the pool threads were
+    static void report(std::ostream &out);
+};
+
+// Span for the lifetime of the object. One opened for the object of the span it would nest in is not recorded
+// again, so a process() override handing the image to the base class's shows once.
+class TraceSpan {
+protected:
+    // The span recorded, or the one this would have nested in when it was not recorded
+    Trace::Span *span;
+    bool owned;
+
+    friend class TraceBand;
+
+public:
+    explicit TraceSpan(const char *name, int64_t pixels = 0) : span(nullptr), owned(false) {
+        if (Trace::isEnabled()) {
+            span = Trace::open(name, nullptr, nullptr, pixels, owned);
+        }
+    }
+    // Named after the dynamic type of owner
+    template <typename T>
+    TraceSpan(const T *owner, int64_t pixels) : span(nullptr), owned(false) {
+        if (Trace::isEnabled()) {
+            span = Trace::open(nullptr, &typeid(*owner), owner, pixels, owned);
+        }
+    }
+    ~TraceSpan() {
+        if (owned) {
+            Trace::close(span);
+        }
+    }
+    TraceSpan(const TraceSpan &other) = delete;
+    TraceSpan &operator=(const TraceSpan &other) = delete;
+};
+
+// Work done for span by the calling thread, usually a pool task. Spans opened meanwhile nest in span.
+class TraceBand {
+protected:
+    Trace::Span *span, *previous[2];
+    int64_t start;
+
+public:
+    explicit TraceBand(const TraceSpan &owner) : span(owner.span), previous(), start(0) {
+        if (span) {
+            start = Trace::beginBand(span, previous);
+        }
+    }
+    ~TraceBand() {
+        if (span) {
+            Trace::endBand(span, previous, start);
+        }
+    }
+    TraceBand(const TraceBand &other) = delete;
+    TraceBand &operator=(const TraceBand &other) = delete;
+};
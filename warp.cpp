@@ -0,0 +1,135 @@
+#include "warp.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+static const QRgb outside = qRgb(0, 0, 0);
+static const int fractionBits = 32;
+
+static const QRgb *constRow(const ImageBuffer &img, int y) {
+    return img.constLine(y);
+}
+
+static int64_t toFixed(double value) {
+    return std::llround(std::ldexp(value, fractionBits));
+}
+
+// Integer part rounded toward zero, as an int conversion of the position would
+static int64_t truncated(int64_t position) {
+    return position >= 0 ? position >> fractionBits : -((-position) >> fractionBits);
+}
+
+static float fraction(int64_t position) {
+    return std::ldexp(static_cast<float>(position & ((int64_t(1) << fractionBits) - 1)), -fractionBits);
+}
+
+static int roundChannel(float value) {
+    return std::min(std::max(static_cast<int>(value + 0.5f), 0), 255);
+}
+
+static QRgb bilinear(const ImageBuffer &img, int64_t u, int64_t v) {
+    int x0 = static_cast<int>(u >> fractionBits), y0 = static_cast<int>(v >> fractionBits);
+    int x1 = std::min(x0 + 1, img.width() - 1), y1 = std::min(y0 + 1, img.height() - 1);
+    float fx = fraction(u), fy = fraction(v);
+    const QRgb *top = constRow(img, y0), *bottom = constRow(img, y1);
+    QRgb taps[4] = {top[x0], top[x1], bottom[x0], bottom[x1]};
+    float weights[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+
+    float red = 0, green = 0, blue = 0, alpha = 0;
+    for (int k = 0; k < 4; k++) {
+        red += weights[k] * qRed(taps[k]);
+        green += weights[k] * qGreen(taps[k]);
+        blue += weights[k] * qBlue(taps[k]);
+        alpha += weights[k] * qAlpha(taps[k]);
+    }
+    return qRgba(roundChannel(red), roundChannel(green), roundChannel(blue), roundChannel(alpha));
+}
+
+// Catmull-Rom weights of the taps at -1, 0, 1 and 2 for a position t past tap 0
+static void cubicWeights(float t, float weights[4]) {
+    weights[0] = ((-0.5f * t + 1.f) * t - 0.5f) * t;
+    weights[1] = (1.5f * t - 2.5f) * t * t + 1.f;
+    weights[2] = ((-1.5f * t + 2.f) * t + 0.5f) * t;
+    weights[3] = (0.5f * t - 0.5f) * t * t;
+}
+
+static QRgb bicubic(const ImageBuffer &img, int64_t u, int64_t v) {
+    int x0 = static_cast<int>(u >> fractionBits), y0 = static_cast<int>(v >> fractionBits);
+    float weightsX[4], weightsY[4];
+    cubicWeights(fraction(u), weightsX);
+    cubicWeights(fraction(v), weightsY);
+
+    int columns[4];
+    for (int k = 0; k < 4; k++) {
+        columns[k] = std::min(std::max(x0 + k - 1, 0), img.width() - 1);
+    }
+    float red = 0, green = 0, blue = 0, alpha = 0;
+    for (int i = 0; i < 4; i++) {
+        const QRgb *line = constRow(img, std::min(std::max(y0 + i - 1, 0), img.height() - 1));
+        for (int j = 0; j < 4; j++) {
+            float weight = weightsY[i] * weightsX[j];
+            QRgb color = line[columns[j]];
+            red += weight * qRed(color);
+            green += weight * qGreen(color);
+            blue += weight * qBlue(color);
+            alpha += weight * qAlpha(color);
+        }
+    }
+    return qRgba(roundChannel(red), roundChannel(green), roundChannel(blue), roundChannel(alpha));
+}
+
+void Warp::translateRow(const ImageBuffer &img, int y, int deltaX, int deltaY, QRgb *result) {
+    int width = img.width();
+    int sourceY = y + deltaY;
+    if (sourceY < 0 || sourceY >= img.height()) {
+        std::fill(result, result + width, outside);
+        return;
+    }
+
+    // Output pixels [begin, end) have a source pixel
+    int begin = std::min(std::max(-deltaX, 0), width), end = std::max(std::min(width - deltaX, width), begin);
+    std::fill(result, result + begin, outside);
+    std::memcpy(result + begin, constRow(img, sourceY) + begin + deltaX, std::size_t(end - begin) * sizeof(QRgb));
+    std::fill(result + end, result + width, outside);
+}
+
+void Warp::remapRow(const ImageBuffer &img, int sourceY, const int *sourceX, QRgb *result) {
+    int width = img.width();
+    if (sourceY < 0 || sourceY >= img.height()) {
+        std::fill(result, result + width, outside);
+        return;
+    }
+
+    const QRgb *line = constRow(img, sourceY);
+    for (int x = 0; x < width; x++) {
+        result[x] = sourceX[x] >= 0 && sourceX[x] < width ? line[sourceX[x]] : outside;
+    }
+}
+
+void Warp::affineRow(const ImageBuffer &img, const AffineMap &map, int y, Interpolation interpolation, QRgb *result) {
+    int width = img.width(), height = img.height();
+    int64_t u = toFixed(map.xy * y + map.x0), v = toFixed(map.yy * y + map.y0);
+    int64_t stepU = toFixed(map.xx), stepV = toFixed(map.yx);
+
+    if (interpolation == Interpolation::Nearest) {
+        for (int x = 0; x < width; x++, u += stepU, v += stepV) {
+            int64_t sourceX = truncated(u), sourceY = truncated(v);
+            if (sourceX >= 0 && sourceX < width && sourceY >= 0 && sourceY < height) {
+                result[x] = constRow(img, static_cast<int>(sourceY))[sourceX];
+            } else {
+                result[x] = outside;
+            }
+        }
+        return;
+    }
+
+    int64_t lastU = int64_t(width - 1) << fractionBits, lastV = int64_t(height - 1) << fractionBits;
+    for (int x = 0; x < width; x++, u += stepU, v += stepV) {
+        if (u < 0 || u > lastU || v < 0 || v > lastV) {
+            result[x] = outside;
+        } else {
+            result[x] = interpolation == Interpolation::Bilinear ? bilinear(img, u, v) : bicubic(img, u, v);
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "imagebuffer.h"
+
+enum class Interpolation { Nearest, Bilinear, Bicubic };
+
+// Inverse mapping of output pixel (x, y) to the source position (xx * x + xy * y + x0, yx * x + yy * y + y0)
+struct AffineMap {
+    double xx, xy, x0, yx, yy, y0;
+};
+
+// Row kernels of the geometric filters. Output pixels whose source position falls outside the image are opaque
+// black. Nearest sampling copies the source pixel as it is and truncates positions toward zero, like the plain
+// int conversions the filters always used; the interpolating modes blend all four channels, alpha included.
+class Warp {
+public:
+    // Source row y + deltaY shifted left by deltaX, one block copy
+    static void translateRow(const ImageBuffer &img, int y, int deltaX, int deltaY, QRgb *result);
+    // Pixel x is source pixel sourceX[x] of row sourceY
+    static void remapRow(const ImageBuffer &img, int sourceY, const int *sourceX, QRgb *result);
+    // The source position is stepped along the row in 32.32 fixed point, no multiplication per pixel
+    static void affineRow(const ImageBuffer &img, const AffineMap &map, int y, Interpolation interpolation, QRgb *result);
+};